@@ -0,0 +1,719 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "spawn.h"
+#include "async.h"
+
+/* Blocking calls run on a pool of worker threads.  A coroutine which makes
+ * one submits a job and yields; the worker performs the call and moves the
+ * job to the completion queue, writing to a pipe to wake the Lua side; then
+ * ex.async.run() resumes the coroutine with the results.  Only the thread
+ * running Lua touches the Lua state: the arguments a worker uses are plain
+ * C data, or strings kept alive by the job's anchor table in the registry.
+ * Called outside a coroutine, the functions simply run the call inline.
+ *
+ * The workers serve every Lua state in the process, but each state has
+ * its own completion queue and pipe, in a userdata in its registry; closing
+ * a state waits for its own jobs, and the last one stops the workers. */
+
+enum {
+  OP_STAT, OP_OPEN, OP_READ, OP_WRITE, OP_FSYNC, OP_DIR, OP_MKDIR,
+  OP_REMOVE, OP_SPAWN
+};
+
+/* The completions of one Lua state. */
+struct async_state {
+  struct async_task *done, **done_tail;
+  int notify[2];
+  int pending;          /* jobs submitted and not yet resumed */
+  int running;          /* jobs submitted and not yet completed */
+};
+
+struct job {
+  struct async_task task;
+  struct async_state *as;
+  int op;
+  int err;              /* errno, or 0 */
+  const char *path;
+  int fd, flags;
+  off_t offset;         /* -1 for the current position */
+  size_t len;
+  const char *data;     /* for writes */
+  char *buf;            /* for reads and dir listings, owned by the job */
+  ssize_t result;
+  struct stat st;
+  struct spawn_params *spawn;
+  int ref;              /* anchor table: {co, args...} */
+  int top;              /* the number of anchored args */
+};
+
+#define ASYNC_WORKERS 4
+#define ASYNC_MAXWORKERS 64
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+static struct async_task *queue, **queue_tail = &queue;
+static pthread_t workers[ASYNC_MAXWORKERS];
+static int nworkers, maxworkers = ASYNC_WORKERS, stopping;
+static int busy;        /* tasks queued or running */
+static int states;      /* Lua states which opened the module */
+
+extern int push_error(lua_State *L);
+extern FILE *check_file(lua_State *L, int idx, const char *argname);
+extern FILE **new_file(lua_State *L, int fd, const char *mode);
+extern struct spawn_params *ex_spawn_params(lua_State *L);
+
+/* Runs a job; called on a worker thread, or inline. */
+static void job_run(struct job *j)
+{
+  ssize_t n = 0;
+  switch (j->op) {
+  case OP_STAT:
+    n = stat(j->path, &j->st);
+    break;
+  case OP_OPEN:
+    n = open(j->path, j->flags | O_CLOEXEC, 0666);
+    break;
+  case OP_READ:
+    if (!(j->buf = malloc(j->len ? j->len : 1))) {
+      errno = ENOMEM;
+      n = -1;
+      break;
+    }
+    do n = j->offset < 0 ? read(j->fd, j->buf, j->len)
+                         : pread(j->fd, j->buf, j->len, j->offset);
+    while (n == -1 && errno == EINTR);
+    break;
+  case OP_WRITE: {
+    size_t off = 0;
+    while (off < j->len) {
+      n = j->offset < 0 ? write(j->fd, j->data + off, j->len - off)
+                        : pwrite(j->fd, j->data + off, j->len - off,
+                                 j->offset + off);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n == -1)
+        break;
+      off += n;
+    }
+    if (off == j->len)
+      n = off;
+    break;
+  }
+  case OP_FSYNC:
+    n = fsync(j->fd);
+    break;
+  case OP_DIR: {
+    /* names, each NUL-terminated, in one buffer */
+    DIR *d = opendir(j->path);
+    struct dirent *e;
+    size_t size = 0;
+    n = -1;
+    if (!d)
+      break;
+    j->len = 0;
+    while ((e = readdir(d))) {
+      size_t len = strlen(e->d_name) + 1;
+      if (e->d_name[0] == '.' && (!e->d_name[1]
+          || (e->d_name[1] == '.' && !e->d_name[2])))
+        continue;
+      if (j->len + len > size) {
+        char *buf = realloc(j->buf, size = 2 * size + len + 1024);
+        if (!buf) {
+          errno = ENOMEM;
+          break;
+        }
+        j->buf = buf;
+      }
+      memcpy(j->buf + j->len, e->d_name, len);
+      j->len += len;
+    }
+    if (!e)
+      n = 0;
+    closedir(d);
+    break;
+  }
+  case OP_MKDIR:
+    n = mkdir(j->path, 0777);
+    break;
+  case OP_REMOVE:
+    n = remove(j->path);
+    break;
+  case OP_SPAWN:
+    if ((j->err = spawn_param_launch(j->spawn)) > 0)
+      n = -1, errno = j->err;
+    break;
+  }
+  j->result = n;
+  j->err = n == -1 ? errno : 0;
+}
+
+/* Runs a job on a worker thread and queues it for ex.async.run() in the
+ * state which submitted it. */
+static void job_task(struct async_task *t)
+{
+  struct async_state *as = ((struct job *)t)->as;
+  job_run((struct job *)t);
+  pthread_mutex_lock(&lock);
+  t->next = 0;
+  if (!as->done) {
+    ssize_t ignored = write(as->notify[1], "", 1);
+    (void)ignored;
+  }
+  *as->done_tail = t;
+  as->done_tail = &t->next;
+  if (--as->running == 0)
+    pthread_cond_broadcast(&finished);
+  pthread_mutex_unlock(&lock);
+}
+
+static void *worker(void *arg)
+{
+  sigset_t all;
+  /* leave signals, SIGCHLD above all, to the thread running Lua */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, 0);
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    struct async_task *t;
+    while (!queue && !stopping)
+      pthread_cond_wait(&work, &lock);
+    if (!queue)
+      break;
+    t = queue;
+    if (!(queue = t->next))
+      queue_tail = &queue;
+    pthread_mutex_unlock(&lock);
+    t->run(t);
+    pthread_mutex_lock(&lock);
+    busy--;
+  }
+  pthread_mutex_unlock(&lock);
+  return arg;
+}
+
+/* Starts a worker if the busy tasks want one.  Returns -1 with errno set
+ * on failure.  Called with the lock held. */
+static int async_init(void)
+{
+  int err;
+  if (nworkers >= maxworkers || nworkers >= busy)
+    return 0;
+  if ((err = pthread_create(&workers[nworkers], 0, worker, 0))) {
+    if (nworkers > 0)
+      return 0;
+    errno = err;
+    return -1;
+  }
+  nworkers++;
+  return 0;
+}
+
+/* Queues t to run on a worker thread.  Returns -1 with errno set if no
+ * worker could be started. */
+int async_task_submit(struct async_task *t)
+{
+  pthread_mutex_lock(&lock);
+  busy++;
+  if (-1 == async_init()) {
+    busy--;
+    pthread_mutex_unlock(&lock);
+    return -1;
+  }
+  t->next = 0;
+  *queue_tail = t;
+  queue_tail = &t->next;
+  pthread_cond_signal(&work);
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+static struct async_state *async_state(lua_State *L)
+{
+  struct async_state *as;
+  lua_getfield(L, LUA_REGISTRYINDEX, "ex.async");
+  as = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return as;
+}
+
+/* Makes the state's notification pipe on first use.  Returns -1 with errno
+ * set on failure. */
+static int notify_init(struct async_state *as)
+{
+  int i;
+  if (as->notify[0] == -1) {
+    if (-1 == pipe(as->notify))
+      return -1;
+    for (i = 0; i < 2; i++) {
+      fcntl(as->notify[i], F_SETFD, FD_CLOEXEC);
+      fcntl(as->notify[i], F_SETFL, O_NONBLOCK);
+    }
+  }
+  return 0;
+}
+
+/* ... -- (yields)
+ * Submits the job from a coroutine, anchoring the values on the stack, or
+ * runs it inline on the main thread.  Returns -1 in the latter case. */
+static int submit(lua_State *L, struct job *j)
+{
+  struct async_state *as = async_state(L);
+  int i, n = lua_gettop(L);
+  if (lua_pushthread(L) || -1 == notify_init(as)) {
+    lua_pop(L, 1);
+    job_run(j);
+    return -1;
+  }
+  lua_createtable(L, n + 1, 0);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, 1);
+  for (i = 1; i <= n; i++) {
+    lua_pushvalue(L, i);
+    lua_rawseti(L, -2, i + 1);
+  }
+  j->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  j->top = n;
+  j->task.run = job_task;
+  j->as = as;
+  pthread_mutex_lock(&lock);
+  as->running++;
+  pthread_mutex_unlock(&lock);
+  if (-1 == async_task_submit(&j->task)) {
+    pthread_mutex_lock(&lock);
+    as->running--;
+    pthread_mutex_unlock(&lock);
+    luaL_unref(L, LUA_REGISTRYINDEX, j->ref);
+    j->ref = LUA_NOREF;
+    job_run(j);
+    return -1;
+  }
+  as->pending++;
+  return 0;
+}
+
+/* Pushes a table like that of os.dirent() for st. */
+void push_stat(lua_State *L, const struct stat *st)
+{
+  lua_createtable(L, 0, 6);
+  if (S_ISDIR(st->st_mode))
+    lua_pushliteral(L, "directory");
+  else
+    lua_pushliteral(L, "file");
+  lua_setfield(L, -2, "type");
+  lua_pushnumber(L, st->st_size);
+  lua_setfield(L, -2, "size");
+  lua_pushnumber(L, st->st_mode & 07777);
+  lua_setfield(L, -2, "mode");
+  lua_pushnumber(L, st->st_mtime);
+  lua_setfield(L, -2, "mtime");
+  lua_pushnumber(L, st->st_ino);
+  lua_setfield(L, -2, "ino");
+  lua_pushnumber(L, st->st_nlink);
+  lua_setfield(L, -2, "nlink");
+}
+
+/* Pushes the results of a finished job and returns their number.  Frees the
+ * job.  L is the thread which made the call. */
+static int job_results(lua_State *L, struct job *j)
+{
+  int n = 1;
+  if (j->op == OP_SPAWN) {
+    /* the proc is on top of the stack, or the last anchored value */
+    if (j->ref != LUA_NOREF) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, j->ref);
+      lua_rawgeti(L, -1, j->top + 1);
+      lua_replace(L, -2);
+    }
+    errno = j->err;
+    n = spawn_param_finish(j->spawn, j->err);
+  }
+  else if (j->result == -1) {
+    errno = j->err;
+    n = push_error(L);
+  }
+  else switch (j->op) {
+  case OP_STAT:
+    push_stat(L, &j->st);
+    break;
+  case OP_OPEN:
+    /* the file takes the environment of ex.async.open, as io.pipe */
+    if (!*new_file(L, j->result, j->flags & O_WRONLY ? "w"
+                                 : j->flags & O_RDWR ? "r+" : "r")) {
+      close(j->result);
+      n = push_error(L);
+    }
+    break;
+  case OP_READ:
+    if (j->result == 0 && j->len > 0)
+      lua_pushnil(L);
+    else
+      lua_pushlstring(L, j->buf, j->result);
+    break;
+  case OP_WRITE:
+    lua_pushnumber(L, j->result);
+    break;
+  case OP_DIR: {
+    size_t off = 0;
+    int i = 0;
+    lua_newtable(L);
+    while (off < j->len) {
+      size_t len = strlen(j->buf + off);
+      lua_pushlstring(L, j->buf + off, len);
+      lua_rawseti(L, -2, ++i);
+      off += len + 1;
+    }
+    break;
+  }
+  default:
+    lua_pushboolean(L, 1);
+  }
+  free(j->buf);
+  free(j);
+  return n;
+}
+
+/* job -- results/(yields) */
+static int finish_or_yield(lua_State *L, struct job *j)
+{
+  if (submit(L, j) == -1)
+    return job_results(L, j);
+  return lua_yield(L, 0);
+}
+
+static struct job *new_job(lua_State *L, int op)
+{
+  struct job *j = calloc(1, sizeof *j);
+  if (!j)
+    luaL_error(L, "not enough memory");
+  j->op = op;
+  j->offset = -1;
+  j->fd = -1;
+  j->ref = LUA_NOREF;
+  return j;
+}
+
+static int check_fd(lua_State *L, int idx)
+{
+  if (lua_type(L, idx) == LUA_TNUMBER)
+    return lua_tonumber(L, idx);
+  return fileno(check_file(L, idx, 0));
+}
+
+/* pathname -- entry/nil error */
+static int async_stat(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  struct job *j = new_job(L, OP_STAT);
+  j->path = path;
+  return finish_or_yield(L, j);
+}
+
+/* pathname [mode] -- file/nil error */
+static int async_openfile(lua_State *L)
+{
+  static const char *const modes[] = { "r", "w", "a", "r+", "w+", "a+", 0 };
+  static const int flags[] = {
+    O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_APPEND,
+    O_RDWR, O_RDWR | O_CREAT | O_TRUNC, O_RDWR | O_CREAT | O_APPEND
+  };
+  const char *path = luaL_checkstring(L, 1);
+  struct job *j;
+  int mode = luaL_checkoption(L, 2, "r", modes);
+  j = new_job(L, OP_OPEN);
+  j->path = path;
+  j->flags = flags[mode];
+  return finish_or_yield(L, j);
+}
+
+/* file-or-fd count [offset] -- data/nil/nil error */
+static int async_read(lua_State *L)
+{
+  int fd = check_fd(L, 1);
+  lua_Number len = luaL_checknumber(L, 2);
+  struct job *j;
+  luaL_argcheck(L, len >= 0, 2, "negative count");
+  j = new_job(L, OP_READ);
+  j->fd = fd;
+  j->len = len;
+  if (!lua_isnoneornil(L, 3))
+    j->offset = luaL_checknumber(L, 3);
+  return finish_or_yield(L, j);
+}
+
+/* file-or-fd data [offset] -- count/nil error */
+static int async_write(lua_State *L)
+{
+  int fd = check_fd(L, 1);
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+  struct job *j = new_job(L, OP_WRITE);
+  j->fd = fd;
+  j->data = data;
+  j->len = len;
+  if (!lua_isnoneornil(L, 3))
+    j->offset = luaL_checknumber(L, 3);
+  return finish_or_yield(L, j);
+}
+
+/* file-or-fd -- true/nil error */
+static int async_fsync(lua_State *L)
+{
+  int fd = check_fd(L, 1);
+  struct job *j = new_job(L, OP_FSYNC);
+  j->fd = fd;
+  return finish_or_yield(L, j);
+}
+
+/* pathname -- {name, ...}/nil error */
+static int async_dir(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  struct job *j = new_job(L, OP_DIR);
+  j->path = path;
+  return finish_or_yield(L, j);
+}
+
+/* pathname -- true/nil error */
+static int async_mkdir(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  struct job *j = new_job(L, OP_MKDIR);
+  j->path = path;
+  return finish_or_yield(L, j);
+}
+
+/* pathname -- true/nil error */
+static int async_remove(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  struct job *j = new_job(L, OP_REMOVE);
+  j->path = path;
+  return finish_or_yield(L, j);
+}
+
+/* as os.spawn -- proc/nil error */
+static int async_spawn(lua_State *L)
+{
+  struct spawn_params *p = ex_spawn_params(L);
+  struct job *j;
+  int n = spawn_param_prepare(p);
+  if (n != 1)
+    return n;
+  j = new_job(L, OP_SPAWN);
+  j->spawn = p;
+  return finish_or_yield(L, j);
+}
+
+/* Puts completions back at the head of the done list, as when a resumed
+ * coroutine raises before the rest of those taken were resumed. */
+static void requeue(struct async_state *as, struct async_task *list)
+{
+  struct async_task **tail = &list;
+  while (*tail)
+    tail = &(*tail)->next;
+  if (!list)
+    return;
+  pthread_mutex_lock(&lock);
+  if (!as->done) {
+    ssize_t ignored = write(as->notify[1], "", 1);
+    (void)ignored;
+    as->done_tail = tail;
+  }
+  *tail = as->done;
+  as->done = list;
+  pthread_mutex_unlock(&lock);
+}
+
+/* [timeout] -- count/nil error
+ * Waits up to timeout seconds (default: until one arrives, if any job is
+ * pending) for completions and resumes their coroutines. */
+static int async_run(lua_State *L)
+{
+  struct async_state *as = async_state(L);
+  struct async_task *list;
+  struct job *j;
+  int count = 0;
+  double deadline = -1;
+  if (!lua_isnoneornil(L, 1))
+    deadline = monotime() + luaL_checknumber(L, 1);
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    list = as->done;
+    as->done = 0;
+    as->done_tail = &as->done;
+    pthread_mutex_unlock(&lock);
+    if (list || !as->pending || (deadline >= 0 && remaining_ms(deadline) == 0))
+      break;
+    {
+      struct pollfd pfd;
+      pfd.fd = as->notify[0];
+      pfd.events = POLLIN;
+      if (-1 == poll(&pfd, 1, remaining_ms(deadline)) && errno != EINTR)
+        return push_error(L);
+    }
+  }
+  if (as->notify[0] != -1) {
+    char buf[64];
+    while (read(as->notify[0], buf, sizeof buf) > 0)
+      ;
+  }
+  while ((j = (struct job *)list)) {
+    lua_State *co;
+    int nres, status;
+    list = j->task.next;
+    as->pending--;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, j->ref);  /* anchors */
+    lua_rawgeti(L, -1, 1);                      /* anchors co */
+    co = lua_tothread(L, -1);
+    nres = job_results(co, j);
+    luaL_unref(L, LUA_REGISTRYINDEX, j->ref);
+    status = lua_resume(co, nres);
+    lua_pop(L, 2);
+    if (status != 0 && status != LUA_YIELD) {
+      requeue(as, list);
+      lua_xmove(co, L, 1);
+      return lua_error(L);
+    }
+    count++;
+  }
+  lua_pushnumber(L, count);
+  return 1;
+}
+
+/* -- fd
+ * A descriptor which is readable while completions are waiting, for use
+ * with ex.loop or another poller. */
+static int async_fd(lua_State *L)
+{
+  struct async_state *as = async_state(L);
+  if (-1 == notify_init(as))
+    return push_error(L);
+  lua_pushnumber(L, as->notify[0]);
+  return 1;
+}
+
+/* -- count */
+static int async_pending(lua_State *L)
+{
+  lua_pushnumber(L, async_state(L)->pending);
+  return 1;
+}
+
+/* n -- previous */
+static int async_workers(lua_State *L)
+{
+  int prev = maxworkers;
+  if (!lua_isnoneornil(L, 1)) {
+    int n = luaL_checknumber(L, 1);
+    luaL_argcheck(L, n >= 1 && n <= ASYNC_MAXWORKERS, 1, "out of range");
+    maxworkers = n;
+  }
+  lua_pushnumber(L, prev);
+  return 1;
+}
+
+/* Waits for the state's jobs when it is closed, and stops the workers
+ * with the last state, before the code they run can be unloaded. */
+static int async_gc(lua_State *L)
+{
+  struct async_state *as = lua_touserdata(L, 1);
+  struct job *j;
+  int i, last;
+  pthread_mutex_lock(&lock);
+  while (as->running > 0)
+    pthread_cond_wait(&finished, &lock);
+  if ((last = --states == 0)) {
+    stopping = 1;
+    pthread_cond_broadcast(&work);
+  }
+  pthread_mutex_unlock(&lock);
+  while ((j = (struct job *)as->done)) {
+    as->done = j->task.next;
+    free(j->buf);
+    free(j);
+  }
+  for (i = 0; i < 2; i++)
+    if (as->notify[i] != -1)
+      close(as->notify[i]);
+  if (last) {
+    for (i = 0; i < nworkers; i++)
+      pthread_join(workers[i], 0);
+    nworkers = 0;
+    stopping = 0;
+  }
+  return 0;
+}
+
+/* ex -- ex */
+int async_open(lua_State *L)
+{
+  struct async_state *as;
+  const luaL_reg functions[] = {
+    {"stat",     async_stat},
+    {"open",     async_openfile},
+    {"read",     async_read},
+    {"write",    async_write},
+    {"fsync",    async_fsync},
+    {"dir",      async_dir},
+    {"mkdir",    async_mkdir},
+    {"remove",   async_remove},
+    {"spawn",    async_spawn},
+    {"run",      async_run},
+    {"fd",       async_fd},
+    {"pending",  async_pending},
+    {"workers",  async_workers},
+    {0,0} };
+  lua_newtable(L);                            /* ex A */
+  luaL_register(L, 0, functions);             /* ex A */
+  lua_getglobal(L, "io");                     /* ex A io */
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -2, "open");              /* ex A io async_open */
+    lua_getfield(L, -2, "open");              /* ex A io async_open io_open */
+    lua_getfenv(L, -1);                       /* ex A io async_open io_open E */
+    lua_setfenv(L, -3);                       /* ex A io async_open io_open */
+    lua_pop(L, 2);                            /* ex A io */
+  }
+  lua_pop(L, 1);                              /* ex A */
+  as = lua_newuserdata(L, sizeof *as);        /* ex A state */
+  as->done = 0;
+  as->done_tail = &as->done;
+  as->notify[0] = as->notify[1] = -1;
+  as->pending = as->running = 0;
+  lua_createtable(L, 0, 1);                   /* ex A state M */
+  lua_pushcfunction(L, async_gc);             /* ex A state M gc */
+  lua_setfield(L, -2, "__gc");                /* ex A state M */
+  lua_setmetatable(L, -2);                    /* ex A state */
+  lua_setfield(L, LUA_REGISTRYINDEX, "ex.async"); /* ex A */
+  pthread_mutex_lock(&lock);
+  states++;
+  pthread_mutex_unlock(&lock);
+  lua_setfield(L, -2, "async");               /* ex */
+  return 0;
+}
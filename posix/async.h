@@ -0,0 +1,20 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include "lua.h"
+
+/* A call to run on a worker thread of the ex.async pool. */
+struct async_task {
+  void (*run)(struct async_task *t);
+  struct async_task *next;
+};
+
+int async_task_submit(struct async_task *t);
+int async_open(lua_State *L);
+
+#endif/*ASYNC_H*/
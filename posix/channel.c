@@ -0,0 +1,349 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "channel.h"
+
+/* A channel carries messages over a pair of descriptors as frames: a
+ * 4-byte big-endian length followed by that many bytes, so that messages
+ * may hold any bytes.  Frames are sent with one writev for up to
+ * CHANNEL_FRAMES messages, and received through one reusable buffer, as
+ * ex.lines does, each message being copied once into its Lua string. */
+
+#define CHANNEL_HANDLE "ex.channel"
+#define CHANNEL_SIZE 65536              /* initial receive buffer */
+#define CHANNEL_MAX (64 << 20)          /* default largest frame */
+#define CHANNEL_FRAMES 64               /* frames per writev */
+
+struct channel {
+  int in, out;                  /* -1 if absent */
+  int eof;
+  int batch;                    /* frames per table, -1 for all, else 0 */
+  size_t max;
+  char *buf;
+  size_t size, start, end;
+};
+
+extern int push_error(lua_State *L);
+extern FILE *check_file(lua_State *L, int idx, const char *argname);
+
+static int opt_fd(lua_State *L, int idx)
+{
+  switch (lua_type(L, idx)) {
+  case LUA_TNONE:
+  case LUA_TNIL:
+    return -1;
+  case LUA_TNUMBER:
+    return lua_tonumber(L, idx);
+  default:
+    return fileno(check_file(L, idx, NULL));
+  }
+}
+
+static struct channel *checkchannel(lua_State *L, int idx)
+{
+  struct channel *c = luaL_checkudata(L, idx, CHANNEL_HANDLE);
+  if (!c->buf) luaL_error(L, "attempt to use a closed channel");
+  return c;
+}
+
+/* Waits for fd to become ready after EAGAIN. */
+static void channel_poll(int fd, short events)
+{
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = events;
+  poll(&pfd, 1, -1);
+}
+
+/* Writes all of iov, resuming after short writes.  Returns 0, or -1 with
+ * errno set. */
+static int channel_writev(int fd, struct iovec *iov, int n)
+{
+  while (n > 0) {
+    ssize_t w = writev(fd, iov, n);
+    if (w == -1) {
+      if (errno == EAGAIN)
+        channel_poll(fd, POLLOUT);
+      else if (errno != EINTR)
+        return -1;
+      continue;
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 0;
+}
+
+/* channel message/{message...} -- true/nil error */
+static int channel_send(lua_State *L)
+{
+  struct channel *c = checkchannel(L, 1);
+  unsigned char heads[CHANNEL_FRAMES][4];
+  struct iovec iov[2 * CHANNEL_FRAMES];
+  int i, n, count, table = lua_istable(L, 2);
+  if (c->out == -1)
+    return luaL_error(L, "channel has no output");
+  if (table)
+    count = lua_objlen(L, 2);
+  else {
+    luaL_checktype(L, 2, LUA_TSTRING);
+    count = 1;
+  }
+  for (i = 0; i < count; ) {
+    for (n = 0; n < CHANNEL_FRAMES && i < count; n++, i++) {
+      size_t len;
+      const char *s;
+      if (table) {
+        lua_rawgeti(L, 2, i + 1);
+        /* a number would be converted in this copy, not in the table */
+        if (lua_type(L, -1) != LUA_TSTRING)
+          return luaL_error(L, "message %d is not a string", i + 1);
+        s = lua_tolstring(L, -1, &len);
+        lua_pop(L, 1);        /* still referenced by the table */
+      }
+      else
+        s = lua_tolstring(L, 2, &len);
+      if (len > 0xffffffffu)
+        return luaL_error(L, "message %d too large", i + 1);
+      heads[n][0] = len >> 24;
+      heads[n][1] = len >> 16;
+      heads[n][2] = len >> 8;
+      heads[n][3] = len;
+      iov[2 * n].iov_base = heads[n];
+      iov[2 * n].iov_len = 4;
+      iov[2 * n + 1].iov_base = (void *)s;
+      iov[2 * n + 1].iov_len = len;
+    }
+    if (-1 == channel_writev(c->out, iov, 2 * n))
+      return push_error(L);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* Reads more data after the unconsumed part of the buffer, making room
+ * for at least need bytes.  With wait unset, reads only what is ready.
+ * Returns the number of bytes read, 0 at end of file, or -1 with errno
+ * set. */
+static ssize_t channel_fill(lua_State *L, struct channel *c, size_t need,
+                            int wait)
+{
+  ssize_t n;
+  if (c->start > 0) {
+    memmove(c->buf, c->buf + c->start, c->end - c->start);
+    c->end -= c->start;
+    c->start = 0;
+  }
+  if (need > c->size) {
+    size_t size = c->size;
+    char *buf;
+    while (size < need)
+      size *= 2;
+    if (!(buf = realloc(c->buf, size)))
+      return luaL_error(L, "not enough memory");
+    c->buf = buf;
+    c->size = size;
+  }
+  if (!wait) {
+    struct pollfd pfd;
+    pfd.fd = c->in;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) < 1)
+      return errno = EAGAIN, -1;
+  }
+  for (;;) {
+    n = read(c->in, c->buf + c->end, c->size - c->end);
+    if (n > 0) {
+      c->end += n;
+      return n;
+    }
+    if (n == 0) {
+      c->eof = 1;
+      return 0;
+    }
+    if (errno == EAGAIN && wait)
+      channel_poll(c->in, POLLIN);
+    else if (errno != EINTR)
+      return -1;
+  }
+}
+
+/* Pushes the next message, reading it if wait is set, else only if it is
+ * ready.  Returns 1, or 0 at end of input or if not ready, or -1 with an
+ * error message pushed. */
+static int channel_frame(lua_State *L, struct channel *c, int wait)
+{
+  for (;;) {
+    size_t have = c->end - c->start, len = 0;
+    ssize_t n;
+    if (have >= 4) {
+      unsigned char *p = (unsigned char *)c->buf + c->start;
+      len = (size_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+      if (len > c->max) {
+        lua_pushliteral(L, "frame too large");
+        return -1;
+      }
+      if (have >= 4 + len) {
+        lua_pushlstring(L, (char *)p + 4, len);
+        c->start += 4 + len;
+        return 1;
+      }
+    }
+    if (c->eof) {
+      if (have == 0)
+        return 0;
+      lua_pushliteral(L, "truncated frame");
+      return -1;
+    }
+    n = channel_fill(L, c, 4 + len, wait);
+    if (n == -1) {
+      if (errno == EAGAIN)
+        return 0;
+      lua_pushstring(L, strerror(errno));
+      return -1;
+    }
+  }
+}
+
+/* channel -- message/{message...}/nil [error] */
+static int channel_recv(lua_State *L)
+{
+  struct channel *c = checkchannel(L, 1);
+  int i = 0, ret;
+  if (c->in == -1)
+    return luaL_error(L, "channel has no input");
+  lua_settop(L, 1);
+  if (!c->batch)
+    ret = channel_frame(L, c, 1);
+  else {
+    lua_newtable(L);
+    /* wait for the first message, then take those which are ready */
+    while ((c->batch < 0 || i < c->batch)
+           && 1 == (ret = channel_frame(L, c, i == 0)))
+      lua_rawseti(L, 2, ++i);
+    if (i > 0) {
+      lua_settop(L, 2);         /* any error comes again on the next call */
+      return 1;
+    }
+  }
+  if (ret == 1)
+    return 1;
+  lua_pushnil(L);
+  if (ret == 0)
+    return 1;
+  lua_insert(L, -2);
+  return 2;
+}
+
+/* channel -- */
+static int channel_close(lua_State *L)
+{
+  struct channel *c = luaL_checkudata(L, 1, CHANNEL_HANDLE);
+  free(c->buf);
+  c->buf = 0;
+  c->in = c->out = -1;
+  return 0;
+}
+
+/* channel -- string */
+static int channel_tostring(lua_State *L)
+{
+  struct channel *c = luaL_checkudata(L, 1, CHANNEL_HANDLE);
+  if (c->buf)
+    lua_pushfstring(L, "channel (%d, %d)", c->in, c->out);
+  else
+    lua_pushliteral(L, "channel (closed)");
+  return 1;
+}
+
+/* in out [options] -- channel */
+static int ex_channel(lua_State *L)
+{
+  struct channel *c;
+  size_t size = CHANNEL_SIZE, max = CHANNEL_MAX;
+  int in = opt_fd(L, 1), out = opt_fd(L, 2), batch = 0;
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "size");
+    size = luaL_optnumber(L, -1, size);
+    lua_getfield(L, 3, "max");
+    max = luaL_optnumber(L, -1, max);
+    lua_getfield(L, 3, "batch");
+    if (lua_isboolean(L, -1))
+      batch = lua_toboolean(L, -1) ? -1 : 0;
+    else if ((batch = luaL_optnumber(L, -1, 0)) < 0)
+      batch = 0;
+    lua_pop(L, 3);
+  }
+  if (size < 4096)
+    size = 4096;
+  lua_settop(L, 2);
+  c = lua_newuserdata(L, sizeof *c);
+  c->in = in;
+  c->out = out;
+  c->eof = 0;
+  c->batch = batch;
+  c->max = max;
+  c->start = c->end = 0;
+  c->size = size;
+  c->buf = malloc(size);
+  luaL_getmetatable(L, CHANNEL_HANDLE);
+  lua_setmetatable(L, -2);
+  if (!c->buf)
+    return luaL_error(L, "not enough memory");
+  /* keep the files open for as long as the channel lives */
+  lua_createtable(L, 2, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, 2);
+  lua_setfenv(L, -2);
+  return 1;
+}
+
+/* ex -- ex */
+int channel_open(lua_State *L)
+{
+  const luaL_reg methods[] = {
+    {"send",     channel_send},
+    {"recv",     channel_recv},
+    {"close",    channel_close},
+    {0,0} };
+  luaL_newmetatable(L, CHANNEL_HANDLE);       /* ex M */
+  lua_pushvalue(L, -1);                       /* ex M M */
+  lua_setfield(L, -2, "__index");             /* ex M */
+  luaL_register(L, 0, methods);               /* ex M */
+  lua_pushcfunction(L, channel_close);        /* ex M close */
+  lua_setfield(L, -2, "__gc");                /* ex M */
+  lua_pushcfunction(L, channel_tostring);     /* ex M tostring */
+  lua_setfield(L, -2, "__tostring");          /* ex M */
+  lua_pop(L, 1);                              /* ex */
+  lua_pushcfunction(L, ex_channel);           /* ex channel */
+  lua_setfield(L, -2, "channel");             /* ex */
+  return 0;
+}
@@ -0,0 +1,13 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include "lua.h"
+
+int channel_open(lua_State *L);
+
+#endif/*CHANNEL_H*/
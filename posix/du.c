@@ -0,0 +1,754 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#else
+/* for openat, fstatat and fdopendir */
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined __linux__ && defined STATX_BASIC_STATS
+#define DU_STATX 1
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+#ifndef AT_NO_AUTOMOUNT
+#define AT_NO_AUTOMOUNT 0
+#endif
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "du.h"
+
+/* os.du walks a tree on several threads, which take directories from a
+ * shared stack.  A directory is a node holding only its own name and a
+ * reference to its parent's node; its pathname is put together in a
+ * per-thread buffer when it is opened, and its entries are looked up
+ * relative to its descriptor, so a file costs one statx and no allocation.
+ * Each thread keeps one directory found to go on with and queues the
+ * others, in one locked step per directory.
+ *
+ * Files with several links are counted once, through a set of (device,
+ * inode) split into locked shards.  Totals per directory are added to the
+ * directory's group once it is read; totals by extension or owner are kept
+ * by each thread and merged at the end. */
+
+#define DU_THREADS 8            /* at least, as statx mostly waits */
+#define DU_MAXTHREADS 64
+#define DU_SHARDS 64
+#define DU_EXTMAX 15            /* longer suffixes are not extensions */
+#define DU_TALLIES 64
+
+enum { BY_NONE, BY_DIR, BY_EXT, BY_OWNER };
+
+struct du_sum {
+  unsigned long long bytes, files, dirs;
+};
+
+/* a directory reported with by="dir" */
+struct du_group {
+  struct du_group *next;
+  struct du_group *parent;
+  struct du_sum own;            /* added to atomically */
+  struct du_sum total;          /* with those below, at the end */
+  char path[1];
+};
+
+struct du_node {
+  struct du_node *parent;
+  struct du_node *next;         /* on the stack */
+  struct du_group *group;
+  int refs;                     /* itself, until read, and its children */
+  int depth;
+  int file;                     /* a root which is not a directory */
+  unsigned long uid;
+  unsigned long long bytes;     /* its own */
+  size_t namelen;
+  char name[1];
+};
+
+/* a total by extension or owner */
+struct du_tally {
+  unsigned long hash;
+  int used;
+  unsigned long uid;
+  struct du_sum sum;
+  char ext[DU_EXTMAX + 1];
+};
+
+struct du_link {
+  unsigned long long dev;       /* plus one; 0 for a free slot */
+  unsigned long long ino;
+};
+
+struct du_shard {
+  pthread_mutex_t lock;
+  struct du_link *links;
+  size_t mask, count;
+};
+
+struct du {
+  int by, depth, apparent;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct du_node *stack;        /* guarded by lock */
+  long pending;                 /* nodes queued or being read */
+  struct du_group *groups;      /* guarded by lock */
+  int failed;                   /* errno of a failed allocation */
+  struct du_shard shards[DU_SHARDS];
+};
+
+struct du_worker {
+  struct du *du;
+  pthread_t thread;
+  struct du_sum sum;
+  unsigned long errors;
+  struct du_tally *tallies;
+  size_t mask, count;
+  char path[PATH_MAX];
+};
+
+struct du_stat {
+  unsigned long long dev, ino, bytes;
+  unsigned long uid, nlink;
+  int dir;
+};
+
+extern int push_error(lua_State *L);
+
+static void du_fail(struct du *du, int err)
+{
+  __atomic_store_n(&du->failed, err, __ATOMIC_RELAXED);
+}
+
+/* Looks name up relative to dirfd.  Returns 0, or -1 with errno set. */
+static int du_stat(int dirfd, const char *name, int flags, int apparent,
+                   struct du_stat *s)
+{
+  struct stat st;
+#ifdef DU_STATX
+  static int no_statx;
+  struct statx stx;
+  if (!no_statx) {
+    if (0 == statx(dirfd, name, flags | AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC,
+                   STATX_TYPE | STATX_NLINK | STATX_UID | STATX_INO
+                   | STATX_SIZE | STATX_BLOCKS, &stx)) {
+      s->dev = (unsigned long long)stx.stx_dev_major << 32 | stx.stx_dev_minor;
+      s->ino = stx.stx_ino;
+      s->bytes = apparent ? stx.stx_size : stx.stx_blocks * 512;
+      s->uid = stx.stx_uid;
+      s->nlink = stx.stx_nlink;
+      s->dir = S_ISDIR(stx.stx_mode);
+      return 0;
+    }
+    if (errno != ENOSYS)
+      return -1;
+    no_statx = 1;
+  }
+#endif
+  if (-1 == fstatat(dirfd, name, &st, flags | AT_NO_AUTOMOUNT))
+    return -1;
+  s->dev = st.st_dev;
+  s->ino = st.st_ino;
+  s->bytes = apparent ? (unsigned long long)st.st_size
+                      : (unsigned long long)st.st_blocks * 512;
+  s->uid = st.st_uid;
+  s->nlink = st.st_nlink;
+  s->dir = S_ISDIR(st.st_mode);
+  return 0;
+}
+
+/* The length of the pathname of a node.  The root "/" is kept as an
+ * empty name. */
+static size_t du_pathlen(const struct du_node *n)
+{
+  size_t len = 0;
+  for (; n; n = n->parent)
+    len += n->namelen + (n->parent != 0);
+  return len ? len : 1;
+}
+
+/* Writes the pathname of a node into buf.  Returns its length, or -1 with
+ * errno set if it does not fit. */
+static int du_path(const struct du_node *n, char *buf, size_t size)
+{
+  const struct du_node *p;
+  size_t len = du_pathlen(n), pos;
+  if (len >= size) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if (n->namelen == 0 && !n->parent) {
+    strcpy(buf, "/");
+    return 1;
+  }
+  buf[pos = len] = '\0';
+  for (p = n; p; p = p->parent) {
+    pos -= p->namelen;
+    memcpy(buf + pos, p->name, p->namelen);
+    if (p->parent)
+      buf[--pos] = '/';
+  }
+  return len;
+}
+
+/* Adds a group for a node, named by its pathname.  Returns 0 with errno
+ * set on failure. */
+static struct du_group *du_group(struct du *du, struct du_node *n)
+{
+  struct du_group *g;
+  size_t len = du_pathlen(n);
+  if (!(g = calloc(1, offsetof(struct du_group, path) + len + 1)))
+    return 0;
+  du_path(n, g->path, len + 1);
+  g->parent = n->parent ? n->parent->group : 0;
+  pthread_mutex_lock(&du->lock);
+  g->next = du->groups;
+  du->groups = g;
+  pthread_mutex_unlock(&du->lock);
+  return g;
+}
+
+static struct du_node *du_node(struct du_node *parent, const char *name,
+                               size_t len, const struct du_stat *s)
+{
+  struct du_node *n = malloc(offsetof(struct du_node, name) + len + 1);
+  if (!n)
+    return 0;
+  n->parent = parent;
+  n->next = 0;
+  n->group = parent ? parent->group : 0;
+  n->refs = 1;
+  n->depth = parent ? parent->depth + 1 : 0;
+  n->file = !s->dir;
+  n->uid = s->uid;
+  n->bytes = s->bytes;
+  n->namelen = len;
+  memcpy(n->name, name, len);
+  n->name[len] = '\0';
+  if (parent)
+    __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+  return n;
+}
+
+/* Opens the directory of a node.  One whose pathname is too long to open
+ * is opened a name at a time, from the deepest ancestor whose pathname
+ * fits in the worker's buffer.  Returns a descriptor, or -1 with errno
+ * set. */
+static int du_open(struct du_worker *w, const struct du_node *n)
+{
+  const struct du_node *a = n, **down;
+  size_t len = du_pathlen(n);
+  int fd, next, err, i, k = 0;
+  while (len >= sizeof w->path) {
+    if (!a->parent) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    len -= a->namelen + 1;
+    a = a->parent;
+    k++;
+  }
+  du_path(a, w->path, sizeof w->path);
+  fd = open(w->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC
+                     | (a->parent ? O_NOFOLLOW : 0));
+  if (fd == -1 || k == 0)
+    return fd;
+  if (!(down = malloc(k * sizeof *down))) {
+    close(fd);
+    errno = ENOMEM;
+    return -1;
+  }
+  for (i = k; n != a; n = n->parent)
+    down[--i] = n;
+  for (i = 0; i < k && fd != -1; i++) {
+    next = openat(fd, down[i]->name,
+                  O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    err = errno;
+    close(fd);
+    errno = err;
+    fd = next;
+  }
+  free(down);
+  return fd;
+}
+
+/* Drops a reference to a node, freeing it and then its parents as they
+ * become unused. */
+static void du_release(struct du_node *n)
+{
+  while (n && 0 == __atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL)) {
+    struct du_node *p = n->parent;
+    free(n);
+    n = p;
+  }
+}
+
+static unsigned long du_link_hash(unsigned long long dev,
+                                  unsigned long long ino)
+{
+  return (unsigned long)(ino * 2654435761UL ^ dev);
+}
+
+/* Records a file with several links.  Returns 1 the first time its device
+ * and inode are seen, or if the set cannot grow. */
+static int du_link_first(struct du *du, const struct du_stat *s)
+{
+  unsigned long hash = du_link_hash(s->dev, s->ino);
+  struct du_shard *sh = &du->shards[hash % DU_SHARDS];
+  unsigned long long dev = s->dev + 1;
+  size_t i;
+  pthread_mutex_lock(&sh->lock);
+  if (2 * (sh->count + 1) > sh->mask + 1 || !sh->links) {
+    size_t size = sh->links ? 2 * (sh->mask + 1) : 256;
+    struct du_link *links = calloc(size, sizeof *links);
+    if (!links) {
+      pthread_mutex_unlock(&sh->lock);
+      return 1;
+    }
+    if (sh->links) {
+      for (i = 0; i <= sh->mask; i++) {
+        struct du_link *l = &sh->links[i];
+        size_t j;
+        if (!l->dev)
+          continue;
+        j = du_link_hash(l->dev - 1, l->ino) / DU_SHARDS;
+        for (j &= size - 1; links[j].dev; j = (j + 1) & (size - 1))
+          ;
+        links[j] = *l;
+      }
+      free(sh->links);
+    }
+    sh->links = links;
+    sh->mask = size - 1;
+  }
+  for (i = (hash / DU_SHARDS) & sh->mask; sh->links[i].dev;
+       i = (i + 1) & sh->mask)
+    if (sh->links[i].dev == dev && sh->links[i].ino == s->ino) {
+      pthread_mutex_unlock(&sh->lock);
+      return 0;
+    }
+  sh->links[i].dev = dev;
+  sh->links[i].ino = s->ino;
+  sh->count++;
+  pthread_mutex_unlock(&sh->lock);
+  return 1;
+}
+
+/* The extension of a file name: what follows its last '.', unless that is
+ * its first character. */
+static const char *du_ext(const char *name, size_t *len)
+{
+  const char *base = strrchr(name, '/'), *dot;
+  if (base)
+    name = base + 1;
+  dot = strrchr(name, '.');
+  if (!dot || dot == name || (*len = strlen(dot + 1)) > DU_EXTMAX) {
+    *len = 0;
+    return "";
+  }
+  return dot + 1;
+}
+
+/* Finds the worker's tally for an extension or an owner, adding it if
+ * needed.  Returns 0 if it cannot be added. */
+static struct du_tally *du_tally(struct du_worker *w, const char *ext,
+                                 size_t len, unsigned long uid)
+{
+  unsigned long hash = uid * 2654435761UL;
+  struct du_tally *t;
+  size_t i;
+  for (i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char)ext[i]) * 16777619UL;
+  if (2 * (w->count + 1) > w->mask + 1 || !w->tallies) {
+    size_t size = w->tallies ? 2 * (w->mask + 1) : DU_TALLIES;
+    struct du_tally *tallies = calloc(size, sizeof *tallies);
+    if (!tallies)
+      return 0;
+    for (i = 0; w->tallies && i <= w->mask; i++) {
+      size_t j;
+      if (!w->tallies[i].used)
+        continue;
+      for (j = w->tallies[i].hash & (size - 1); tallies[j].used;
+           j = (j + 1) & (size - 1))
+        ;
+      tallies[j] = w->tallies[i];
+    }
+    free(w->tallies);
+    w->tallies = tallies;
+    w->mask = size - 1;
+  }
+  for (i = hash & w->mask; (t = &w->tallies[i])->used; i = (i + 1) & w->mask)
+    if (t->hash == hash && t->uid == uid && 0 == strncmp(t->ext, ext, len)
+        && t->ext[len] == '\0')
+      return t;
+  t->used = 1;
+  t->hash = hash;
+  t->uid = uid;
+  memcpy(t->ext, ext, len);
+  t->ext[len] = '\0';
+  w->count++;
+  return t;
+}
+
+/* Adds bytes, files and directories to the tally for an extension or an
+ * owner. */
+static void du_count(struct du_worker *w, const char *name, unsigned long uid,
+                     unsigned long long bytes, int files, int dirs)
+{
+  struct du_tally *t;
+  size_t len = 0;
+  const char *ext = "";
+  if (w->du->by == BY_EXT) {
+    if (dirs)
+      return;
+    ext = du_ext(name, &len);
+    uid = 0;
+  }
+  if (!(t = du_tally(w, ext, len, uid))) {
+    du_fail(w->du, ENOMEM);
+    return;
+  }
+  t->sum.bytes += bytes;
+  t->sum.files += files;
+  t->sum.dirs += dirs;
+}
+
+/* Takes a directory from the stack, waiting while others are being read.
+ * Returns 0 once there are none left. */
+static struct du_node *du_pop(struct du *du)
+{
+  struct du_node *n;
+  pthread_mutex_lock(&du->lock);
+  while (!du->stack && du->pending > 0)
+    pthread_cond_wait(&du->cond, &du->lock);
+  if ((n = du->stack))
+    du->stack = n->next;
+  pthread_mutex_unlock(&du->lock);
+  return n;
+}
+
+/* Queues the directories first to last, count in all with the one kept,
+ * and accounts for the directory just read. */
+static void du_push(struct du *du, struct du_node *first,
+                    struct du_node *last, long count)
+{
+  pthread_mutex_lock(&du->lock);
+  if (first) {
+    last->next = du->stack;
+    du->stack = first;
+  }
+  du->pending += count - 1;
+  if (du->pending == 0 || (first && first != last))
+    pthread_cond_broadcast(&du->cond);
+  else if (first)
+    pthread_cond_signal(&du->cond);
+  pthread_mutex_unlock(&du->lock);
+}
+
+/* Reads a directory, counting its files and queueing its directories.
+ * Returns a directory found in it for the worker to go on with, or 0. */
+static struct du_node *du_read(struct du_worker *w, struct du_node *n)
+{
+  struct du *du = w->du;
+  struct du_node *keep = 0, *first = 0, *last = 0;
+  struct du_sum sum;
+  struct dirent *e;
+  struct du_stat s;
+  DIR *dir = 0;
+  long count = 0;
+  int fd = -1;
+  sum.bytes = n->bytes;
+  sum.files = n->file;
+  sum.dirs = !n->file;
+  if (du->by == BY_EXT || du->by == BY_OWNER)
+    du_count(w, n->name, n->uid, n->bytes, n->file, !n->file);
+  if (!n->file
+      && (-1 == (fd = du_open(w, n)) || !(dir = fdopendir(fd)))) {
+    if (fd != -1)
+      close(fd);
+    w->errors++;
+  }
+  while (dir && (e = readdir(dir))) {
+    const char *name = e->d_name;
+    if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+      continue;
+    if (-1 == du_stat(fd, name, AT_SYMLINK_NOFOLLOW, du->apparent, &s)) {
+      w->errors++;
+      continue;
+    }
+    if (s.dir) {
+      struct du_node *c = du_node(n, name, strlen(name), &s);
+      if (!c) {
+        du_fail(du, ENOMEM);
+        continue;
+      }
+      if (du->by == BY_DIR && c->depth <= du->depth
+          && !(c->group = du_group(du, c)))
+        du_fail(du, errno);
+      if (!keep)
+        keep = c;
+      else {
+        c->next = first;
+        first = c;
+        if (!last) last = c;
+      }
+      count++;
+      continue;
+    }
+    if (s.nlink > 1 && !du_link_first(du, &s))
+      continue;
+    sum.bytes += s.bytes;
+    sum.files++;
+    if (du->by == BY_EXT || du->by == BY_OWNER)
+      du_count(w, name, s.uid, s.bytes, 1, 0);
+  }
+  if (dir)
+    closedir(dir);
+  w->sum.bytes += sum.bytes;
+  w->sum.files += sum.files;
+  w->sum.dirs += sum.dirs;
+  if (n->group) {
+    __atomic_add_fetch(&n->group->own.bytes, sum.bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&n->group->own.files, sum.files, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&n->group->own.dirs, sum.dirs, __ATOMIC_RELAXED);
+  }
+  du_push(du, first, last, count);
+  du_release(n);
+  return keep;
+}
+
+static void du_work(struct du_worker *w)
+{
+  struct du_node *n = 0;
+  while (n || (n = du_pop(w->du)))
+    n = du_read(w, n);
+}
+
+static void *du_thread(void *arg)
+{
+  sigset_t all;
+  /* leave signals to the thread running Lua, as ex.async does */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, 0);
+  du_work(arg);
+  return 0;
+}
+
+/* Walks the tree from top, on up to nthreads threads including this one.
+ * Returns the number of threads used. */
+static int du_walk(struct du *du, struct du_worker *w, int nthreads,
+                   struct du_node *top)
+{
+  int i;
+  if (du->by == BY_DIR && du->depth >= 0
+      && !(top->group = du_group(du, top)))
+    du_fail(du, errno);
+  du->stack = top;
+  du->pending = 1;
+  for (i = 0; i < nthreads; i++)
+    w[i].du = du;
+  for (i = 1; i < nthreads; i++)
+    if (pthread_create(&w[i].thread, 0, du_thread, &w[i]))
+      break;
+  nthreads = i;
+  du_work(&w[0]);
+  for (i = 1; i < nthreads; i++)
+    pthread_join(w[i].thread, 0);
+  return nthreads;
+}
+
+/* Sets the bytes, files and dirs of the table on top, adding to them if
+ * add is set. */
+static void du_setsum(lua_State *L, const struct du_sum *s, int add)
+{
+  static const char *const keys[] = { "bytes", "files", "dirs" };
+  lua_Number v[3];
+  int i;
+  v[0] = s->bytes;
+  v[1] = s->files;
+  v[2] = s->dirs;
+  for (i = 0; i < 3; i++) {
+    if (add) {
+      lua_getfield(L, -1, keys[i]);
+      v[i] += lua_tonumber(L, -1);
+      lua_pop(L, 1);
+    }
+    lua_pushnumber(L, v[i]);
+    lua_setfield(L, -2, keys[i]);
+  }
+}
+
+/* groups -- groups */
+static void du_groups(lua_State *L, struct du *du, struct du_worker *w,
+                      int nworkers)
+{
+  struct du_group *g, *p;
+  int i;
+  size_t j;
+  if (du->by == BY_DIR) {
+    for (g = du->groups; g; g = g->next)
+      for (p = g; p; p = p->parent) {
+        p->total.bytes += g->own.bytes;
+        p->total.files += g->own.files;
+        p->total.dirs += g->own.dirs;
+      }
+    for (g = du->groups; g; g = g->next) {
+      lua_createtable(L, 0, 3);
+      du_setsum(L, &g->total, 0);
+      lua_setfield(L, -2, g->path);
+    }
+    return;
+  }
+  for (i = 0; i < nworkers; i++)
+    for (j = 0; w[i].tallies && j <= w[i].mask; j++) {
+      struct du_tally *t = &w[i].tallies[j];
+      if (!t->used)
+        continue;
+      if (du->by == BY_EXT)
+        lua_pushstring(L, t->ext);
+      else
+        lua_pushnumber(L, t->uid);
+      lua_pushvalue(L, -1);
+      lua_rawget(L, -3);                      /* groups key sum/nil */
+      if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 3);
+        du_setsum(L, &t->sum, 0);
+        lua_rawset(L, -3);
+      }
+      else {
+        du_setsum(L, &t->sum, 1);
+        lua_pop(L, 2);
+      }
+    }
+}
+
+static void du_free(struct du *du, struct du_worker *w, int nworkers)
+{
+  struct du_group *g;
+  int i;
+  while ((g = du->groups)) {
+    du->groups = g->next;
+    free(g);
+  }
+  for (i = 0; i < DU_SHARDS; i++) {
+    free(du->shards[i].links);
+    pthread_mutex_destroy(&du->shards[i].lock);
+  }
+  for (i = 0; i < nworkers; i++)
+    free(w[i].tallies);
+  free(w);
+  pthread_mutex_destroy(&du->lock);
+  pthread_cond_destroy(&du->cond);
+}
+
+/* root [options] -- summary/nil error */
+int ex_du(lua_State *L)
+{
+  static const char *const bys[] = { "dir", "ext", "owner", 0 };
+  const char *root = luaL_checkstring(L, 1);
+  struct du du;
+  struct du_worker *w;
+  struct du_node *top;
+  struct du_stat s;
+  struct du_sum sum;
+  unsigned long errors = 0;
+  size_t len;
+  int nthreads = 0, i;
+  memset(&du, 0, sizeof du);
+  du.depth = 1;
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "by");
+    if (!lua_isnil(L, -1)) {
+      const char *by = luaL_checkstring(L, -1);
+      for (i = 0; bys[i] && strcmp(by, bys[i]); i++)
+        ;
+      if (!bys[i])
+        return luaL_error(L, "bad by option (%s)", by);
+      du.by = BY_DIR + i;
+    }
+    lua_getfield(L, 2, "depth");
+    du.depth = luaL_optnumber(L, -1, 1);
+    lua_getfield(L, 2, "apparent");
+    du.apparent = lua_toboolean(L, -1);
+    lua_getfield(L, 2, "threads");
+    nthreads = luaL_optnumber(L, -1, 0);
+    lua_pop(L, 4);
+  }
+  if (nthreads < 1) {
+#ifdef _SC_NPROCESSORS_ONLN
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (nthreads < DU_THREADS)
+      nthreads = DU_THREADS;
+  }
+  if (nthreads > DU_MAXTHREADS)
+    nthreads = DU_MAXTHREADS;
+  if (-1 == du_stat(AT_FDCWD, root, 0, du.apparent, &s))
+    return push_error(L);
+  /* the root's name, without trailing slashes; "/" becomes "" */
+  for (len = strlen(root); len > 0 && root[len - 1] == '/'; len--)
+    ;
+  if (!(w = calloc(nthreads, sizeof *w))
+      || !(top = du_node(0, root, len, &s))) {
+    free(w);
+    return luaL_error(L, "not enough memory");
+  }
+  pthread_mutex_init(&du.lock, 0);
+  pthread_cond_init(&du.cond, 0);
+  for (i = 0; i < DU_SHARDS; i++)
+    pthread_mutex_init(&du.shards[i].lock, 0);
+  nthreads = du_walk(&du, w, nthreads, top);
+  if (du.failed) {
+    du_free(&du, w, nthreads);
+    errno = du.failed;
+    return push_error(L);
+  }
+  memset(&sum, 0, sizeof sum);
+  for (i = 0; i < nthreads; i++) {
+    sum.bytes += w[i].sum.bytes;
+    sum.files += w[i].sum.files;
+    sum.dirs += w[i].sum.dirs;
+    errors += w[i].errors;
+  }
+  lua_createtable(L, 0, 5);
+  du_setsum(L, &sum, 0);
+  lua_pushnumber(L, errors);
+  lua_setfield(L, -2, "errors");
+  if (du.by != BY_NONE) {
+    lua_newtable(L);
+    du_groups(L, &du, w, nthreads);
+    lua_setfield(L, -2, "groups");
+  }
+  du_free(&du, w, nthreads);
+  return 1;
+}
@@ -0,0 +1,13 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef DU_H
+#define DU_H
+
+#include "lua.h"
+
+int ex_du(lua_State *L);
+
+#endif/*DU_H*/
@@ -0,0 +1,373 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include "environ.h"
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "envsnap.h"
+
+/* The environment is read from an immutable snapshot, which env_set
+ * replaces under a lock with a modified copy.  Readers take no lock: each
+ * thread announces the snapshot it reads in a hazard slot of its own, on a
+ * cache line of its own, and a replaced snapshot is freed only once no slot
+ * holds it.  A reader which cannot have a slot pins every snapshot instead.
+ *
+ * Reads may nest, as when a finalizer run while pushing a value reads the
+ * environment again; an error raised during a read leaves its snapshot
+ * held until the thread exits.
+ *
+ * env_set mirrors each change into the process environment, under its
+ * lock, for io.popen and other C code; nothing here reads environ after
+ * the first snapshot, and spawning searches PATH in the snapshot, so the
+ * mirror is the only copy which another thread's os.setenv may change
+ * under a reader. */
+
+#define ENV_HAZARDS 4           /* nested reads per thread */
+#define CACHE_LINE 64
+
+struct env_snapshot {
+  struct env_snapshot *next;    /* once retired */
+  size_t count;
+  char **vars;                  /* NAME=value, in order, null-terminated */
+  char **sorted;                /* the same, by name */
+};
+
+struct env_slot {
+  const struct env_snapshot *hp[ENV_HAZARDS];
+  int depth;
+  int used;
+  struct env_slot *next;
+};
+
+#define SLOT_SIZE \
+  ((sizeof(struct env_slot) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1))
+
+static char *no_vars[1];
+static struct env_snapshot empty = { 0, 0, no_vars, no_vars };
+static struct env_snapshot *current = &empty;
+static struct env_snapshot *retired;
+static struct env_slot *slots;
+static int pinned;              /* readers without a hazard slot */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static int have_key;
+
+/* Compares NAME=value strings by name. */
+static int namecmp(const char *a, const char *b)
+{
+  for (; *a == *b && *a != '='; a++, b++)
+    ;
+  return (*a == '=' ? 0 : (unsigned char)*a)
+       - (*b == '=' ? 0 : (unsigned char)*b);
+}
+
+/* Compares a name of len bytes with the name of a NAME=value string. */
+static int keycmp(const char *name, size_t len, const char *var)
+{
+  size_t i;
+  for (i = 0; i < len && name[i] == var[i] && var[i] != '='; i++)
+    ;
+  if (i == len)
+    return var[i] == '=' ? 0 : -1;
+  return (unsigned char)name[i] - (var[i] == '=' ? 0 : (unsigned char)var[i]);
+}
+
+/* Orders pointers into vars by name, then by position, so that the first
+ * of each name comes first. */
+static int slotcmp(const void *a, const void *b)
+{
+  char **x = *(char **const *)a, **y = *(char **const *)b;
+  int c = namecmp(*x, *y);
+  return c ? c : x < y ? -1 : x > y;
+}
+
+/* Makes a snapshot of n strings, skipping those without a '=' and all but
+ * the first of each name.  Returns 0 with errno set on failure. */
+static struct env_snapshot *build(char *const *src, size_t n)
+{
+  struct env_snapshot *e;
+  char ***order;
+  char *s;
+  size_t i, j, k, bytes = 0;
+  for (i = 0; i < n; i++)
+    if (strchr(src[i], '='))
+      bytes += strlen(src[i]) + 1;
+  e = malloc(sizeof *e + 2 * (n + 1) * sizeof(char *) + bytes);
+  order = malloc((n + 1) * sizeof *order);
+  if (!e || !order) {
+    free(e);
+    free(order);
+    errno = ENOMEM;
+    return 0;
+  }
+  e->next = 0;
+  e->vars = (char **)(e + 1);
+  e->sorted = e->vars + n + 1;
+  s = (char *)(e->sorted + n + 1);
+  for (i = j = 0; i < n; i++) {
+    size_t len;
+    if (!strchr(src[i], '='))
+      continue;
+    len = strlen(src[i]) + 1;
+    memcpy(s, src[i], len);
+    e->vars[j] = s;
+    order[j] = &e->vars[j];
+    j++;
+    s += len;
+  }
+  qsort(order, j, sizeof *order, slotcmp);
+  for (i = k = 0; i < j; i++) {
+    if (k > 0 && 0 == namecmp(*order[i], e->sorted[k - 1]))
+      *order[i] = 0;            /* a later duplicate */
+    else
+      e->sorted[k++] = *order[i];
+  }
+  free(order);
+  for (i = k = 0; i < j; i++)
+    if (e->vars[i])
+      e->vars[k++] = e->vars[i];
+  e->vars[k] = e->sorted[k] = 0;
+  e->count = k;
+  return e;
+}
+
+static void slot_free(void *p)
+{
+  struct env_slot *s = p;
+  int i;
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < ENV_HAZARDS; i++)
+    __atomic_store_n(&s->hp[i], 0, __ATOMIC_RELEASE);
+  s->depth = 0;
+  s->used = 0;
+  pthread_mutex_unlock(&lock);
+}
+
+static void env_init(void)
+{
+  struct env_snapshot *e;
+  size_t n = 0;
+  while (environ[n]) n++;
+  if ((e = build(environ, n)))
+    current = e;
+  have_key = 0 == pthread_key_create(&key, slot_free);
+}
+
+/* Returns the calling thread's slot, or 0 if it cannot have one.  Slots of
+ * threads which have exited are reused. */
+static struct env_slot *env_slot(void)
+{
+  struct env_slot *s;
+  pthread_once(&once, env_init);
+  if (!have_key)
+    return 0;
+  if ((s = pthread_getspecific(key)))
+    return s;
+  pthread_mutex_lock(&lock);
+  for (s = slots; s && s->used; s = s->next)
+    ;
+  if (!s) {
+    void *p;
+    if (0 == posix_memalign(&p, CACHE_LINE, SLOT_SIZE)) {
+      s = p;
+      memset(s, 0, sizeof *s);
+      s->next = slots;
+      slots = s;
+    }
+  }
+  if (s) {
+    if (0 == pthread_setspecific(key, s))
+      s->used = 1;
+    else
+      s = 0;
+  }
+  pthread_mutex_unlock(&lock);
+  return s;
+}
+
+/* Returns the current snapshot, which stays valid until env_release. */
+const struct env_snapshot *env_acquire(void)
+{
+  struct env_slot *s = env_slot();
+  const struct env_snapshot *e, *again;
+  if (!s || s->depth >= ENV_HAZARDS) {
+    if (s) s->depth++;
+    __atomic_add_fetch(&pinned, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+  }
+  e = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+  for (;;) {
+    /* announce it, then check that it was not retired meanwhile */
+    __atomic_store_n(&s->hp[s->depth], e, __ATOMIC_SEQ_CST);
+    again = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+    if (again == e)
+      break;
+    e = again;
+  }
+  s->depth++;
+  return e;
+}
+
+/* Releases the snapshot of the latest env_acquire. */
+void env_release(void)
+{
+  struct env_slot *s = have_key ? pthread_getspecific(key) : 0;
+  if (!s || --s->depth >= ENV_HAZARDS)
+    __atomic_sub_fetch(&pinned, 1, __ATOMIC_SEQ_CST);
+  else
+    __atomic_store_n(&s->hp[s->depth], 0, __ATOMIC_RELEASE);
+}
+
+/* Returns the value of a name of len bytes, or 0 if it is unset. */
+const char *env_get(const struct env_snapshot *e, const char *name,
+                    size_t len)
+{
+  size_t lo = 0, hi = e->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int c = keycmp(name, len, e->sorted[mid]);
+    if (c == 0)
+      return e->sorted[mid] + len + 1;
+    if (c < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return 0;
+}
+
+/* Returns the NAME=value strings, null-terminated. */
+char *const *env_vars(const struct env_snapshot *e)
+{
+  return e->vars;
+}
+
+/* Frees the retired snapshots which no reader holds.  Called with the lock
+ * held, after the current snapshot was replaced. */
+static void reclaim(void)
+{
+  struct env_snapshot **p = &retired, *e;
+  struct env_slot *s;
+  int i, held;
+  if (__atomic_load_n(&pinned, __ATOMIC_SEQ_CST))
+    return;
+  while ((e = *p)) {
+    held = 0;
+    for (s = slots; s && !held; s = s->next)
+      for (i = 0; i < ENV_HAZARDS; i++)
+        if (__atomic_load_n(&s->hp[i], __ATOMIC_SEQ_CST) == e)
+          held = 1;
+    if (held)
+      p = &e->next;
+    else {
+      *p = e->next;
+      free(e);
+    }
+  }
+}
+
+/* Sets a variable, or unsets it if value is null.  Returns 0, or -1 with
+ * errno set. */
+int env_set(const char *name, const char *value)
+{
+  struct env_snapshot *old, *e = 0;
+  char **src, *var = 0;
+  size_t i, n = 0, len = strlen(name);
+  int found = 0, err;
+  if (len == 0 || strchr(name, '=')) {
+    errno = EINVAL;
+    return -1;
+  }
+  pthread_once(&once, env_init);
+  if (value) {
+    size_t vlen = strlen(value);
+    if (!(var = malloc(len + vlen + 2))) {
+      errno = ENOMEM;
+      return -1;
+    }
+    memcpy(var, name, len);
+    var[len] = '=';
+    memcpy(var + len + 1, value, vlen + 1);
+  }
+  pthread_mutex_lock(&lock);
+  old = current;
+  if ((src = malloc((old->count + 1) * sizeof *src))) {
+    for (i = 0; i < old->count; i++) {
+      if (0 != keycmp(name, len, old->vars[i]))
+        src[n++] = old->vars[i];
+      else if (var && !found++)
+        src[n++] = var;         /* keeps its place */
+    }
+    if (var && !found)
+      src[n++] = var;
+    e = build(src, n);
+    free(src);
+  }
+  free(var);
+  err = ENOMEM;
+  if (!e || -1 == (value ? setenv(name, value, 1) : unsetenv(name))) {
+    if (e) err = errno;
+    free(e);
+    pthread_mutex_unlock(&lock);
+    errno = err;
+    return -1;
+  }
+  __atomic_store_n(&current, e, __ATOMIC_SEQ_CST);
+  if (old != &empty) {
+    old->next = retired;
+    retired = old;
+  }
+  reclaim();
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+/* -- value
+ * Pushes the value of a name of len bytes, or returns 0, pushing nothing,
+ * if it is unset. */
+int env_push(lua_State *L, const char *name, size_t len)
+{
+  const char *v = env_get(env_acquire(), name, len);
+  if (v)
+    lua_pushstring(L, v);
+  env_release();
+  return v != 0;
+}
+
+/* -- vector
+ * Copies the environment into a userdata, for a process which may be
+ * started from another thread. */
+const char **env_copy(lua_State *L)
+{
+  const struct env_snapshot *e = env_acquire();
+  const char **v;
+  char *s;
+  size_t i, bytes = 0;
+  for (i = 0; i < e->count; i++)
+    bytes += strlen(e->vars[i]) + 1;
+  v = lua_newuserdata(L, (e->count + 1) * sizeof *v + bytes);
+  s = (char *)(v + e->count + 1);
+  for (i = 0; i < e->count; i++) {
+    size_t len = strlen(e->vars[i]) + 1;
+    memcpy(s, e->vars[i], len);
+    v[i] = s;
+    s += len;
+  }
+  v[i] = 0;
+  env_release();
+  return v;
+}
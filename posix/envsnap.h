@@ -0,0 +1,25 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef ENVSNAP_H
+#define ENVSNAP_H
+
+#include <stddef.h>
+#include "lua.h"
+
+struct env_snapshot;
+
+const struct env_snapshot *env_acquire(void);
+void env_release(void);
+const char *env_get(const struct env_snapshot *e, const char *name,
+                    size_t len);
+char *const *env_vars(const struct env_snapshot *e);
+int env_set(const char *name, const char *value);
+
+int env_push(lua_State *L, const char *name, size_t len);
+#define env_pushliteral(L, s) env_push(L, "" s, sizeof(s) - 1)
+const char **env_copy(lua_State *L);
+
+#endif/*ENVSNAP_H*/
@@ -3,6 +3,9 @@
  * http://lua-users.org/wiki/ExtensionProposal
  * Copyright 2007 Mark Edgar < medgar123 at gmail com >
  */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -13,9 +16,13 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <limits.h>
-
-#include "environ.h"
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #include "lua.h"
 #include "lualib.h"
@@ -24,6 +31,23 @@
 #define absindex(L,i) ((i)>0?(i):lua_gettop(L)+(i)+1)
 
 #include "spawn.h"
+#include "jobserver.h"
+#include "lines.h"
+#include "which.h"
+#include "procstats.h"
+#include "loop.h"
+#include "timers.h"
+#include "async.h"
+#include "ring.h"
+#include "watch.h"
+#include "statcache.h"
+#include "lockfile.h"
+#include "shmring.h"
+#include "fdpass.h"
+#include "channel.h"
+#include "expand.h"
+#include "envsnap.h"
+#include "du.h"
 
 /* -- nil error */
 extern int push_error(lua_State *L)
@@ -37,11 +61,10 @@ extern int push_error(lua_State *L)
 /* name -- value/nil */
 static int ex_getenv(lua_State *L)
 {
-  const char *nam = luaL_checkstring(L, 1);
-  char *val = getenv(nam);
-  if (!val)
+  size_t len;
+  const char *nam = luaL_checklstring(L, 1, &len);
+  if (!env_push(L, nam, len))
     return push_error(L);
-  lua_pushstring(L, val);
   return 1;
 }
 
@@ -51,8 +74,7 @@ static int ex_setenv(lua_State *L)
 {
   const char *nam = luaL_checkstring(L, 1);
   const char *val = lua_tostring(L, 2);
-  int err = val ? setenv(nam, val, 1) : unsetenv(nam);
-  if (err == -1) return push_error(L);
+  if (-1 == env_set(nam, val)) return push_error(L);
   lua_pushboolean(L, 1);
   return 1;
 }
@@ -61,14 +83,15 @@ static int ex_setenv(lua_State *L)
 static int ex_environ(lua_State *L)
 {
   const char *nam, *val, *end;
-  const char **env;
+  char *const *env;
   lua_newtable(L);
-  for (env = (const char **)environ; (nam = *env); env++) {
+  for (env = env_vars(env_acquire()); (nam = *env); env++) {
     end = strchr(val = strchr(nam, '=') + 1, '\0');
     lua_pushlstring(L, nam, val - nam - 1);
     lua_pushlstring(L, val, end - val);
     lua_settable(L, -3);
   }
+  env_release();
   return 1;
 }
 
@@ -106,7 +129,7 @@ static int ex_mkdir(lua_State *L)
 /* Lua os.remove provides the correct semantics on POSIX systems */
 
 
-static FILE *check_file(lua_State *L, int idx, const char *argname)
+FILE *check_file(lua_State *L, int idx, const char *argname)
 {
   FILE **pf;
   if (idx > 0) pf = luaL_checkudata(L, idx, LUA_FILEHANDLE);
@@ -123,7 +146,7 @@ static FILE *check_file(lua_State *L, int idx, const char *argname)
   return *pf;
 }
 
-static FILE **new_file(lua_State *L, int fd, const char *mode)
+FILE **new_file(lua_State *L, int fd, const char *mode)
 {
   FILE **pf = lua_newuserdata(L, sizeof *pf);
   *pf = 0;
@@ -136,6 +159,18 @@ static FILE **new_file(lua_State *L, int fd, const char *mode)
 
 #define new_dirent(L) lua_newtable(L)
 
+/* entry -- entry */
+static void set_dirent(lua_State *L, int idx, const struct stat *st)
+{
+  if (S_ISDIR(st->st_mode))
+    lua_pushliteral(L, "directory");
+  else
+    lua_pushliteral(L, "file");
+  lua_setfield(L, idx, "type");
+  lua_pushnumber(L, st->st_size);
+  lua_setfield(L, idx, "size");
+}
+
 /* pathname/file [entry] -- entry */
 static int ex_dirent(lua_State *L)
 {
@@ -144,7 +179,7 @@ static int ex_dirent(lua_State *L)
   default: return luaL_typerror(L, 1, "file or pathname");
   case LUA_TSTRING: {
     const char *name = lua_tostring(L, 1);
-    if (-1 == stat(name, &st))
+    if (-1 == statcache_stat(name, &st))
       return push_error(L);
     } break;
   case LUA_TUSERDATA: {
@@ -160,13 +195,33 @@ static int ex_dirent(lua_State *L)
   else {
     lua_settop(L, 2);
   }
-  if (S_ISDIR(st.st_mode))
-    lua_pushliteral(L, "directory");
-  else
-    lua_pushliteral(L, "file");
-  lua_setfield(L, 2, "type");
-  lua_pushnumber(L, st.st_size);
-  lua_setfield(L, 2, "size");
+  set_dirent(L, 2, &st);
+  return 1;
+}
+
+/* {pathname, ...} -- {entry/false, ...} */
+static int ex_dirents(lua_State *L)
+{
+  struct stat st;
+  int i, n;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = lua_objlen(L, 1);
+  lua_settop(L, 1);
+  lua_createtable(L, n, 0);                   /* list entries */
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);                     /* list entries pathname */
+    if (!lua_isstring(L, -1))
+      return luaL_error(L, "bad pathname %d (string expected, got %s)",
+                        i, luaL_typename(L, -1));
+    if (-1 == statcache_stat(lua_tostring(L, -1), &st))
+      lua_pushboolean(L, 0);
+    else {
+      new_dirent(L);
+      set_dirent(L, lua_gettop(L), &st);
+    }
+    lua_rawseti(L, 2, i);                     /* list entries pathname */
+    lua_pop(L, 1);                            /* list entries */
+  }
   return 1;
 }
 
@@ -253,21 +308,23 @@ static int ex_dir(lua_State *L)
 }
 
 
-static int file_lock(lua_State *L,
-                     FILE *f, const char *mode, long offset, long length)
+static int file_lock(lua_State *L, FILE *f, const char *mode,
+                     long offset, long length, double timeout)
 {
-  struct flock k;
+  int type;
   switch (*mode) {
-    case 'w': k.l_type = F_WRLCK; break;
-    case 'r': k.l_type = F_RDLCK; break;
-    case 'u': k.l_type = F_UNLCK; break;
+    case 'w': type = F_WRLCK; break;
+    case 'r': type = F_RDLCK; break;
+    case 'u': type = F_UNLCK; break;
     default: return luaL_error(L, "invalid mode");
   }
-  k.l_whence = SEEK_SET;
-  k.l_start = offset;
-  k.l_len = length;
-  if (-1 == fcntl(fileno(f), F_SETLK, &k))
-    return push_error(L);
+  if (-1 == lock_range(fileno(f), type, offset, length, timeout, 0)) {
+    if (errno != ETIMEDOUT)
+      return push_error(L);
+    lua_pushnil(L);
+    lua_pushliteral(L, "timeout");
+    return 2;
+  }
   /* return the file */
   lua_settop(L, 1);
   return 1;
@@ -280,15 +337,22 @@ static const char *opt_mode(lua_State *L, int *pidx)
   return lua_tostring(L, (*pidx)++);
 }
 
-/* file [mode] [offset [length]] -- file/nil error */
+/* file [mode] [offset [length]] [options] -- file/nil error */
 static int ex_lock(lua_State *L)
 {
   FILE *f = check_file(L, 1, NULL);
   int argi = 2;
-  const char *mode = opt_mode(L, &argi);
-  long offset = luaL_optnumber(L, argi, 0);
-  long length = luaL_optnumber(L, argi + 1, 0);
-  return file_lock(L, f, mode, offset, length);
+  const char *mode;
+  long offset, length;
+  double timeout = 0;
+  if (lua_gettop(L) > 1 && lua_istable(L, -1)) {
+    timeout = lock_timeout(L, lua_gettop(L), 0);
+    lua_pop(L, 1);
+  }
+  mode = opt_mode(L, &argi);
+  offset = luaL_optnumber(L, argi, 0);
+  length = luaL_optnumber(L, argi + 1, 0);
+  return file_lock(L, f, mode, offset, length, timeout);
 }
 
 
@@ -315,36 +379,347 @@ static int ex_pipe(lua_State *L)
 
 
 /* seconds --
- * interval units -- */
+ * interval units --
+ * Sleeps until a deadline on the monotonic clock, so that a signal handler
+ * which interrupts the sleep neither ends nor lengthens it. */
 static int ex_sleep(lua_State *L)
 {
   lua_Number interval = luaL_checknumber(L, 1);
   lua_Number units = luaL_optnumber(L, 2, 1);
-  usleep(1e6 * interval / units);
+  lua_Number seconds = interval / units;
+  struct timespec ts;
+  if (!(seconds > 0))
+    return 0;
+#if defined _POSIX_MONOTONIC_CLOCK && defined TIMER_ABSTIME
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  seconds += ts.tv_nsec / 1e9;
+  ts.tv_sec += (time_t)seconds;
+  ts.tv_nsec = (seconds - (time_t)seconds) * 1e9;
+  while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0))
+    ;
+#else
+  ts.tv_sec = (time_t)seconds;
+  ts.tv_nsec = (seconds - ts.tv_sec) * 1e9;
+  while (-1 == nanosleep(&ts, &ts) && errno == EINTR)
+    ;
+#endif
   return 0;
 }
 
+/* The monotonic clock when the module was first loaded; os.clock_ns()
+ * counts from it, so that its result stays exact in a double (below 2^53)
+ * for 104 days after rather than after boot. */
+static struct timespec clock_origin;
+static pthread_once_t clock_once = PTHREAD_ONCE_INIT;
 
+static void clock_init(void)
+{
+  clock_gettime(CLOCK_MONOTONIC, &clock_origin);
+}
+
+/* -- nanoseconds */
+static int ex_clock_ns(lua_State *L)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  lua_pushnumber(L, (double)((long long)(ts.tv_sec - clock_origin.tv_sec)
+                             * 1000000000 + (ts.tv_nsec - clock_origin.tv_nsec)));
+  return 1;
+}
+
+/* -- seconds */
+static int ex_monotonic(lua_State *L)
+{
+  lua_pushnumber(L, monotime());
+  return 1;
+}
+
+
+/* A file, or for stdin a string to feed the child, or for stdout and stderr
+ * "capture" (a pipe) or "memfd" (an anonymous file) to be collected by
+ * proc:communicate().  A stdin string stays in the options table, which the
+ * caller keeps on the stack until the spawn. */
 static void get_redirect(lua_State *L,
                          int idx, const char *stdname, struct spawn_params *p)
 {
   lua_getfield(L, idx, stdname);
-  if (!lua_isnil(L, -1))
+  if (lua_type(L, -1) == LUA_TSTRING) {
+    size_t len;
+    const char *s = lua_tolstring(L, -1, &len);
+    if (stdname[3] == 'i')
+      spawn_param_input(p, s, len);
+    else if (0 == strcmp(s, "capture"))
+      spawn_param_capture(p, stdname, CAPTURE_PIPE);
+    else if (0 == strcmp(s, "memfd"))
+      spawn_param_capture(p, stdname, CAPTURE_FILE);
+    else
+      luaL_error(L, "bad %s option ('capture' or 'memfd' expected, got '%s')",
+                 stdname, s);
+  }
+  else if (!lua_isnil(L, -1))
     spawn_param_redirect(p, stdname, fileno(check_file(L, -1, stdname)));
   lua_pop(L, 1);
 }
 
-/* filename [args-opts] -- proc/nil error */
-/* args-opts -- proc/nil error */
-static int ex_spawn(lua_State *L)
+static void get_pgroup(lua_State *L, int idx, struct spawn_params *p)
+{
+  lua_getfield(L, idx, "pgid");
+  switch (lua_type(L, -1)) {
+  default:
+    luaL_error(L, "bad pgid option (number or boolean expected, got %s)",
+               luaL_typename(L, -1));
+    break;
+  case LUA_TNIL:
+    break;
+  case LUA_TBOOLEAN:
+    if (lua_toboolean(L, -1))
+      spawn_param_pgroup(p, 0);
+    break;
+  case LUA_TNUMBER:
+    spawn_param_pgroup(p, lua_tonumber(L, -1));
+    break;
+  }
+  lua_pop(L, 1);
+}
+
+static const char *const rlimit_names[] = {
+  "as", "core", "cpu", "data", "fsize", "nofile", "stack",
+#ifdef RLIMIT_MEMLOCK
+  "memlock",
+#endif
+#ifdef RLIMIT_NPROC
+  "nproc",
+#endif
+#ifdef RLIMIT_RSS
+  "rss",
+#endif
+  0
+};
+static const int rlimit_resources[] = {
+  RLIMIT_AS, RLIMIT_CORE, RLIMIT_CPU, RLIMIT_DATA, RLIMIT_FSIZE,
+  RLIMIT_NOFILE, RLIMIT_STACK,
+#ifdef RLIMIT_MEMLOCK
+  RLIMIT_MEMLOCK,
+#endif
+#ifdef RLIMIT_NPROC
+  RLIMIT_NPROC,
+#endif
+#ifdef RLIMIT_RSS
+  RLIMIT_RSS,
+#endif
+};
+
+/* a number, with math.huge or "unlimited" for no limit */
+static rlim_t check_rlim(lua_State *L, int idx, const char *name)
+{
+  lua_Number n;
+  if (lua_type(L, idx) == LUA_TSTRING
+      && 0 == strcmp(lua_tostring(L, idx), "unlimited"))
+    return RLIM_INFINITY;
+  if (lua_type(L, idx) != LUA_TNUMBER)
+    luaL_error(L, "bad rlimits option %s (number expected, got %s)",
+               name, luaL_typename(L, idx));
+  n = lua_tonumber(L, idx);
+  if (n < 0)
+    luaL_error(L, "bad rlimits option %s (negative limit)", name);
+  return n >= (lua_Number)RLIM_INFINITY ? RLIM_INFINITY : (rlim_t)n;
+}
+
+/* rlimits={name=limit or {soft, hard}, ...} */
+static void get_rlimits(lua_State *L, int idx, struct spawn_params *p)
+{
+  int i;
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {                  /* ... k v */
+    const char *name = lua_tostring(L, -2);
+    rlim_t soft, hard;
+    for (i = 0; name && rlimit_names[i]; i++)
+      if (0 == strcmp(name, rlimit_names[i]))
+        break;
+    if (!name || !rlimit_names[i])
+      luaL_error(L, "bad rlimits option (unknown resource %s)",
+                 name ? name : luaL_typename(L, -2));
+    if (lua_istable(L, -1)) {
+      lua_rawgeti(L, -1, 1);
+      soft = check_rlim(L, -1, name);
+      lua_rawgeti(L, -2, 2);
+      hard = lua_isnil(L, -1) ? soft : check_rlim(L, -1, name);
+      lua_pop(L, 2);
+    }
+    else
+      soft = hard = check_rlim(L, -1, name);
+    if (-1 == spawn_param_rlimit(p, rlimit_resources[i], soft, hard))
+      luaL_error(L, "bad rlimits option (too many limits)");
+    lua_pop(L, 1);
+  }
+}
+
+static lua_Number opt_number(lua_State *L, const char *name)
+{
+  if (lua_type(L, -1) != LUA_TNUMBER)
+    luaL_error(L, "bad %s option (number expected, got %s)",
+               name, luaL_typename(L, -1));
+  return lua_tonumber(L, -1);
+}
+
+/* cpus={cpu, ...}, nice=n, ioprio=level or "idle", rlimits={...},
+ * setsid=true, umask=mode
+ * These are applied in the child between fork and exec. */
+static void get_sched(lua_State *L, int idx, struct spawn_params *p)
+{
+  lua_getfield(L, idx, "cpus");
+  if (!lua_isnil(L, -1)) {
+    size_t i, n;
+    if (!lua_istable(L, -1))
+      luaL_error(L, "bad cpus option (table expected, got %s)",
+                 luaL_typename(L, -1));
+    n = lua_objlen(L, -1);
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(L, -1, i);
+      if (!lua_isnumber(L, -1) || -1 == spawn_param_cpu(p, lua_tonumber(L, -1)))
+        luaL_error(L, "bad cpus option (invalid cpu at index %d)", (int)i);
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+  lua_getfield(L, idx, "nice");
+  if (!lua_isnil(L, -1))
+    spawn_param_nice(p, opt_number(L, "nice"));
+  lua_pop(L, 1);
+  lua_getfield(L, idx, "ioprio");
+  switch (lua_type(L, -1)) {
+  default:
+    luaL_error(L, "bad ioprio option (number or \"idle\" expected, got %s)",
+               luaL_typename(L, -1));
+    break;
+  case LUA_TNIL:
+    break;
+  case LUA_TSTRING:
+    if (0 != strcmp(lua_tostring(L, -1), "idle"))
+      luaL_error(L, "bad ioprio option (number or \"idle\" expected, got %s)",
+                 lua_tostring(L, -1));
+    if (-1 == spawn_param_ioprio(p, 3 /*IOPRIO_CLASS_IDLE*/, 0))
+      luaL_error(L, "ioprio option is not supported");
+    break;
+  case LUA_TNUMBER: {
+    int level = lua_tonumber(L, -1);
+    if (level < 0 || level > 7)
+      luaL_error(L, "bad ioprio option (level must be 0 to 7)");
+    if (-1 == spawn_param_ioprio(p, 2 /*IOPRIO_CLASS_BE*/, level))
+      luaL_error(L, "ioprio option is not supported");
+    break;
+  }
+  }
+  lua_pop(L, 1);
+  lua_getfield(L, idx, "rlimits");
+  switch (lua_type(L, -1)) {
+  default:
+    luaL_error(L, "bad rlimits option (table expected, got %s)",
+               luaL_typename(L, -1));
+    break;
+  case LUA_TNIL:
+    break;
+  case LUA_TTABLE:
+    get_rlimits(L, lua_gettop(L), p);
+    break;
+  }
+  lua_pop(L, 1);
+  lua_getfield(L, idx, "setsid");
+  if (lua_toboolean(L, -1))
+    spawn_param_setsid(p);
+  lua_pop(L, 1);
+  lua_getfield(L, idx, "umask");
+  if (!lua_isnil(L, -1))
+    spawn_param_umask(p, opt_number(L, "umask"));
+  lua_pop(L, 1);
+}
+
+/* -- count */
+static int ex_cpucount(lua_State *L)
+{
+  int n = 0;
+#ifdef __linux__
+  cpu_set_t set;
+  if (0 == sched_getaffinity(0, sizeof set, &set))
+    n = CPU_COUNT(&set);
+#endif
+#ifdef _SC_NPROCESSORS_ONLN
+  if (n < 1)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  lua_pushnumber(L, n < 1 ? 1 : n);
+  return 1;
+}
+
+/* -- {cpu, ...}/nil error */
+static int ex_getaffinity(lua_State *L)
+{
+#ifdef __linux__
+  cpu_set_t set;
+  int cpu, i = 0;
+  if (-1 == sched_getaffinity(0, sizeof set, &set))
+    return push_error(L);
+  lua_createtable(L, CPU_COUNT(&set), 0);
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu, &set)) {
+      lua_pushnumber(L, cpu);
+      lua_rawseti(L, -2, ++i);
+    }
+  return 1;
+#else
+  errno = ENOSYS;
+  return push_error(L);
+#endif
+}
+
+/* {cpu, ...} -- true/nil error */
+static int ex_setaffinity(lua_State *L)
+{
+#ifdef __linux__
+  cpu_set_t set;
+  size_t i, n;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  CPU_ZERO(&set);
+  n = lua_objlen(L, 1);
+  for (i = 1; i <= n; i++) {
+    int cpu;
+    lua_rawgeti(L, 1, i);
+    cpu = luaL_checknumber(L, -1);
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+      return luaL_argerror(L, 1, "cpu out of range");
+    CPU_SET(cpu, &set);
+    lua_pop(L, 1);
+  }
+  if (-1 == sched_setaffinity(0, sizeof set, &set))
+    return push_error(L);
+  lua_pushboolean(L, 1);
+  return 1;
+#else
+  errno = ENOSYS;
+  return push_error(L);
+#endif
+}
+
+static void get_jobserver(lua_State *L, int idx, struct spawn_params *p)
+{
+  lua_getfield(L, idx, "jobserver");
+  if (!lua_isnil(L, -1))
+    spawn_param_jobserver(p, jobserver_check(L, -1));
+  lua_pop(L, 1);
+}
+
+/* filename [args-opts] -- filename opts ... params */
+/* args-opts -- filename opts ... params
+ * Parses the arguments of os.spawn. */
+struct spawn_params *ex_spawn_params(lua_State *L)
 {
   struct spawn_params *params;
   int have_options;
   switch (lua_type(L, 1)) {
-  default: return luaL_typerror(L, 1, "string or table");
+  default: return luaL_typerror(L, 1, "string or table"), NULL;
   case LUA_TSTRING:
     switch (lua_type(L, 2)) {
-    default: return luaL_typerror(L, 2, "table");
+    default: return luaL_typerror(L, 2, "table"), NULL;
     case LUA_TNONE: have_options = 0; break;
     case LUA_TTABLE: have_options = 1; break;
     }
@@ -369,7 +744,7 @@ static int ex_spawn(lua_State *L)
     }
     if (lua_type(L, 1) != LUA_TSTRING)
       return luaL_error(L, "bad command option (string expected, got %s)",
-                        luaL_typename(L, 1));
+                        luaL_typename(L, 1)), NULL;
     break;
   }
   params = spawn_param_init(L);
@@ -381,15 +756,15 @@ static int ex_spawn(lua_State *L)
     switch (lua_type(L, -1)) {
     default:
       return luaL_error(L, "bad args option (table expected, got %s)",
-                        luaL_typename(L, -1));
+                        luaL_typename(L, -1)), NULL;
     case LUA_TNIL:
       lua_pop(L, 1);                    /* cmd opts ... */
       lua_pushvalue(L, 2);              /* cmd opts ... opts */
       if (0) /*FALLTHRU*/
     case LUA_TTABLE:
       if (lua_objlen(L, 2) > 0)
-        return
-          luaL_error(L, "cannot specify both the args option and array values");
+        return luaL_error(L,
+          "cannot specify both the args option and array values"), NULL;
       spawn_param_args(params);         /* cmd opts ... */
       break;
     }
@@ -397,7 +772,7 @@ static int ex_spawn(lua_State *L)
     switch (lua_type(L, -1)) {
     default:
       return luaL_error(L, "bad env option (table expected, got %s)",
-                        luaL_typename(L, -1));
+                        luaL_typename(L, -1)), NULL;
     case LUA_TNIL:
       break;
     case LUA_TTABLE:
@@ -407,8 +782,535 @@ static int ex_spawn(lua_State *L)
     get_redirect(L, 2, "stdin", params);    /* cmd opts ... */
     get_redirect(L, 2, "stdout", params);   /* cmd opts ... */
     get_redirect(L, 2, "stderr", params);   /* cmd opts ... */
+    get_pgroup(L, 2, params);               /* cmd opts ... */
+    get_jobserver(L, 2, params);            /* cmd opts ... */
+    get_sched(L, 2, params);                /* cmd opts ... */
+  }
+  if (which_cached(L, lua_tostring(L, 1)))  /* cmd opts ... path */
+    spawn_param_path(params, lua_tostring(L, -1));
+  return params;
+}
+
+/* filename [args-opts] -- proc/nil error */
+/* args-opts -- proc/nil error */
+int ex_spawn(lua_State *L)
+{
+  return spawn_param_execute(ex_spawn_params(L));
+}
+
+
+/* ... t -- ... t copy
+ * os.spawn rearranges the array part of a table argument, so callers which
+ * reuse a command table pass it a shallow copy instead. */
+static void copytable(lua_State *L)
+{
+  int t = lua_gettop(L);
+  lua_newtable(L);
+  lua_pushnil(L);
+  while (lua_next(L, t)) {
+    lua_pushvalue(L, -2);
+    lua_insert(L, -2);
+    lua_settable(L, t + 1);
+  }
+}
+
+/* ... command -- ... proc/nil error */
+static void spawn_command(lua_State *L)
+{
+  lua_pushcfunction(L, ex_spawn);
+  lua_insert(L, -2);
+  if (lua_istable(L, -1)) {
+    copytable(L);
+    lua_remove(L, -2);
   }
-  return spawn_param_execute(params);   /* proc/nil error */
+  lua_call(L, 1, 2);
+}
+
+static int opt_jobs(lua_State *L, int idx)
+{
+  int jobs = 0;
+  if (lua_istable(L, idx)) {
+    lua_getfield(L, idx, "jobs");
+    jobs = luaL_optnumber(L, -1, 0);
+    lua_pop(L, 1);
+  }
+  if (jobs < 1) {
+    ex_cpucount(L);
+    jobs = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+  }
+  return jobs;
+}
+
+/* commands [opts] -- statuses/nil error */
+static int ex_spawnmany(lua_State *L)
+{
+  struct process **procs;
+  struct jobserver *js = 0;
+  int *index;
+  int n, jobs, next = 1, running = 0, i, token = 0;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  if (!lua_isnoneornil(L, 2))
+    luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  n = lua_objlen(L, 1);
+  jobs = opt_jobs(L, 2);
+  if (jobs > n) jobs = n > 0 ? n : 1;
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "jobserver");
+    if (!lua_isnil(L, -1))
+      js = jobserver_check(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "on_exit");      /* cmds opts on_exit */
+  }
+  else
+    lua_pushnil(L);
+  lua_createtable(L, n, 0);             /* cmds opts on_exit results */
+  lua_newtable(L);                      /* cmds opts on_exit results running */
+  procs = lua_newuserdata(L, jobs * (sizeof *procs + sizeof *index));
+  index = (int *)(procs + jobs);
+  while (next <= n || running > 0) {
+    while (running < jobs && next <= n) {
+      if (js) {
+        /* with children to reap, never block on a token they may hold */
+        token = jobserver_acquire(js, running > 0 ? monotime() : -1);
+        if (token == -2) return push_error(L);
+        if (token == -1) break;
+      }
+      lua_rawgeti(L, 1, next);          /* ... command */
+      spawn_command(L);                 /* ... proc/nil error */
+      if (lua_isnil(L, -2)) {
+        if (js) jobserver_release(js, token);
+        lua_createtable(L, 0, 1);       /* ... nil error status */
+        lua_insert(L, -2);              /* ... nil status error */
+        lua_setfield(L, -2, "error");   /* ... nil status */
+        lua_rawseti(L, 4, next);        /* ... nil */
+        lua_pop(L, 1);
+        if (!lua_isnil(L, 3)) {
+          lua_pushvalue(L, 3);
+          lua_pushnumber(L, next);
+          lua_pushnil(L);
+          lua_rawgeti(L, 4, next);
+          lua_call(L, 3, 0);
+        }
+        next++;
+        continue;
+      }
+      lua_pop(L, 1);                    /* ... proc */
+      procs[running] = lua_touserdata(L, -1);
+      if (js) process_settoken(procs[running], js, token);
+      index[running++] = next;
+      lua_rawseti(L, 5, next++);        /* ... */
+    }
+    if (running == 0)
+      break;
+    i = process_waitfor(L, procs, running, -1);
+    if (i < 0)
+      return push_error(L);
+    process_pushstatus(L, procs[i]);    /* ... exitcode status */
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, 4, index[i]);
+    if (!lua_isnil(L, 3)) {
+      lua_pushvalue(L, 3);              /* ... exitcode status on_exit */
+      lua_pushnumber(L, index[i]);
+      lua_pushvalue(L, -4);
+      lua_pushvalue(L, -4);
+      lua_call(L, 3, 0);
+    }
+    lua_pop(L, 2);
+    lua_pushnil(L);
+    lua_rawseti(L, 5, index[i]);
+    running--;
+    procs[i] = procs[running];
+    index[i] = index[running];
+  }
+  lua_pushvalue(L, 4);
+  return 1;
+}
+
+
+/* Each argument or environment string costs its bytes, its terminator and
+ * a pointer in the new process image. */
+#define ARGSIZE(len) ((len) + 1 + sizeof(char *))
+/* room left for the loader, as POSIX suggests for xargs */
+#define ARG_HEADROOM 2048
+#ifdef __linux__
+/* largest single argument on Linux (MAX_ARG_STRLEN) */
+#define ARG_STRMAX (32 * 4096)
+#endif
+
+/* envtab/nil -- envtab/nil */
+static size_t env_size(lua_State *L, int idx)
+{
+  size_t size = sizeof(char *), len;
+  if (lua_istable(L, idx)) {
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+      lua_pushvalue(L, -2);     /* measuring a numeric key converts it */
+      size += ARGSIZE(lua_objlen(L, -1) + 1 + lua_objlen(L, -2));
+      lua_pop(L, 2);
+    }
+  }
+  else {
+    char *const *env;
+    for (env = env_vars(env_acquire()); *env; env++) {
+      len = strlen(*env);
+      size += ARGSIZE(len);
+    }
+    env_release();
+  }
+  return size;
+}
+
+static const char *const xargs_options[] = {
+  "jobs", "max_args", "on_exit", "jobserver", 0
+};
+
+/* opts batch -- opts batch
+ * Copies the spawn options into a batch command table. */
+static void xargs_options_copy(lua_State *L, int opts)
+{
+  int i;
+  if (!opts) return;
+  lua_pushnil(L);
+  while (lua_next(L, opts)) {
+    if (lua_type(L, -2) == LUA_TSTRING) {
+      const char *k = lua_tostring(L, -2);
+      for (i = 0; xargs_options[i]; i++)
+        if (0 == strcmp(k, xargs_options[i]))
+          break;
+      if (!xargs_options[i]) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_settable(L, -4);
+        continue;
+      }
+    }
+    lua_pop(L, 1);
+  }
+}
+
+/* command items [opts] -- exitcode statuses/nil error */
+static int ex_xargs(lua_State *L)
+{
+  long argmax = sysconf(_SC_ARG_MAX);
+  size_t base = sizeof(char *), budget, used = 0, len;
+  int opts = 0, nitems, ncmd, i, j, maxargs = 0, batch = 0, inbatch = 0;
+  int jobs = 1;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    opts = 3;
+  }
+  lua_settop(L, 3);
+  switch (lua_type(L, 1)) {
+  default: return luaL_typerror(L, 1, "string or table");
+  case LUA_TSTRING:
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_replace(L, 1);
+    break;
+  case LUA_TTABLE:
+    break;
+  }
+  ncmd = lua_objlen(L, 1);
+  for (j = 1; j <= ncmd; j++) {
+    lua_rawgeti(L, 1, j);
+    if (!lua_tolstring(L, -1, &len))
+      return luaL_error(L, "expected string for argument %d, got %s",
+                        j, luaL_typename(L, -1));
+    base += ARGSIZE(len);
+    lua_pop(L, 1);
+  }
+  if (opts) {
+    lua_getfield(L, opts, "max_args");
+    maxargs = luaL_optnumber(L, -1, 0);
+    lua_getfield(L, opts, "jobs");
+    jobs = luaL_optnumber(L, -1, 1);
+    lua_getfield(L, opts, "env");
+    base += env_size(L, lua_gettop(L));
+    lua_pop(L, 3);
+  }
+  else
+    base += env_size(L, 0);
+  if (argmax <= 0)
+    argmax = _POSIX_ARG_MAX;
+  if ((size_t)argmax < base + ARG_HEADROOM) {
+    errno = E2BIG;
+    return push_error(L);
+  }
+  budget = argmax - base - ARG_HEADROOM;
+  nitems = lua_objlen(L, 2);
+  lua_pushcfunction(L, ex_spawnmany);   /* cmd items opts spawnmany */
+  lua_createtable(L, 0, 0);             /* ... commands */
+  for (i = 1; i <= nitems; i++) {
+    size_t size;
+    lua_rawgeti(L, 2, i);               /* ... commands [batch] item */
+    if (!lua_tolstring(L, -1, &len))
+      return luaL_error(L, "expected string for item %d, got %s",
+                        i, luaL_typename(L, -1));
+    size = ARGSIZE(len);
+#ifdef ARG_STRMAX
+    if (len >= ARG_STRMAX) size = budget + 1;
+#endif
+    if (size > budget) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "item %d is too long for a command line", i);
+      return 2;
+    }
+    if (inbatch == 0 || used + size > budget
+        || (maxargs > 0 && inbatch == maxargs)) {
+      if (inbatch > 0)
+        lua_remove(L, -2);              /* ... commands item */
+      lua_createtable(L, ncmd + 16, 4); /* ... commands item batch */
+      for (j = 1; j <= ncmd; j++) {
+        lua_rawgeti(L, 1, j);
+        lua_rawseti(L, -2, j);
+      }
+      xargs_options_copy(L, opts);
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, -4, ++batch);
+      lua_insert(L, -2);                /* ... commands batch item */
+      used = 0;
+      inbatch = 0;
+    }
+    lua_rawseti(L, -2, ncmd + ++inbatch);
+    used += size;
+  }
+  if (inbatch > 0)
+    lua_pop(L, 1);                      /* ... spawnmany commands */
+  lua_createtable(L, 0, 3);             /* ... spawnmany commands spawnopts */
+  lua_pushnumber(L, jobs > 0 ? jobs : 1);
+  lua_setfield(L, -2, "jobs");
+  if (opts) {
+    lua_getfield(L, opts, "on_exit");
+    lua_setfield(L, -2, "on_exit");
+    lua_getfield(L, opts, "jobserver");
+    lua_setfield(L, -2, "jobserver");
+  }
+  lua_call(L, 2, 1);                    /* ... statuses */
+  /* the worst exit code wins; a batch which failed to start counts as 127 */
+  for (i = 1, j = 0; i <= batch; i++) {
+    int exitcode;
+    lua_rawgeti(L, -1, i);
+    lua_getfield(L, -1, "error");
+    lua_getfield(L, -2, "exitcode");
+    if (!lua_isnil(L, -2))
+      exitcode = 127;
+    else if (lua_isnil(L, -1)) {
+      lua_getfield(L, -3, "signal");
+      exitcode = 128 + lua_tonumber(L, -1);
+      lua_pop(L, 1);
+    }
+    else
+      exitcode = lua_tonumber(L, -1);
+    if (exitcode > j) j = exitcode;
+    lua_pop(L, 3);
+  }
+  lua_pushnumber(L, j);
+  lua_insert(L, -2);
+  return 2;
+}
+
+
+#define PIPELINE_HANDLE "pipeline"
+
+static void close_file(lua_State *L, int idx)
+{
+  FILE **pf = lua_touserdata(L, idx);
+  if (pf && *pf) {
+    fclose(*pf);
+    *pf = 0;
+  }
+}
+
+/* stage -- stage */
+static void stage_default(lua_State *L, int opts, const char *name)
+{
+  lua_getfield(L, -1, name);
+  if (lua_isnil(L, -1) && opts) {
+    lua_getfield(L, opts, name);
+    lua_setfield(L, -3, name);
+  }
+  lua_pop(L, 1);
+}
+
+/* pipeline [signal] -- pipeline */
+static int pipeline_kill(lua_State *L)
+{
+  int i, n;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = lua_objlen(L, 1);
+  for (i = 1; i <= n; i++) {
+    lua_pushcfunction(L, process_kill);
+    lua_rawgeti(L, 1, i);
+    lua_pushvalue(L, 2);
+    lua_call(L, 2, 0);
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* pipeline [timeout] -- exitcode statuses/nil error */
+static int pipeline_wait(lua_State *L)
+{
+  struct process **procs;
+  double deadline = -1;
+  int n, i, left, exitcode = 0, pipefail;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  if (!lua_isnoneornil(L, 2)) {
+    lua_Number timeout = luaL_checknumber(L, 2);
+    deadline = monotime() + (timeout > 0 ? timeout : 0);
+  }
+  lua_settop(L, 1);
+  lua_getfield(L, 1, "pipefail");
+  pipefail = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  n = lua_objlen(L, 1);
+  procs = lua_newuserdata(L, n * sizeof *procs);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    procs[i] = luaL_checkudata(L, -1, PROCESS_HANDLE);
+    lua_pop(L, 1);
+  }
+  for (left = n; left > 0; ) {
+    i = process_waitfor(L, procs, left, deadline);
+    if (i == -2) return push_error(L);
+    if (i == -1) {
+      lua_pushnil(L);
+      lua_pushliteral(L, "timeout");
+      return 2;
+    }
+    procs[i] = procs[--left];
+  }
+  lua_createtable(L, n, 0);             /* pipeline vec statuses */
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);
+    process_pushstatus(L, lua_touserdata(L, -1));
+    lua_rawseti(L, 3, i);               /* ... proc exitcode */
+    /* with pipefail, the last stage which failed decides */
+    if (pipefail ? lua_tonumber(L, -1) != 0 : i == n)
+      exitcode = lua_tonumber(L, -1);
+    lua_pop(L, 2);
+  }
+  lua_pushnumber(L, exitcode);
+  lua_insert(L, -2);
+  return 2;
+}
+
+/* Kills and reaps the stages of a partially started pipeline. */
+static void pipeline_abort(lua_State *L, int pipeline)
+{
+  int i, n = lua_objlen(L, pipeline);
+  for (i = 1; i <= n; i++) {
+    lua_pushcfunction(L, process_kill);
+    lua_rawgeti(L, pipeline, i);
+    lua_call(L, 1, 0);
+    lua_pushcfunction(L, process_wait);
+    lua_rawgeti(L, pipeline, i);
+    lua_call(L, 1, 0);
+  }
+}
+
+/* command... [opts] -- pipeline/nil error */
+static int ex_pipeline(lua_State *L)
+{
+  int n = lua_gettop(L), opts = 0, i, pipesize = 0;
+  int pipeline, in;
+  /* a trailing table with neither array items nor a command is options */
+  if (n > 1 && lua_istable(L, n) && lua_objlen(L, n) == 0) {
+    lua_getfield(L, n, "command");
+    if (lua_isnil(L, -1))
+      opts = n--;
+    lua_pop(L, 1);
+  }
+  if (n < 1)
+    return luaL_typerror(L, 1, "string or table");
+  for (i = 1; i <= n; i++)
+    if (!lua_isstring(L, i) && !lua_istable(L, i))
+      return luaL_typerror(L, i, "string or table");
+  lua_createtable(L, n, 1);             /* ... pipeline */
+  pipeline = lua_gettop(L);
+  luaL_getmetatable(L, PIPELINE_HANDLE);
+  lua_setmetatable(L, pipeline);
+  if (opts) {
+    lua_getfield(L, opts, "pipefail");
+    lua_setfield(L, pipeline, "pipefail");
+    lua_getfield(L, opts, "pipesize");
+    pipesize = luaL_optnumber(L, -1, 0);
+    lua_pop(L, 1);
+  }
+  lua_pushnil(L);                       /* ... pipeline in */
+  in = lua_gettop(L);
+  for (i = 1; i <= n; i++) {
+    if (lua_istable(L, i)) {
+      lua_pushvalue(L, i);
+      copytable(L);
+      lua_remove(L, -2);
+    }
+    else {
+      lua_createtable(L, 1, 0);
+      lua_pushvalue(L, i);
+      lua_rawseti(L, -2, 1);
+    }                                   /* ... in stage */
+    if (i == 1)
+      stage_default(L, opts, "stdin");
+    else {
+      lua_pushvalue(L, in);
+      lua_setfield(L, -2, "stdin");
+    }
+    stage_default(L, opts, "stderr");
+    if (i == n) {
+      stage_default(L, opts, "stdout");
+      lua_pushnil(L);                   /* ... in stage nextin */
+      lua_pushnil(L);                   /* ... in stage nextin out */
+    }
+    else {
+      int fd[2];
+      if (-1 == pipe(fd)) {
+        close_file(L, in);
+        push_error(L);
+        pipeline_abort(L, pipeline);
+        return 2;
+      }
+      closeonexec(fd[0]);
+      closeonexec(fd[1]);
+#ifdef F_SETPIPE_SZ
+      if (pipesize > 0)
+        fcntl(fd[1], F_SETPIPE_SZ, pipesize);
+#endif
+      new_file(L, fd[0], "r");          /* ... in stage nextin */
+      new_file(L, fd[1], "w");          /* ... in stage nextin out */
+      lua_pushvalue(L, -1);
+      lua_setfield(L, -4, "stdout");
+    }
+    lua_pushcfunction(L, ex_spawn);
+    lua_pushvalue(L, -4);
+    if (0 != lua_pcall(L, 1, 2, 0)) {   /* ... in stage nextin out message */
+      close_file(L, in);
+      close_file(L, -3);
+      close_file(L, -2);
+      pipeline_abort(L, pipeline);
+      return lua_error(L);
+    }                                   /* ... in stage nextin out proc/nil error */
+    /* the parent must not keep pipe ends open: a stage would never see EOF
+     * while we hold the write end of its input */
+    close_file(L, in);
+    close_file(L, -3);
+    if (lua_isnil(L, -2)) {
+      close_file(L, -4);
+      pipeline_abort(L, pipeline);
+      return 2;
+    }
+    lua_pop(L, 1);                      /* ... in stage nextin out proc */
+    lua_rawseti(L, pipeline, i);        /* ... in stage nextin out */
+    lua_pop(L, 1);                      /* ... in stage nextin */
+    lua_replace(L, in);                 /* ... nextin stage */
+    lua_pop(L, 1);                      /* ... nextin */
+  }
+  lua_pushvalue(L, pipeline);
+  return 1;
 }
 
 
@@ -429,39 +1331,76 @@ static void copyfields(lua_State *L, const luaL_reg *l, int from, int to)
 int luaopen_ex(lua_State *L)
 {
   const char *name = lua_tostring(L, 1);
-  int ex;
+  int ex, i;
+  static const char *const file_makers[] = {
+    "pipe", "socketpair", "recvfds", "pipeline", 0 };
   const luaL_reg ex_iolib[] = {
     {"pipe",       ex_pipe},
-#define ex_iofile_methods (ex_iolib + 1)
+    {"socketpair", ex_socketpair},
+#define ex_iofile_methods (ex_iolib + 2)
     {"lock",       ex_lock},
     {"unlock",     ex_lock},
+    {"sendfds",    ex_sendfds},
+    {"recvfds",    ex_recvfds},
     {0,0} };
   const luaL_reg ex_oslib[] = {
     /* environment */
     {"getenv",     ex_getenv},
     {"setenv",     ex_setenv},
     {"environ",    ex_environ},
+    {"expand",     ex_expand},
     /* file system */
     {"currentdir", ex_currentdir},
     {"chdir",      ex_chdir},
     {"mkdir",      ex_mkdir},
     {"dir",        ex_dir},
     {"dirent",     ex_dirent},
+    {"dirents",    ex_dirents},
+    {"du",         ex_du},
+    {"watch",      ex_watch},
     /* process control */
     {"sleep",      ex_sleep},
+    {"clock_ns",   ex_clock_ns},
+    {"monotonic",  ex_monotonic},
     {"spawn",      ex_spawn},
+    {"which",      ex_which},
+    {"cpucount",   ex_cpucount},
+    {"getaffinity", ex_getaffinity},
+    {"setaffinity", ex_setaffinity},
+    {"waitany",    process_waitany},
+    {"spawnmany",  ex_spawnmany},
+    {"pipeline",   ex_pipeline},
+    {"procstats",  ex_procstats},
+    {"xargs",      ex_xargs},
+    {0,0} };
+  const luaL_reg ex_pipeline_methods[] = {
+    {"wait",       pipeline_wait},
+    {"kill",       pipeline_kill},
     {0,0} };
   const luaL_reg ex_diriter_methods[] = {
     {"__gc",       diriter_close},
     {0,0} };
   const luaL_reg ex_process_methods[] = {
+    {"__gc",       process_gc},
     {"__tostring", process_tostring},
-#define ex_process_functions (ex_process_methods + 1)
+#define ex_process_functions (ex_process_methods + 2)
     {"wait",       process_wait},
+    {"poll",       process_poll},
+    {"kill",       process_kill},
+    {"communicate", process_communicate},
+    {"lines",      process_lines},
+    {"stats",      process_stats},
     {0,0} };
+  pthread_once(&clock_once, clock_init);
   /* diriter metatable */
   luaL_newmetatable(L, DIR_HANDLE);           /* . D */
   luaL_register(L, 0, ex_diriter_methods);    /* . D */
+  /* pipeline metatable */
+  luaL_newmetatable(L, PIPELINE_HANDLE);      /* . L */
+  lua_newtable(L);                            /* . L M */
+  luaL_register(L, 0, ex_pipeline_methods);   /* . L M */
+  lua_setfield(L, -2, "__index");             /* . L */
+  lua_pop(L, 1);                              /* . */
   /* proc metatable */
   luaL_newmetatable(L, PROCESS_HANDLE);       /* . P */
   luaL_register(L, 0, ex_process_methods);    /* . P */
@@ -472,6 +1411,25 @@ int luaopen_ex(lua_State *L)
   luaL_register(L, 0, ex_iolib);
   copyfields(L, ex_process_functions, -2, -1);
   ex = lua_gettop(L);
+  jobserver_open(L);                          /* . P ex J */
+  lua_setfield(L, ex, "jobserver");           /* . P ex */
+  lua_pushcfunction(L, process_autoreap);     /* . P ex autoreap */
+  lua_setfield(L, ex, "autoreap");            /* . P ex */
+  lua_pushcfunction(L, ex_pathcache);         /* . P ex pathcache */
+  lua_setfield(L, ex, "pathcache");           /* . P ex */
+  loop_open(L);                               /* . P ex */
+  timers_open(L);                             /* . P ex */
+  async_open(L);                              /* . P ex */
+  ring_open(L);                               /* . P ex */
+  watch_open(L);                              /* . P ex */
+  statcache_open(L);                          /* . P ex */
+  lockfile_open(L);                           /* . P ex */
+  shmring_open(L);                            /* . P ex */
+  channel_open(L);                            /* . P ex */
+  expand_open(L);                             /* . P ex */
+  lines_open(L);
+  lua_pushcfunction(L, ex_lines);             /* . P ex lines */
+  lua_setfield(L, ex, "lines");               /* . P ex */
   /* extend the os table */
   lua_getglobal(L, "os");                     /* . os */
   if (lua_isnil(L, -1)) return luaL_error(L, "os not loaded");
@@ -482,10 +1440,15 @@ int luaopen_ex(lua_State *L)
   lua_getglobal(L, "io");                     /* . io */
   if (lua_isnil(L, -1)) return luaL_error(L, "io not loaded");
   copyfields(L, ex_iolib, ex, -1);
-  lua_getfield(L, ex, "pipe");                /* . io ex_pipe */
-  lua_getfield(L, -2, "open");                /* . io ex_pipe io_open */
-  lua_getfenv(L, -1);                         /* . io ex_pipe io_open E */
-  lua_setfenv(L, -3);                         /* . io ex_pipe io_open */
+  /* the functions which make files take the environment of io.open */
+  lua_getfield(L, -1, "open");                /* . io io_open */
+  lua_getfenv(L, -1);                         /* . io io_open E */
+  for (i = 0; file_makers[i]; i++) {
+    lua_getfield(L, ex, file_makers[i]);      /* . io io_open E f */
+    lua_pushvalue(L, -2);                     /* . io io_open E f E */
+    lua_setfenv(L, -2);                       /* . io io_open E f */
+    lua_pop(L, 1);                            /* . io io_open E */
+  }
   /* extend the io.file metatable */
   luaL_getmetatable(L, LUA_FILEHANDLE);       /* . F */
   if (lua_isnil(L, -1)) return luaL_error(L, "can't find FILE* metatable");
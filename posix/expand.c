@@ -0,0 +1,469 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "expand.h"
+#include "envsnap.h"
+
+/* Variable expansion in the manner of the shell:
+ *
+ *   $NAME ${NAME} ${NAME-word} ${NAME:-word} ${NAME+word} ${NAME:+word}
+ *   ${NAME?word} ${NAME:?word} $$
+ *
+ * A template is compiled once into a list of nodes, literals and
+ * variables.  A variable with an operator is followed by the nodes of its
+ * word, which may hold further expansions; its words field counts them
+ * all, so that the list is walked by skipping over them.  Expansion then
+ * looks each name up in a table or the environment and appends to a
+ * luaL_Buffer, without scanning the text again. */
+
+#define TEMPLATE_HANDLE "ex.template"
+#define EXPAND_NODES 64         /* nodes compiled on the C stack */
+
+enum { T_LIT, T_VAR };
+
+struct tnode {
+  int kind;
+  int op;                       /* 0, '-', '+' or '?' */
+  int colon;                    /* an empty value counts as unset */
+  int words;                    /* nodes of the word, which follow */
+  size_t off, len;              /* the literal, or the name, in src */
+};
+
+/* count is -1 for a table of templates, kept in the environment with the
+ * table's other values; a string template keeps its source there, as
+ * {src}. */
+struct template {
+  int count;
+  const char *src;
+  struct tnode nodes[1];
+};
+
+struct parser {
+  lua_State *L;
+  const char *s;
+  size_t len, pos;
+  struct tnode *nodes;
+  int n;
+};
+
+/* The most nodes s can compile to: each '$' makes one node and ends a
+ * literal, and so may the '}' which closes it. */
+static int max_nodes(const char *s, size_t len)
+{
+  const char *end = s + len;
+  int n = 1;
+  while ((s = memchr(s, '$', end - s))) {
+    n += 3;
+    s++;
+  }
+  return n;
+}
+
+static struct tnode *add_node(struct parser *p, int kind, size_t off,
+                              size_t len)
+{
+  struct tnode *t = &p->nodes[p->n++];
+  t->kind = kind;
+  t->op = t->colon = t->words = 0;
+  t->off = off;
+  t->len = len;
+  return t;
+}
+
+static void add_literal(struct parser *p, size_t off, size_t len)
+{
+  if (len > 0)
+    add_node(p, T_LIT, off, len);
+}
+
+static int isname(int c, int first)
+{
+  return c == '_' || (first ? isalpha(c) : isalnum(c));
+}
+
+static void parse_var(struct parser *p);
+
+/* Parses up to the end, or to a '}' closing the word of a variable. */
+static void parse(struct parser *p, int nested)
+{
+  size_t start = p->pos;
+  while (p->pos < p->len) {
+    char c = p->s[p->pos];
+    if (c == '}' && nested)
+      break;
+    if (c != '$') {
+      p->pos++;
+      continue;
+    }
+    add_literal(p, start, p->pos - start);
+    parse_var(p);
+    start = p->pos;
+  }
+  add_literal(p, start, p->pos - start);
+}
+
+static void parse_var(struct parser *p)
+{
+  const char *s = p->s;
+  size_t i = p->pos + 1, name;
+  int idx;
+  if (i < p->len && s[i] == '$') {
+    add_literal(p, i, 1);
+    p->pos = i + 1;
+    return;
+  }
+  if (i < p->len && s[i] == '{') {
+    for (name = ++i; i < p->len; i++)
+      if (!isname((unsigned char)s[i], i == name))
+        break;
+    if (i == name || i == p->len)
+      goto bad;
+    add_node(p, T_VAR, name, i - name);
+    idx = p->n - 1;
+    if (s[i] == '}') {
+      p->pos = i + 1;
+      return;
+    }
+    if (s[i] == ':') {
+      p->nodes[idx].colon = 1;
+      i++;
+    }
+    if (i == p->len || !strchr("-+?", s[i]))
+      goto bad;
+    p->nodes[idx].op = s[i];
+    p->pos = i + 1;
+    parse(p, 1);
+    if (p->pos == p->len) {
+      luaL_error(p->L, "unterminated ${ at position %d in template",
+                 (int)name - 1);
+      return;
+    }
+    p->pos++;
+    p->nodes[idx].words = p->n - idx - 1;
+    return;
+  }
+  if (i < p->len && isname((unsigned char)s[i], 1)) {
+    for (name = i++; i < p->len && isname((unsigned char)s[i], 0); i++)
+      ;
+    add_node(p, T_VAR, name, i - name);
+    p->pos = i;
+    return;
+  }
+  /* a lone '$' */
+  add_literal(p, p->pos, 1);
+  p->pos++;
+  return;
+bad:
+  luaL_error(p->L, "bad substitution at position %d in template",
+             (int)p->pos + 1);
+}
+
+/* Compiles s into nodes, which has room for max_nodes(s).  Returns the
+ * number of nodes. */
+static int compile(lua_State *L, const char *s, size_t len,
+                   struct tnode *nodes)
+{
+  struct parser p;
+  p.L = L;
+  p.s = s;
+  p.len = len;
+  p.pos = 0;
+  p.nodes = nodes;
+  p.n = 0;
+  parse(&p, 0);
+  return p.n;
+}
+
+/* Finds the value of a name, in the table at index env or, when env is 0,
+ * the environment.  The value is pushed, for luaL_addvalue; *pushed says
+ * so. */
+static const char *lookup(lua_State *L, int env, const char *name,
+                          size_t len, size_t *vlen, int *pushed)
+{
+  if (env) {
+    lua_pushlstring(L, name, len);
+    lua_rawget(L, env);
+  }
+  else if (!env_push(L, name, len)) {
+    *pushed = 0;
+    return 0;
+  }
+  *pushed = 1;
+  return lua_tolstring(L, -1, vlen);
+}
+
+/* Appends the expansion of n nodes from nodes[i] to b.  Returns 0, or -1
+ * with an error message pushed, for a '?' operator. */
+static int expand(lua_State *L, const char *src, struct tnode *nodes,
+                  int i, int n, int env, luaL_Buffer *b)
+{
+  int end = i + n;
+  for (; i < end; i += 1 + nodes[i].words) {
+    struct tnode *t = &nodes[i];
+    const char *v;
+    size_t vlen = 0;
+    int pushed, set;
+    if (t->kind == T_LIT) {
+      luaL_addlstring(b, src + t->off, t->len);
+      continue;
+    }
+    v = lookup(L, env, src + t->off, t->len, &vlen, &pushed);
+    set = v && (!t->colon || vlen > 0);
+    if (t->op == '+' ? !set : set) {
+      if (t->op == '+') {
+        if (pushed) lua_pop(L, 1);
+        continue;
+      }
+      if (pushed) luaL_addvalue(b);
+      else luaL_addlstring(b, v, vlen);
+      continue;
+    }
+    if (pushed) lua_pop(L, 1);
+    if (t->op == '?') {
+      luaL_Buffer msg;
+      luaL_buffinit(L, &msg);
+      if (-1 == expand(L, src, nodes, i + 1, t->words, env, &msg))
+        return -1;
+      luaL_pushresult(&msg);
+      if (lua_objlen(L, -1) == 0) {
+        lua_pop(L, 1);
+        lua_pushlstring(L, src + t->off, t->len);
+        lua_pushliteral(L, ": parameter not set");
+        lua_concat(L, 2);
+      }
+      return -1;
+    }
+    if (t->op && -1 == expand(L, src, nodes, i + 1, t->words, env, b))
+      return -1;
+  }
+  return 0;
+}
+
+/* ... -- ... string/nil error */
+static int push_expansion(lua_State *L, const char *src, struct tnode *nodes,
+                          int n, int env)
+{
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  if (-1 == expand(L, src, nodes, 0, n, env, &b)) {
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+/* ... -- ... string/nil error */
+static int expand_string(lua_State *L, int idx, int env)
+{
+  struct tnode local[EXPAND_NODES], *nodes = local;
+  size_t len;
+  const char *s = lua_tolstring(L, idx, &len);
+  int max = max_nodes(s, len);
+  if (max > EXPAND_NODES)
+    nodes = lua_newuserdata(L, max * sizeof *nodes);
+  return push_expansion(L, s, nodes, compile(L, s, len, nodes), env);
+}
+
+/* ... -- ... table/nil error
+ * Expands the array part of the table, and its args field if a table,
+ * copying all else. */
+static int expand_table(lua_State *L, int idx, int env, int depth)
+{
+  int t;
+  lua_newtable(L);
+  t = lua_gettop(L);
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {                  /* ... t k v */
+    int v = lua_gettop(L);
+    int array = lua_type(L, -2) == LUA_TNUMBER;
+    int args = !depth && lua_type(L, -2) == LUA_TSTRING
+               && 0 == strcmp(lua_tostring(L, -2), "args");
+    if (array && lua_type(L, -1) == LUA_TSTRING) {
+      if (2 == expand_string(L, v, env))
+        return 2;
+      lua_replace(L, v);                      /* ... t k v' ... */
+      lua_settop(L, v);                       /* ... t k v' */
+    }
+    else if (args && lua_istable(L, -1)) {
+      if (2 == expand_table(L, v, env, 1))
+        return 2;
+      lua_replace(L, v);
+      lua_settop(L, v);
+    }
+    lua_pushvalue(L, -2);                     /* ... t k v k */
+    lua_insert(L, -2);                        /* ... t k k v */
+    lua_rawset(L, t);                         /* ... t k */
+  }
+  lua_settop(L, t);
+  return 1;
+}
+
+static int opt_env(lua_State *L, int idx)
+{
+  if (lua_isnoneornil(L, idx))
+    return 0;
+  luaL_checktype(L, idx, LUA_TTABLE);
+  return idx;
+}
+
+/* string/table [env] -- string/table/nil error */
+int ex_expand(lua_State *L)
+{
+  int env = opt_env(L, 2);
+  if (lua_istable(L, 1))
+    return expand_table(L, 1, env, 0);
+  luaL_checkstring(L, 1);
+  return expand_string(L, 1, env);
+}
+
+static struct template *checktemplate(lua_State *L, int idx)
+{
+  return luaL_checkudata(L, idx, TEMPLATE_HANDLE);
+}
+
+/* string -- template */
+static struct template *new_template(lua_State *L, int idx)
+{
+  size_t len;
+  const char *s = lua_tolstring(L, idx, &len);
+  int max = max_nodes(s, len);
+  struct template *t = lua_newuserdata(L, sizeof *t
+                                          + (max - 1) * sizeof t->nodes[0]);
+  t->src = s;
+  t->count = compile(L, s, len, t->nodes);
+  luaL_getmetatable(L, TEMPLATE_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 1, 0);                   /* the source stays alive */
+  lua_pushvalue(L, idx);
+  lua_rawseti(L, -2, 1);
+  lua_setfenv(L, -2);
+  return t;
+}
+
+/* string/table -- template */
+static int ex_template(lua_State *L)
+{
+  struct template *t;
+  int array;
+  if (!lua_istable(L, 1)) {
+    luaL_checkstring(L, 1);
+    new_template(L, 1);
+    return 1;
+  }
+  /* a table of templates, as expand_table */
+  lua_settop(L, 1);
+  t = lua_newuserdata(L, sizeof *t);          /* tab T */
+  t->count = -1;
+  t->src = 0;
+  luaL_getmetatable(L, TEMPLATE_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_newtable(L);                            /* tab T E */
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {                    /* tab T E k v */
+    array = lua_type(L, -2) == LUA_TNUMBER;
+    if (array && lua_type(L, -1) == LUA_TSTRING) {
+      new_template(L, lua_gettop(L));         /* tab T E k v t */
+      lua_replace(L, -2);                     /* tab T E k t */
+    }
+    else if (lua_type(L, -2) == LUA_TSTRING
+             && 0 == strcmp(lua_tostring(L, -2), "args")
+             && lua_istable(L, -1)) {
+      lua_pushcfunction(L, ex_template);      /* tab T E k v template */
+      lua_insert(L, -2);                      /* tab T E k template v */
+      lua_call(L, 1, 1);                      /* tab T E k t */
+    }
+    lua_pushvalue(L, -2);                     /* tab T E k t k */
+    lua_insert(L, -2);                        /* tab T E k k t */
+    lua_rawset(L, 3);                         /* tab T E k */
+  }
+  lua_setfenv(L, 2);                          /* tab T */
+  return 1;
+}
+
+static int istemplate(lua_State *L, int idx)
+{
+  int ret;
+  if (!lua_getmetatable(L, idx))
+    return 0;
+  luaL_getmetatable(L, TEMPLATE_HANDLE);
+  ret = lua_rawequal(L, -1, -2);
+  lua_pop(L, 2);
+  return ret;
+}
+
+/* ... template -- ... string/table/nil error */
+static int template_push(lua_State *L, int idx, int env)
+{
+  struct template *t = checktemplate(L, idx);
+  int tab;
+  if (t->count >= 0)
+    return push_expansion(L, t->src, t->nodes, t->count, env);
+  lua_getfenv(L, idx);                        /* ... E */
+  lua_newtable(L);                            /* ... E tab */
+  tab = lua_gettop(L);
+  lua_pushnil(L);
+  while (lua_next(L, tab - 1)) {              /* ... E tab k v */
+    if (istemplate(L, -1)) {
+      int v = lua_gettop(L);
+      if (2 == template_push(L, v, env))
+        return 2;
+      lua_replace(L, v);                      /* ... E tab k s ... */
+      lua_settop(L, v);                       /* ... E tab k s */
+    }
+    lua_pushvalue(L, -2);                     /* ... E tab k s k */
+    lua_insert(L, -2);                        /* ... E tab k k s */
+    lua_rawset(L, tab);                       /* ... E tab k */
+  }
+  return 1;
+}
+
+/* template [env] -- string/table/nil error */
+static int template_expand(lua_State *L)
+{
+  checktemplate(L, 1);
+  return template_push(L, 1, opt_env(L, 2));
+}
+
+/* template -- string */
+static int template_tostring(lua_State *L)
+{
+  struct template *t = checktemplate(L, 1);
+  if (t->count < 0)
+    lua_pushliteral(L, "template (table)");
+  else
+    lua_pushfstring(L, "template (%s)", t->src);
+  return 1;
+}
+
+/* ex -- ex */
+int expand_open(lua_State *L)
+{
+  luaL_newmetatable(L, TEMPLATE_HANDLE);      /* ex M */
+  lua_createtable(L, 0, 1);                   /* ex M I */
+  lua_pushcfunction(L, template_expand);      /* ex M I expand */
+  lua_setfield(L, -2, "expand");              /* ex M I */
+  lua_setfield(L, -2, "__index");             /* ex M */
+  lua_pushcfunction(L, template_expand);      /* ex M expand */
+  lua_setfield(L, -2, "__call");              /* ex M */
+  lua_pushcfunction(L, template_tostring);    /* ex M tostring */
+  lua_setfield(L, -2, "__tostring");          /* ex M */
+  lua_pop(L, 1);                              /* ex */
+  lua_pushcfunction(L, ex_template);          /* ex template */
+  lua_setfield(L, -2, "template");            /* ex */
+  return 0;
+}
@@ -0,0 +1,14 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef EXPAND_H
+#define EXPAND_H
+
+#include "lua.h"
+
+int ex_expand(lua_State *L);
+int expand_open(lua_State *L);
+
+#endif/*EXPAND_H*/
@@ -0,0 +1,210 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "fdpass.h"
+
+#ifndef SOCK_CLOEXEC
+#define SOCK_CLOEXEC 0
+#endif
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+#define FDPASS_MAXFDS 64        /* descriptors in one message */
+#define FDPASS_SIZE 4096        /* default bytes received */
+
+extern int push_error(lua_State *L);
+extern FILE *check_file(lua_State *L, int idx, const char *argname);
+extern FILE **new_file(lua_State *L, int fd, const char *mode);
+
+static void closeonexec(int fd)
+{
+  int fl = fcntl(fd, F_GETFD);
+  if (fl != -1)
+    fcntl(fd, F_SETFD, fl | FD_CLOEXEC);
+}
+
+/* the stdio mode for a descriptor's access mode */
+static const char *fd_mode(int fd)
+{
+  switch (fcntl(fd, F_GETFL) & O_ACCMODE) {
+  case O_RDONLY: return "r";
+  case O_WRONLY: return "w";
+  default: return "r+";
+  }
+}
+
+/* [options] -- file file/nil error
+ * The files take the environment of io.open, as io.pipe. */
+int ex_socketpair(lua_State *L)
+{
+  static const char *const types[] = { "stream", "seqpacket", 0 };
+  int type = SOCK_STREAM, fd[2];
+  if (!lua_isnoneornil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "type");
+    if (!lua_isnil(L, -1)) {
+      const char *s = luaL_checkstring(L, -1);
+      int i;
+      for (i = 0; types[i] && strcmp(s, types[i]); i++)
+        ;
+      if (!types[i])
+        return luaL_error(L, "bad type option (%s)", s);
+      type = i == 0 ? SOCK_STREAM : SOCK_SEQPACKET;
+    }
+    lua_pop(L, 1);
+  }
+  if (-1 == socketpair(AF_UNIX, type | SOCK_CLOEXEC, 0, fd))
+    return push_error(L);
+  if (!SOCK_CLOEXEC) {
+    closeonexec(fd[0]);
+    closeonexec(fd[1]);
+  }
+  new_file(L, fd[0], "r+");
+  new_file(L, fd[1], "r+");
+  return 2;
+}
+
+/* file {file/fd...} [data] -- bytes/nil error
+ * At least one byte has to go with the descriptors; with no data it is a
+ * zero byte. */
+int ex_sendfds(lua_State *L)
+{
+  int fds[FDPASS_MAXFDS];
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof fds)];
+  } control;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  size_t len;
+  int sock = fileno(check_file(L, 1, NULL));
+  const char *data = luaL_optlstring(L, 3, "", &len);
+  int i, n;
+  ssize_t ret;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  n = lua_objlen(L, 2);
+  if (n > FDPASS_MAXFDS)
+    return luaL_argerror(L, 2, "too many descriptors");
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 2, i + 1);
+    if (lua_type(L, -1) == LUA_TNUMBER)
+      fds[i] = lua_tonumber(L, -1);
+    else
+      fds[i] = fileno(check_file(L, -1, "descriptor"));
+    lua_pop(L, 1);
+  }
+  if (len == 0) {
+    data = "";
+    len = 1;
+  }
+  memset(&msg, 0, sizeof msg);
+  iov.iov_base = (void *)data;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (n > 0) {
+    memset(&control, 0, sizeof control);
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(n * sizeof *fds);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n * sizeof *fds);
+    memcpy(CMSG_DATA(cmsg), fds, n * sizeof *fds);
+  }
+  do ret = sendmsg(sock, &msg, 0);
+  while (ret == -1 && errno == EINTR);
+  if (ret == -1)
+    return push_error(L);
+  lua_pushnumber(L, ret);
+  return 1;
+}
+
+/* file [size] -- data {file...}/nil error
+ * The files take the environment of io.open, as io.pipe. */
+int ex_recvfds(lua_State *L)
+{
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(FDPASS_MAXFDS * sizeof(int))];
+  } control;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  int sock = fileno(check_file(L, 1, NULL));
+  size_t size = luaL_optnumber(L, 2, FDPASS_SIZE);
+  char *buf;
+  ssize_t ret;
+  int i, n = 0;
+  if (size < 1)
+    size = 1;
+  if (!(buf = malloc(size)))
+    return luaL_error(L, "not enough memory");
+  memset(&msg, 0, sizeof msg);
+  iov.iov_base = buf;
+  iov.iov_len = size;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof control.buf;
+  do ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  while (ret == -1 && errno == EINTR);
+  if (ret <= 0) {
+    free(buf);
+    if (ret == 0) {
+      lua_pushnil(L);
+      return 1;
+    }
+    return push_error(L);
+  }
+  lua_settop(L, 1);
+  lua_pushlstring(L, buf, ret);               /* file data */
+  free(buf);
+  lua_newtable(L);                            /* file data fds */
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    int *fds = (int *)CMSG_DATA(cmsg);
+    int count;
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof *fds;
+    for (i = 0; i < count; i++) {
+      int fd;
+      memcpy(&fd, fds + i, sizeof fd);
+      if (!MSG_CMSG_CLOEXEC)
+        closeonexec(fd);
+      if (!*new_file(L, fd, fd_mode(fd))) {
+        lua_pop(L, 1);
+        close(fd);
+        continue;
+      }
+      lua_rawseti(L, -2, ++n);
+    }
+  }
+  if (msg.msg_flags & MSG_CTRUNC) {
+    /* descriptors were lost: the files received are closed when collected */
+    errno = EMSGSIZE;
+    return push_error(L);
+  }
+  return 2;
+}
@@ -0,0 +1,15 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef FDPASS_H
+#define FDPASS_H
+
+#include "lua.h"
+
+int ex_socketpair(lua_State *L);
+int ex_sendfds(lua_State *L);
+int ex_recvfds(lua_State *L);
+
+#endif/*FDPASS_H*/
@@ -0,0 +1,402 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "spawn.h"
+#include "jobserver.h"
+#include "envsnap.h"
+
+/* A GNU make jobserver: a pipe or named fifo holding one byte per free job
+ * slot.  Besides the slots in the pipe, each participant owns one implicit
+ * slot.  The structure is shared by the Lua handle and every process which
+ * holds one of its tokens, and is freed when the last of them lets go. */
+struct jobserver {
+  int refs;
+  int rfd, wfd;
+  int shared;           /* the read end children inherit, for pipe servers */
+  int implicit_free;
+  int jobs;             /* total slots; only known for servers */
+  char *fifo;           /* path of a fifo we created, to be removed */
+  char *auth;           /* value for --jobserver-auth */
+};
+
+extern int push_error(lua_State *L);
+extern int ex_spawn(lua_State *L);
+
+void jobserver_ref(struct jobserver *js)
+{
+  js->refs++;
+}
+
+void jobserver_unref(struct jobserver *js)
+{
+  if (--js->refs > 0)
+    return;
+  if (js->rfd != -1) close(js->rfd);
+  if (js->wfd != -1 && js->wfd != js->rfd) close(js->wfd);
+  if (js->shared != -1) close(js->shared);
+  free(js->fifo);
+  free(js->auth);
+  free(js);
+}
+
+/* Returns a token, -1 on timeout or -2 on error with errno set. */
+int jobserver_acquire(struct jobserver *js, double deadline)
+{
+  unsigned char token;
+  struct pollfd pfd;
+  if (js->implicit_free) {
+    js->implicit_free = 0;
+    return JOBSERVER_IMPLICIT;
+  }
+  pfd.fd = js->rfd;
+  pfd.events = POLLIN;
+  for (;;) {
+    int ret = poll(&pfd, 1, remaining_ms(deadline));
+    if (ret == -1 && errno != EINTR)
+      return -2;
+    if (ret > 0) {
+      ssize_t n = read(js->rfd, &token, 1);
+      if (n == 1)
+        return token;
+      if (n == 0) {
+        errno = EPIPE;
+        return -2;
+      }
+      /* another client took the token first */
+      if (errno != EAGAIN && errno != EINTR)
+        return -2;
+    }
+    if (ret == 0 && remaining_ms(deadline) == 0)
+      return -1;
+  }
+}
+
+void jobserver_release(struct jobserver *js, int token)
+{
+  unsigned char c = token;
+  if (token == JOBSERVER_IMPLICIT)
+    js->implicit_free = 1;
+  else
+    while (-1 == write(js->wfd, &c, 1) && errno == EINTR)
+      ;
+}
+
+static struct jobserver *jobserver_alloc(lua_State *L)
+{
+  struct jobserver **pjs = lua_newuserdata(L, sizeof *pjs);
+  *pjs = calloc(1, sizeof **pjs);
+  if (!*pjs)
+    luaL_error(L, "not enough memory");
+  (*pjs)->refs = 1;
+  (*pjs)->rfd = (*pjs)->wfd = (*pjs)->shared = -1;
+  (*pjs)->implicit_free = 1;
+  luaL_getmetatable(L, JOBSERVER_HANDLE);
+  lua_setmetatable(L, -2);
+  return *pjs;
+}
+
+struct jobserver *jobserver_check(lua_State *L, int idx)
+{
+  struct jobserver **pjs = luaL_checkudata(L, idx, JOBSERVER_HANDLE);
+  if (!*pjs) luaL_error(L, "attempt to use a closed jobserver");
+  return *pjs;
+}
+
+/* Opens a private, non-blocking description of an inherited pipe end so
+ * that a failed read cannot block on a token some other client took.  Falls
+ * back to a plain duplicate where /proc is not available. */
+static int reopen(int fd, int flags)
+{
+  char path[32];
+  int d;
+  sprintf(path, "/proc/self/fd/%d", fd);
+  d = open(path, flags | O_NONBLOCK);
+  if (d == -1)
+    d = dup(fd);
+  if (d != -1)
+    fcntl(d, F_SETFD, FD_CLOEXEC);
+  return d;
+}
+
+/* [makeflags] -- jobserver/nil error */
+static int jobserver_client(lua_State *L)
+{
+  const char *flags, *auth = 0, *s;
+  struct jobserver *js;
+  size_t len;
+  int r, w;
+  lua_settop(L, 1);
+  if (lua_isnil(L, 1) && env_pushliteral(L, "MAKEFLAGS"))
+    lua_replace(L, 1);
+  flags = luaL_optstring(L, 1, 0);
+  /* the last option wins, as in make itself */
+  for (s = flags; s && (s = strstr(s, "--jobserver-")); s++) {
+    if (0 == strncmp(s, "--jobserver-auth=", 17))
+      auth = s + 17;
+    else if (0 == strncmp(s, "--jobserver-fds=", 16))
+      auth = s + 16;
+  }
+  if (!auth) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "no jobserver in MAKEFLAGS");
+    return 2;
+  }
+  len = strcspn(auth, " \t");
+  js = jobserver_alloc(L);
+  js->auth = malloc(len + 1);
+  if (!js->auth)
+    return luaL_error(L, "not enough memory");
+  memcpy(js->auth, auth, len);
+  js->auth[len] = '\0';
+  if (0 == strncmp(js->auth, "fifo:", 5)) {
+    js->rfd = js->wfd = open(js->auth + 5, O_RDWR | O_NONBLOCK);
+    if (js->rfd == -1)
+      return push_error(L);
+    fcntl(js->rfd, F_SETFD, FD_CLOEXEC);
+  }
+  else if (2 == sscanf(js->auth, "%d,%d", &r, &w)) {
+    if (-1 == fcntl(r, F_GETFD) || -1 == fcntl(w, F_GETFD)) {
+      lua_pushnil(L);
+      lua_pushliteral(L, "jobserver descriptors were not inherited");
+      return 2;
+    }
+    /* the originals stay open for sub-makes; we only close our copies */
+    js->rfd = reopen(r, O_RDONLY);
+    js->wfd = reopen(w, O_WRONLY);
+    if (js->rfd == -1 || js->wfd == -1)
+      return push_error(L);
+  }
+  else {
+    lua_pushnil(L);
+    lua_pushfstring(L, "unrecognized jobserver option '%s'", js->auth);
+    return 2;
+  }
+  return 1;
+}
+
+static int fill(struct jobserver *js, int n)
+{
+  char buf[256];
+  memset(buf, '+', sizeof buf);
+  while (n > 0) {
+    ssize_t w = write(js->wfd, buf, n < (int)sizeof buf ? n : (int)sizeof buf);
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    n -= w;
+  }
+  return 0;
+}
+
+/* jobs [opts] -- jobserver/nil error */
+static int jobserver_new(lua_State *L)
+{
+  int jobs = luaL_checknumber(L, 1);
+  int fifo = 0;
+  struct jobserver *js;
+  char auth[64];
+  static unsigned serial;
+  if (jobs < 1)
+    return luaL_argerror(L, 1, "at least one job slot expected");
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "fifo");
+    fifo = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_settop(L, 2);
+  js = jobserver_alloc(L);
+  js->jobs = jobs;
+  if (fifo) {
+    const char *tmp = 0;
+    size_t len;
+    if (env_pushliteral(L, "TMPDIR"))
+      tmp = lua_tostring(L, -1);
+    if (!tmp || !*tmp) tmp = "/tmp";
+    len = strlen(tmp) + 48;
+    if (!(js->fifo = malloc(len)) || !(js->auth = malloc(len + 5)))
+      return luaL_error(L, "not enough memory");
+    lua_settop(L, 3);
+    /* one name per server; one left behind by an earlier process with our
+     * pid is skipped */
+    for (;;) {
+      sprintf(js->fifo, "%s/ex-jobserver-%lu-%u", tmp,
+              (unsigned long)getpid(),
+              __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED));
+      if (0 == mkfifo(js->fifo, 0600))
+        break;
+      if (errno != EEXIST) {
+        free(js->fifo);
+        js->fifo = 0;
+        return push_error(L);
+      }
+    }
+    sprintf(js->auth, "fifo:%s", js->fifo);
+    js->rfd = js->wfd = open(js->fifo, O_RDWR | O_NONBLOCK);
+    if (js->rfd == -1)
+      return push_error(L);
+    fcntl(js->rfd, F_SETFD, FD_CLOEXEC);
+  }
+  else {
+    int fd[2];
+    if (-1 == pipe(fd))
+      return push_error(L);
+    /* children must inherit both ends, as with make's own jobserver; we
+     * read from a private, non-blocking end, as a client does */
+    js->shared = fd[0];
+    js->wfd = fd[1];
+    if (-1 == (js->rfd = reopen(fd[0], O_RDONLY)))
+      return push_error(L);
+    sprintf(auth, "%d,%d", fd[0], fd[1]);
+    if (!(js->auth = malloc(strlen(auth) + 1)))
+      return luaL_error(L, "not enough memory");
+    strcpy(js->auth, auth);
+  }
+  if (-1 == fill(js, jobs - 1))
+    return push_error(L);
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "export");
+    if (lua_toboolean(L, -1)) {
+      lua_pushfstring(L, " -j%d --jobserver-auth=%s", jobs, js->auth);
+      if (-1 == env_set("MAKEFLAGS", lua_tostring(L, -1)))
+        return push_error(L);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+  return 1;
+}
+
+/* jobserver [timeout] -- token/nil error */
+static int jobserver_lacquire(lua_State *L)
+{
+  struct jobserver *js = jobserver_check(L, 1);
+  double deadline = -1;
+  int token;
+  if (!lua_isnoneornil(L, 2)) {
+    lua_Number timeout = luaL_checknumber(L, 2);
+    deadline = monotime() + (timeout > 0 ? timeout : 0);
+  }
+  token = jobserver_acquire(js, deadline);
+  if (token == -2)
+    return push_error(L);
+  if (token == -1) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "timeout");
+    return 2;
+  }
+  lua_pushnumber(L, token);
+  return 1;
+}
+
+/* jobserver token -- jobserver */
+static int jobserver_lrelease(lua_State *L)
+{
+  struct jobserver *js = jobserver_check(L, 1);
+  int token = luaL_checknumber(L, 2);
+  if (token < 0 || token > JOBSERVER_IMPLICIT)
+    return luaL_argerror(L, 2, "invalid token");
+  jobserver_release(js, token);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* jobserver ... -- proc/nil error
+ * Same arguments as os.spawn; the token is released when the process is
+ * reaped. */
+static int jobserver_spawn(lua_State *L)
+{
+  jobserver_check(L, 1);
+  if (lua_istable(L, 2)) {
+    lua_pushvalue(L, 1);
+    lua_setfield(L, 2, "jobserver");
+  }
+  else {
+    lua_settop(L, 3);
+    if (lua_isnil(L, 3)) {
+      lua_newtable(L);
+      lua_replace(L, 3);
+    }
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_pushvalue(L, 1);
+    lua_setfield(L, 3, "jobserver");
+  }
+  lua_remove(L, 1);
+  return ex_spawn(L);
+}
+
+/* jobserver -- string */
+static int jobserver_makeflags(lua_State *L)
+{
+  struct jobserver *js = jobserver_check(L, 1);
+  if (js->jobs)
+    lua_pushfstring(L, " -j%d --jobserver-auth=%s", js->jobs, js->auth);
+  else
+    lua_pushfstring(L, " --jobserver-auth=%s", js->auth);
+  return 1;
+}
+
+/* jobserver -- */
+static int jobserver_close(lua_State *L)
+{
+  struct jobserver **pjs = luaL_checkudata(L, 1, JOBSERVER_HANDLE);
+  if (*pjs) {
+    if ((*pjs)->fifo)
+      unlink((*pjs)->fifo);
+    jobserver_unref(*pjs);
+    *pjs = 0;
+  }
+  return 0;
+}
+
+/* jobserver -- string */
+static int jobserver_tostring(lua_State *L)
+{
+  struct jobserver **pjs = luaL_checkudata(L, 1, JOBSERVER_HANDLE);
+  if (*pjs)
+    lua_pushfstring(L, "jobserver (%s)", (*pjs)->auth);
+  else
+    lua_pushliteral(L, "jobserver (closed)");
+  return 1;
+}
+
+/* -- jobserver-table */
+int jobserver_open(lua_State *L)
+{
+  const luaL_reg jobserver_methods[] = {
+    {"__gc",       jobserver_close},
+    {"__tostring", jobserver_tostring},
+    {"acquire",    jobserver_lacquire},
+    {"release",    jobserver_lrelease},
+    {"spawn",      jobserver_spawn},
+    {"makeflags",  jobserver_makeflags},
+    {"close",      jobserver_close},
+    {0,0} };
+  const luaL_reg jobserver_functions[] = {
+    {"client",     jobserver_client},
+    {"new",        jobserver_new},
+    {0,0} };
+  luaL_newmetatable(L, JOBSERVER_HANDLE);     /* . J */
+  luaL_register(L, 0, jobserver_methods);     /* . J */
+  lua_pushvalue(L, -1);                       /* . J J */
+  lua_setfield(L, -2, "__index");             /* . J */
+  lua_pop(L, 1);                              /* . */
+  lua_newtable(L);                            /* . jobserver */
+  luaL_register(L, 0, jobserver_functions);
+  return 1;
+}
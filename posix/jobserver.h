@@ -0,0 +1,25 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef JOBSERVER_H
+#define JOBSERVER_H
+
+#include "lua.h"
+
+#define JOBSERVER_HANDLE "jobserver"
+struct jobserver;
+
+/* the token every make client holds without reading it from the server */
+#define JOBSERVER_IMPLICIT 256
+
+struct jobserver *jobserver_check(lua_State *L, int idx);
+int jobserver_acquire(struct jobserver *js, double deadline);
+void jobserver_release(struct jobserver *js, int token);
+void jobserver_ref(struct jobserver *js);
+void jobserver_unref(struct jobserver *js);
+
+int jobserver_open(lua_State *L);
+
+#endif/*JOBSERVER_H*/
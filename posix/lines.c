@@ -0,0 +1,284 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <poll.h>
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+
+#include "lines.h"
+
+/* Line splitting over a single reusable buffer.  Data is read from the
+ * descriptor in large chunks, lines are found with memchr (vectorized in
+ * common C libraries), and each line is copied out only once, into the Lua
+ * string returned for it. */
+struct reader {
+  int fd;
+  int owned;            /* close fd when done */
+  int eof;
+  int batch;            /* lines per table in batch mode, else 0 */
+  int views;            /* return chunks with offsets instead of lines */
+  char *buf;
+  size_t size, start, end;
+};
+
+extern FILE *check_file(lua_State *L, int idx, const char *argname);
+
+static void reader_close(struct reader *r)
+{
+  if (r->owned && r->fd != -1)
+    close(r->fd);
+  r->fd = -1;
+  free(r->buf);
+  r->buf = 0;
+  r->size = r->start = r->end = 0;
+}
+
+/* reader -- */
+static int reader_gc(lua_State *L)
+{
+  reader_close(luaL_checkudata(L, 1, LINES_HANDLE));
+  return 0;
+}
+
+/* Reads more data after the unconsumed part of the buffer, moving it to the
+ * front or growing the buffer to make room.  Returns 0 at end of file. */
+static int reader_fill(lua_State *L, struct reader *r)
+{
+  ssize_t n;
+  if (r->start > 0) {
+    memmove(r->buf, r->buf + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+  }
+  if (r->end == r->size) {
+    char *buf = realloc(r->buf, r->size * 2);
+    if (!buf)
+      return luaL_error(L, "not enough memory");
+    r->buf = buf;
+    r->size *= 2;
+  }
+  for (;;) {
+    n = read(r->fd, r->buf + r->end, r->size - r->end);
+    if (n > 0) {
+      r->end += n;
+      return 1;
+    }
+    if (n == 0) {
+      r->eof = 1;
+      return 0;
+    }
+    if (errno == EAGAIN) {
+      struct pollfd pfd;
+      pfd.fd = r->fd;
+      pfd.events = POLLIN;
+      poll(&pfd, 1, -1);
+    }
+    else if (errno != EINTR)
+      return luaL_error(L, "%s", strerror(errno));
+  }
+}
+
+/* Pushes the next line, or nothing at end of input.  Returns the number of
+ * values pushed. */
+static int reader_line(lua_State *L, struct reader *r)
+{
+  for (;;) {
+    char *p = r->buf + r->start;
+    char *nl = memchr(p, '\n', r->end - r->start);
+    if (nl) {
+      lua_pushlstring(L, p, nl - p);
+      r->start += nl - p + 1;
+      return 1;
+    }
+    if (r->eof) {
+      if (r->start == r->end)
+        return 0;
+      lua_pushlstring(L, p, r->end - r->start);
+      r->start = r->end;
+      return 1;
+    }
+    reader_fill(L, r);
+  }
+}
+
+/* Returns the last newline in p[0..len), or NULL. */
+static char *lastnl(char *p, size_t len)
+{
+#ifdef __GLIBC__
+  return memrchr(p, '\n', len);
+#else
+  while (len > 0)
+    if (p[--len] == '\n')
+      return p + len;
+  return 0;
+#endif
+}
+
+/* reader -- line/lines/chunk offsets/nil */
+static int reader_next(lua_State *L)
+{
+  struct reader *r = luaL_checkudata(L, 1, LINES_HANDLE);
+  int n = 0;
+  if (!r->buf)
+    return 0;
+  if (r->views) {
+    char *p, *nl, *last;
+    while (!(last = lastnl(r->buf + r->start, r->end - r->start)) && !r->eof)
+      reader_fill(L, r);
+    if (!last)
+      last = r->buf + r->end - 1;
+    if (r->start == r->end)
+      n = 0;
+    else {
+      lua_pushlstring(L, r->buf + r->start, last - (r->buf + r->start) + 1);
+      lua_newtable(L);
+      for (p = r->buf + r->start; p <= last; p = nl + 1) {
+        nl = memchr(p, '\n', last - p + 1);
+        if (!nl) nl = last + 1;
+        lua_pushnumber(L, p - (r->buf + r->start) + 1);
+        lua_rawseti(L, -2, ++n);
+        lua_pushnumber(L, nl - p);
+        lua_rawseti(L, -2, ++n);
+      }
+      r->start = last - r->buf + 1;
+      n = 2;
+    }
+  }
+  else if (r->batch) {
+    int i = 0;
+    lua_createtable(L, r->batch, 0);
+    while (i < r->batch) {
+      /* after the first line, only take what is already buffered */
+      if (i > 0 && !r->eof && !memchr(r->buf + r->start, '\n',
+                                      r->end - r->start))
+        break;
+      if (!reader_line(L, r))
+        break;
+      lua_rawseti(L, -2, ++i);
+    }
+    n = i > 0;
+    if (!n) lua_pop(L, 1);
+  }
+  else
+    n = reader_line(L, r);
+  if (n == 0)
+    reader_close(r);
+  return n;
+}
+
+/* Pushes an iterator function and its state which read lines from fd,
+ * starting with len bytes of data already read from it.  opts is the stack
+ * index of an options table, or 0. */
+int lines_push(lua_State *L, int fd, int owned,
+               const char *data, size_t len, int opts)
+{
+  struct reader *r;
+  size_t size = 65536;
+  int batch = 0, views = 0;
+  if (opts && lua_istable(L, opts)) {
+    lua_getfield(L, opts, "size");
+    size = luaL_optnumber(L, -1, size);
+    lua_getfield(L, opts, "batch");
+    batch = luaL_optnumber(L, -1, 0);
+    lua_getfield(L, opts, "views");
+    views = lua_toboolean(L, -1);
+    lua_pop(L, 3);
+  }
+  if (size < 4096)
+    size = 4096;
+  while (size < len)
+    size *= 2;
+  lua_pushcfunction(L, reader_next);
+  r = lua_newuserdata(L, sizeof *r);
+  r->fd = fd;
+  r->owned = owned;
+  r->eof = fd == -1;
+  r->batch = batch > 0 ? batch : 0;
+  r->views = views;
+  r->start = 0;
+  r->end = len;
+  r->size = size;
+  r->buf = malloc(size);
+  luaL_getmetatable(L, LINES_HANDLE);
+  lua_setmetatable(L, -2);
+  if (!r->buf) {
+    if (owned) close(fd);
+    r->fd = -1;
+    return luaL_error(L, "not enough memory");
+  }
+  if (len)
+    memcpy(r->buf, data, len);
+  return 2;
+}
+
+/* Returns the number of bytes which stdio has read ahead from the
+ * descriptor of f, or 0 if that cannot be told, as for a pipe outside
+ * glibc. */
+static size_t file_pending(FILE *f)
+{
+#ifdef __GLIBC__
+  if (f->_IO_write_ptr > f->_IO_write_base)
+    return 0;
+  return f->_IO_read_end - f->_IO_read_ptr;
+#else
+  off_t pos = ftello(f), off = lseek(fileno(f), 0, SEEK_CUR);
+  return pos == -1 || off == -1 || off < pos ? 0 : off - pos;
+#endif
+}
+
+/* fd/file [opts] -- iter state
+ * A file's read-ahead is taken first, so that the iterator starts where
+ * stdio would. */
+int ex_lines(lua_State *L)
+{
+  if (lua_type(L, 1) == LUA_TNUMBER)
+    lines_push(L, lua_tonumber(L, 1), 0, 0, 0, 2);
+  else {
+    FILE *f = check_file(L, 1, NULL);
+    luaL_Buffer b;
+    size_t n, len;
+    const char *data;
+    luaL_buffinit(L, &b);
+    while ((n = file_pending(f)) > 0) {
+      if (n > LUAL_BUFFERSIZE)
+        n = LUAL_BUFFERSIZE;
+      if (!(n = fread(luaL_prepbuffer(&b), 1, n, f)))
+        break;
+      luaL_addsize(&b, n);
+    }
+    luaL_pushresult(&b);
+    data = lua_tolstring(L, -1, &len);
+    lines_push(L, fileno(f), 0, data, len, 2);
+    lua_remove(L, -3);
+  }
+  if (lua_type(L, 1) == LUA_TUSERDATA) {
+    /* keep the file open for as long as the iterator lives */
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_setfenv(L, -2);
+  }
+  return 2;
+}
+
+int lines_open(lua_State *L)
+{
+  luaL_newmetatable(L, LINES_HANDLE);
+  lua_pushcfunction(L, reader_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+  return 0;
+}
@@ -0,0 +1,19 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef LINES_H
+#define LINES_H
+
+#include <stddef.h>
+#include "lua.h"
+
+#define LINES_HANDLE "lines"
+
+int lines_push(lua_State *L, int fd, int owned,
+               const char *data, size_t len, int opts);
+int ex_lines(lua_State *L);
+int lines_open(lua_State *L);
+
+#endif/*LINES_H*/
@@ -0,0 +1,489 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "spawn.h"
+#include "lockfile.h"
+
+extern int push_error(lua_State *L);
+
+/* Byte-range locks are open file description locks where the system has
+ * them, so that they belong to the file object which took them: closing
+ * another descriptor for the same file does not drop them, and a second
+ * open of the file in the same process contends like another process
+ * would.  Elsewhere, and on kernels which refuse them, they are ordinary
+ * process-associated locks. */
+
+#ifdef F_OFD_SETLK
+static int ofd = 1;
+#endif
+
+#define LOCK_MINDELAY 0.001
+#define LOCK_MAXDELAY 0.05
+
+/* EINVAL from an OFD request means either an old kernel or a bad range;
+ * only the first, where the plain request does not fail the same way,
+ * turns OFD locks off. */
+static int setlk(int fd, struct flock *k, int wait)
+{
+#ifdef F_OFD_SETLK
+  if (ofd) {
+    int ret = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, k);
+    if (ret == 0 || errno != EINVAL)
+      return ret;
+    ret = fcntl(fd, wait ? F_SETLKW : F_SETLK, k);
+    if (ret == 0 || errno != EINVAL)
+      ofd = 0;
+    return ret;
+  }
+#endif
+  return fcntl(fd, wait ? F_SETLKW : F_SETLK, k);
+}
+
+#if defined(SIGEV_THREAD_ID) && defined(SYS_gettid)
+
+/* A timed wait is a blocking request which a timer interrupts: the timer
+ * sends a real-time signal to the waiting thread only, whose handler does
+ * nothing and is installed without SA_RESTART, so that fcntl fails with
+ * EINTR.  The timer repeats, lest it fire just before fcntl blocks.  If
+ * the signal already has a handler, or no timer can be made, the wait
+ * polls instead. */
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define LOCK_REPEAT 0.01
+
+static pthread_once_t lock_once = PTHREAD_ONCE_INIT;
+static int lock_signal = -1;
+
+static void lock_alarm(int sig)
+{
+  (void)sig;
+}
+
+static void lock_init(void)
+{
+  struct sigaction sa;
+  int sig = SIGRTMAX;
+  if (-1 == sigaction(sig, 0, &sa) || (sa.sa_flags & SA_SIGINFO)
+      || sa.sa_handler != SIG_DFL)
+    return;
+  sa.sa_handler = lock_alarm;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  if (0 == sigaction(sig, &sa, 0))
+    lock_signal = sig;
+}
+
+static void set_seconds(struct timespec *ts, double t)
+{
+  ts->tv_sec = (time_t)t;
+  ts->tv_nsec = (long)((t - ts->tv_sec) * 1e9);
+}
+
+/* Waits up to timeout seconds for a lock.  Returns 0, -1 with errno set,
+ * or -2 if the wait must poll instead. */
+static int setlk_timed(int fd, struct flock *k, double timeout)
+{
+  struct sigevent sev;
+  struct itimerspec its;
+  timer_t timer;
+  sigset_t set, old;
+  double deadline = monotime() + timeout;
+  int ret, err;
+  pthread_once(&lock_once, lock_init);
+  if (lock_signal == -1)
+    return -2;
+  memset(&sev, 0, sizeof sev);
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = lock_signal;
+  sev.sigev_notify_thread_id = syscall(SYS_gettid);
+  if (-1 == timer_create(CLOCK_MONOTONIC, &sev, &timer))
+    return -2;
+  set_seconds(&its.it_value, timeout > 1e-9 ? timeout : 1e-9);
+  set_seconds(&its.it_interval, LOCK_REPEAT);
+  sigemptyset(&set);
+  sigaddset(&set, lock_signal);
+  pthread_sigmask(SIG_UNBLOCK, &set, &old);
+  if (-1 == timer_settime(timer, 0, &its, 0))
+    ret = -2;
+  else
+    while (-1 == (ret = setlk(fd, k, 1)) && errno == EINTR)
+      if (monotime() >= deadline) {
+        errno = ETIMEDOUT;
+        break;
+      }
+  err = errno;
+  timer_delete(timer);
+  pthread_sigmask(SIG_SETMASK, &old, 0);
+  errno = err;
+  return ret;
+}
+
+#else
+
+#define setlk_timed(fd, k, timeout) (-2)
+
+#endif
+
+/* Locks, or with F_UNLCK unlocks, a range of fd, waiting up to timeout
+ * seconds (forever if negative) for a conflicting lock to go.  Sets
+ * *contended if the lock was not free at first.  Returns 0, or -1 with
+ * errno set; ETIMEDOUT means the lock could not be taken in time. */
+int lock_range(int fd, int type, off_t start, off_t len, double timeout,
+               int *contended)
+{
+  struct flock k;
+  double deadline, delay = LOCK_MINDELAY;
+  int ret;
+  memset(&k, 0, sizeof k);
+  k.l_type = type;
+  k.l_whence = SEEK_SET;
+  k.l_start = start;
+  k.l_len = len;
+  if (0 == setlk(fd, &k, 0))
+    return 0;
+  if (errno != EAGAIN && errno != EACCES)
+    return -1;
+  if (contended)
+    *contended = 1;
+  if (timeout == 0)
+    return errno = EAGAIN, -1;
+  if (timeout < 0) {
+    while (-1 == setlk(fd, &k, 1))
+      if (errno != EINTR)
+        return -1;
+    return 0;
+  }
+  if (-2 != (ret = setlk_timed(fd, &k, timeout)))
+    return ret;
+  /* without a timer, poll with backoff */
+  deadline = monotime() + timeout;
+  for (;;) {
+    struct timespec ts;
+    double left = deadline - monotime();
+    if (left <= 0)
+      return errno = ETIMEDOUT, -1;
+    if (delay > left)
+      delay = left;
+    ts.tv_sec = (time_t)delay;
+    ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+    nanosleep(&ts, 0);
+    if (0 == setlk(fd, &k, 0))
+      return 0;
+    if (errno != EAGAIN && errno != EACCES)
+      return -1;
+    if ((delay *= 2) > LOCK_MAXDELAY)
+      delay = LOCK_MAXDELAY;
+  }
+}
+
+/* ... options -- ...
+ * Returns the timeout given by {wait=boolean, timeout=seconds}: 0 not to
+ * wait, or -1 to wait forever.  A timeout implies waiting. */
+double lock_timeout(lua_State *L, int idx, int wait)
+{
+  double timeout;
+  if (lua_isnoneornil(L, idx))
+    return wait ? -1 : 0;
+  luaL_checktype(L, idx, LUA_TTABLE);
+  lua_getfield(L, idx, "wait");
+  if (!lua_isnil(L, -1))
+    wait = lua_toboolean(L, -1);
+  lua_getfield(L, idx, "timeout");
+  if (lua_isnil(L, -1))
+    timeout = wait ? -1 : 0;
+  else {
+    timeout = luaL_checknumber(L, -1);
+    if (timeout < 0)
+      timeout = 0;
+  }
+  lua_pop(L, 2);
+  return timeout;
+}
+
+
+/* Lock files.  The registry keeps, by pathname, the locks this process
+ * holds and the statistics of every lock file it has used:
+ *   ex.locks = { [path] = { lock = lock, acquired = n, contended = n,
+ *                           timeouts = n, wait = seconds, maxwait = seconds } }
+ * A path locked again by the same process gets the lock it already holds,
+ * with its count raised; the file is unlocked when the count drops to 0. */
+
+#define LOCKS "ex.locks"
+#define LOCKFILE_HANDLE "ex.lockfile"
+
+struct lockfile {
+  int fd;
+  int count;
+  int type;
+};
+
+static void add_stat(lua_State *L, int idx, const char *k, double n)
+{
+  lua_getfield(L, idx, k);
+  n += lua_tonumber(L, -1);
+  lua_pop(L, 1);
+  lua_pushnumber(L, n);
+  lua_setfield(L, idx, k);
+}
+
+/* path -- path stats */
+static void get_stats(lua_State *L, int path)
+{
+  lua_getfield(L, LUA_REGISTRYINDEX, LOCKS);  /* locks */
+  lua_pushvalue(L, path);
+  lua_rawget(L, -2);                          /* locks stats */
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_createtable(L, 0, 6);                 /* locks stats */
+    lua_pushvalue(L, path);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  }
+  lua_replace(L, -2);                         /* stats */
+}
+
+/* path [options] -- lock/nil error */
+static int ex_lockfile(lua_State *L)
+{
+  static const char *const modes[] = { "r", "w", 0 };
+  const char *path = luaL_checkstring(L, 1);
+  int type = F_WRLCK, stats, contended = 0, err;
+  double timeout, start, waited;
+  struct lockfile *lk;
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "mode");
+    if (!lua_isnil(L, -1)) {
+      const char *mode = luaL_checkstring(L, -1);
+      int i;
+      for (i = 0; modes[i] && strcmp(mode, modes[i]); i++)
+        ;
+      if (!modes[i])
+        return luaL_error(L, "bad mode option (%s)", mode);
+      type = i == 0 ? F_RDLCK : F_WRLCK;
+    }
+    lua_pop(L, 1);
+  }
+  timeout = lock_timeout(L, 2, 1);
+  lua_settop(L, 1);
+  get_stats(L, 1);                            /* path stats */
+  stats = 2;
+  lua_getfield(L, stats, "lock");             /* path stats lock? */
+  if (!lua_isnil(L, -1)) {
+    lk = lua_touserdata(L, -1);
+    if (type == F_WRLCK && lk->type == F_RDLCK) {
+      start = monotime();
+      if (-1 == lock_range(lk->fd, F_WRLCK, 0, 0, timeout, &contended))
+        goto failed;
+      lk->type = F_WRLCK;
+      goto acquired;
+    }
+    lk->count++;
+    return 1;
+  }
+  lua_pop(L, 1);                              /* path stats */
+  lk = lua_newuserdata(L, sizeof *lk);        /* path stats lock */
+  lk->fd = -1;
+  lk->count = 0;
+  lk->type = type;
+  luaL_getmetatable(L, LOCKFILE_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setfenv(L, -2);
+  /* read-write where possible, so that a read lock can be upgraded */
+  lk->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (lk->fd == -1 && type == F_RDLCK && (errno == EACCES || errno == EROFS))
+    lk->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (lk->fd == -1)
+    return push_error(L);
+  start = monotime();
+  if (-1 == lock_range(lk->fd, type, 0, 0, timeout, &contended)) {
+    err = errno;
+    close(lk->fd);
+    lk->fd = -1;
+    errno = err;
+    goto failed;
+  }
+  lua_pushvalue(L, -1);
+  lua_setfield(L, stats, "lock");
+acquired:
+  waited = monotime() - start;
+  lk->count++;
+  add_stat(L, stats, "acquired", 1);
+  if (contended) {
+    add_stat(L, stats, "contended", 1);
+    add_stat(L, stats, "wait", waited);
+    lua_getfield(L, stats, "maxwait");
+    if (waited > lua_tonumber(L, -1)) {
+      lua_pushnumber(L, waited);
+      lua_setfield(L, stats, "maxwait");
+    }
+    lua_pop(L, 1);
+  }
+  return 1;
+failed:
+  err = errno;
+  if (contended) {
+    add_stat(L, stats, "contended", 1);
+    add_stat(L, stats, "wait", monotime() - start);
+  }
+  errno = err;
+  if (errno == ETIMEDOUT) {
+    add_stat(L, stats, "timeouts", 1);
+    lua_pushnil(L);
+    lua_pushliteral(L, "timeout");
+    return 2;
+  }
+  return push_error(L);
+}
+
+static struct lockfile *check_lockfile(lua_State *L, int idx)
+{
+  return luaL_checkudata(L, idx, LOCKFILE_HANDLE);
+}
+
+/* Closes the lock file, which unlocks it, and forgets it. */
+static void lockfile_drop(lua_State *L, struct lockfile *lk)
+{
+  if (lk->fd != -1) {
+    close(lk->fd);
+    lk->fd = -1;
+  }
+  lk->count = 0;
+  lua_getfenv(L, 1);                          /* lock E */
+  lua_rawgeti(L, -1, 1);                      /* lock E path */
+  get_stats(L, lua_gettop(L));                /* lock E path stats */
+  lua_pushnil(L);
+  lua_setfield(L, -2, "lock");
+  lua_pop(L, 3);
+}
+
+/* lock -- true/nil error */
+static int lockfile_release(lua_State *L)
+{
+  struct lockfile *lk = check_lockfile(L, 1);
+  if (lk->count <= 0)
+    return luaL_error(L, "attempt to release a lock which is not held");
+  if (--lk->count == 0)
+    lockfile_drop(L, lk);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* lock -- count */
+static int lockfile_count(lua_State *L)
+{
+  lua_pushnumber(L, check_lockfile(L, 1)->count);
+  return 1;
+}
+
+/* lock -- */
+static int lockfile_gc(lua_State *L)
+{
+  struct lockfile *lk = check_lockfile(L, 1);
+  if (lk->fd != -1) {
+    close(lk->fd);
+    lk->fd = -1;
+  }
+  return 0;
+}
+
+/* lock -- string */
+static int lockfile_tostring(lua_State *L)
+{
+  struct lockfile *lk = check_lockfile(L, 1);
+  lua_getfenv(L, 1);
+  lua_rawgeti(L, -1, 1);
+  if (lk->count > 0)
+    lua_pushfstring(L, "lockfile (%s, %s, held %d)", lua_tostring(L, -1),
+                    lk->type == F_WRLCK ? "w" : "r", lk->count);
+  else
+    lua_pushfstring(L, "lockfile (%s, released)", lua_tostring(L, -1));
+  return 1;
+}
+
+/* -- { [path] = stats } */
+static int ex_lockstats(lua_State *L)
+{
+  lua_newtable(L);                            /* T */
+  lua_getfield(L, LUA_REGISTRYINDEX, LOCKS);  /* T locks */
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {                   /* T locks path stats */
+    lua_createtable(L, 0, 7);                 /* T locks path stats S */
+    lua_pushnil(L);
+    while (lua_next(L, -3)) {                 /* T locks path stats S k v */
+      if (lua_isuserdata(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushboolean(L, 1);
+        lua_setfield(L, -3, "held");
+      }
+      else {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);                    /* ... S k k v */
+        lua_rawset(L, -4);                    /* ... S k */
+      }
+    }
+    lua_pushvalue(L, -3);                     /* T locks path stats S path */
+    lua_insert(L, -2);                        /* T locks path stats path S */
+    lua_rawset(L, -6);                        /* T locks path stats */
+    lua_pop(L, 1);                            /* T locks path */
+  }
+  lua_pop(L, 1);                              /* T */
+  return 1;
+}
+
+/* ex -- ex */
+int lockfile_open(lua_State *L)
+{
+  const luaL_reg methods[] = {
+    {"release",  lockfile_release},
+    {"count",    lockfile_count},
+    {0,0} };
+  luaL_newmetatable(L, LOCKFILE_HANDLE);      /* ex M */
+  lua_newtable(L);                            /* ex M I */
+  luaL_register(L, 0, methods);               /* ex M I */
+  lua_setfield(L, -2, "__index");             /* ex M */
+  lua_pushcfunction(L, lockfile_gc);          /* ex M gc */
+  lua_setfield(L, -2, "__gc");                /* ex M */
+  lua_pushcfunction(L, lockfile_tostring);    /* ex M tostring */
+  lua_setfield(L, -2, "__tostring");          /* ex M */
+  lua_pop(L, 1);                              /* ex */
+  lua_newtable(L);                            /* ex locks */
+  lua_setfield(L, LUA_REGISTRYINDEX, LOCKS);  /* ex */
+  lua_pushcfunction(L, ex_lockfile);          /* ex lockfile */
+  lua_setfield(L, -2, "lockfile");            /* ex */
+  lua_pushcfunction(L, ex_lockstats);         /* ex lockstats */
+  lua_setfield(L, -2, "lockstats");           /* ex */
+  return 0;
+}
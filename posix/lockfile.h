@@ -0,0 +1,18 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef LOCKFILE_H
+#define LOCKFILE_H
+
+#include <sys/types.h>
+
+#include "lua.h"
+
+int lock_range(int fd, int type, off_t start, off_t len, double timeout,
+               int *contended);
+double lock_timeout(lua_State *L, int idx, int wait);
+int lockfile_open(lua_State *L);
+
+#endif/*LOCKFILE_H*/
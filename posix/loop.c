@@ -0,0 +1,569 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#endif
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "spawn.h"
+#include "loop.h"
+
+#ifdef __linux__
+
+/* A readiness loop over epoll.  Every source is a descriptor owned by the
+ * loop: files are duplicated, processes are watched through pidfds, signals
+ * through signalfds and timers through timerfds.  Watches live in an array
+ * indexed by id; the epoll data carries the id and a generation count, so
+ * that events for a watch removed during dispatch are dropped.  Handlers,
+ * and the objects watched, are kept in the loop's environment table. */
+
+enum { WATCH_FREE, WATCH_FILE, WATCH_PROC, WATCH_SIGNAL, WATCH_TIMER };
+
+struct watch {
+  int kind;
+  int fd;
+  unsigned gen;
+  int mode;             /* for files: 1 to read, 2 to write */
+  int sig;              /* for signals: the signal, which is blocked */
+  int periodic;         /* for timers */
+  int ready;            /* for processes: terminated before being added */
+};
+
+struct loop {
+  int epfd;
+  int stopped;
+  int count;            /* active watches */
+  int nready;           /* processes to dispatch without waiting */
+  struct watch *w;
+  int size;
+};
+
+#define LOOP_EVENTS 64
+
+#ifndef NSIG
+#define NSIG 65
+#endif
+
+/* watches per signal, so that a signal stays blocked until its last watch
+ * is removed */
+static int sigwatches[NSIG];
+
+extern int push_error(lua_State *L);
+extern FILE *check_file(lua_State *L, int idx, const char *argname);
+
+static struct loop *check_loop(lua_State *L, int idx)
+{
+  struct loop *lp = luaL_checkudata(L, idx, LOOP_HANDLE);
+  if (lp->epfd == -1)
+    luaL_error(L, "attempt to use a closed loop");
+  return lp;
+}
+
+/* Returns a free watch id, growing the array if needed. */
+static int watch_alloc(lua_State *L, struct loop *lp)
+{
+  int id;
+  for (id = 0; id < lp->size; id++)
+    if (lp->w[id].kind == WATCH_FREE)
+      return id;
+  {
+    int size = lp->size ? 2 * lp->size : 16;
+    struct watch *w = realloc(lp->w, size * sizeof *w);
+    if (!w)
+      luaL_error(L, "not enough memory");
+    for (id = lp->size; id < size; id++) {
+      w[id].kind = WATCH_FREE;
+      w[id].gen = 0;
+    }
+    id = lp->size;
+    lp->w = w;
+    lp->size = size;
+  }
+  return id;
+}
+
+static void watch_release(struct loop *lp, int id)
+{
+  struct watch *w = &lp->w[id];
+  if (w->fd != -1) {
+    epoll_ctl(lp->epfd, EPOLL_CTL_DEL, w->fd, 0);
+    close(w->fd);
+  }
+  if (w->kind == WATCH_SIGNAL && --sigwatches[w->sig] == 0) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, w->sig);
+    sigprocmask(SIG_UNBLOCK, &set, 0);
+  }
+  if (w->kind == WATCH_PROC && w->ready)
+    lp->nready--;
+  w->kind = WATCH_FREE;
+  w->gen++;
+  lp->count--;
+}
+
+/* loop id -- loop
+ * Forgets the handler and watched object of a released watch. */
+static void watch_unref(lua_State *L, int loop, int id)
+{
+  lua_getfenv(L, loop);
+  lua_pushnil(L);
+  lua_rawseti(L, -2, id + 1);
+  lua_getfield(L, -1, "objects");
+  lua_pushnil(L);
+  lua_rawseti(L, -2, id + 1);
+  lua_pop(L, 2);
+}
+
+/* Adds fd (owned by the loop from now on, even on failure) and stores the
+ * handler at index handler and the object at index obj (or 0) in the
+ * environment.  Pushes the id, or returns 0 with errno set. */
+static int watch_add(lua_State *L, struct loop *lp, int kind, int fd,
+                     unsigned events, int handler, int obj)
+{
+  struct epoll_event ev;
+  struct watch *w;
+  int id;
+  if (fd == -1 && kind != WATCH_PROC)
+    return 0;
+  id = watch_alloc(L, lp);
+  w = &lp->w[id];
+  if (fd != -1) {
+    ev.events = events;
+    ev.data.u64 = (uint64_t)w->gen << 32 | (unsigned)id;
+    if (-1 == epoll_ctl(lp->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return 0;
+    }
+  }
+  w->kind = kind;
+  w->fd = fd;
+  w->mode = w->sig = w->periodic = w->ready = 0;
+  lp->count++;
+  lua_getfenv(L, 1);
+  lua_pushvalue(L, handler);
+  lua_rawseti(L, -2, id + 1);
+  if (obj) {
+    lua_getfield(L, -1, "objects");
+    lua_pushvalue(L, obj);
+    lua_rawseti(L, -2, id + 1);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  lua_pushnumber(L, id);
+  return 1;
+}
+
+static void check_handler(lua_State *L, int idx)
+{
+  int t = lua_type(L, idx);
+  if (t != LUA_TFUNCTION && t != LUA_TTHREAD)
+    luaL_typerror(L, idx, "function or coroutine");
+}
+
+static int dupfd(int fd)
+{
+  return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+/* loop file-or-fd mode handler -- id/nil error */
+static int loop_file(lua_State *L)
+{
+  static const char *const modes[] = { "r", "w", "rw", 0 };
+  struct loop *lp = check_loop(L, 1);
+  int mode = luaL_checkoption(L, 3, 0, modes) + 1;
+  int fd;
+  check_handler(L, 4);
+  fd = lua_type(L, 2) == LUA_TNUMBER ? (int)lua_tonumber(L, 2)
+                                     : fileno(check_file(L, 2, 0));
+  if (!watch_add(L, lp, WATCH_FILE, dupfd(fd),
+                 (mode & 1 ? EPOLLIN : 0) | (mode & 2 ? EPOLLOUT : 0),
+                 4, lua_type(L, 2) == LUA_TNUMBER ? 0 : 2))
+    return push_error(L);
+  lp->w[(int)lua_tonumber(L, -1)].mode = mode;
+  return 1;
+}
+
+/* loop proc handler -- id/nil error */
+static int loop_process(lua_State *L)
+{
+  struct loop *lp = check_loop(L, 1);
+  int fd;
+  luaL_checkudata(L, 2, PROCESS_HANDLE);
+  check_handler(L, 3);
+  fd = process_waitfd(L, 2);
+  if (fd == -1)
+    return push_error(L);
+  if (!watch_add(L, lp, WATCH_PROC, fd == -2 ? -1 : fd, EPOLLIN, 3, 2))
+    return push_error(L);
+  if (fd == -2) {
+    lp->w[(int)lua_tonumber(L, -1)].ready = 1;
+    lp->nready++;
+  }
+  return 1;
+}
+
+/* loop signal handler -- id/nil error
+ * The signal is blocked while it is watched. */
+static int loop_signal(lua_State *L)
+{
+  struct loop *lp = check_loop(L, 1);
+  int sig = check_signal(L, 2, 0);
+  sigset_t set;
+  int fd;
+  check_handler(L, 3);
+  if (sig <= 0 || sig >= NSIG)
+    return luaL_argerror(L, 2, "invalid signal");
+  if (sig == SIGCHLD)
+    return luaL_argerror(L, 2, "use loop:process() to watch children");
+  sigemptyset(&set);
+  sigaddset(&set, sig);
+  fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd != -1)
+    sigprocmask(SIG_BLOCK, &set, 0);
+  if (!watch_add(L, lp, WATCH_SIGNAL, fd, EPOLLIN, 3, 0)) {
+    if (fd != -1 && sigwatches[sig] == 0)
+      sigprocmask(SIG_UNBLOCK, &set, 0);
+    return push_error(L);
+  }
+  lp->w[(int)lua_tonumber(L, -1)].sig = sig;
+  sigwatches[sig]++;
+  return 1;
+}
+
+static void set_timespec(struct timespec *ts, lua_Number seconds)
+{
+  if (seconds < 0)
+    seconds = 0;
+  ts->tv_sec = seconds;
+  ts->tv_nsec = (seconds - ts->tv_sec) * 1e9;
+}
+
+/* loop seconds [interval] handler -- id/nil error */
+static int loop_timer(lua_State *L)
+{
+  struct loop *lp = check_loop(L, 1);
+  lua_Number first = luaL_checknumber(L, 2);
+  lua_Number interval = 0;
+  struct itimerspec its;
+  int fd, h = 3;
+  if (lua_type(L, 3) == LUA_TNUMBER) {
+    interval = lua_tonumber(L, 3);
+    h = 4;
+  }
+  check_handler(L, h);
+  set_timespec(&its.it_value, first);
+  set_timespec(&its.it_interval, interval);
+  /* a zero it_value would disarm the timer */
+  if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+    its.it_value.tv_nsec = 1;
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd != -1 && -1 == timerfd_settime(fd, 0, &its, 0)) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    fd = -1;
+  }
+  if (!watch_add(L, lp, WATCH_TIMER, fd, EPOLLIN, h, 0))
+    return push_error(L);
+  lp->w[(int)lua_tonumber(L, -1)].periodic = interval > 0;
+  return 1;
+}
+
+/* loop id -- loop */
+static int loop_remove(lua_State *L)
+{
+  struct loop *lp = check_loop(L, 1);
+  lua_Number n = luaL_checknumber(L, 2);
+  int id = n;
+  if (id != n || id < 0 || id >= lp->size || lp->w[id].kind == WATCH_FREE)
+    return luaL_argerror(L, 2, "no such watch");
+  watch_release(lp, id);
+  watch_unref(L, 1, id);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* Calls or resumes the handler of watch id with the nargs values on top of
+ * the stack.  A coroutine handler is used once: its watch is released
+ * first. */
+static void dispatch(lua_State *L, struct loop *lp, int id, int nargs,
+                     int once)
+{
+  lua_getfenv(L, 1);
+  lua_rawgeti(L, -1, id + 1);                 /* ... args env handler */
+  lua_replace(L, -2);                         /* ... args handler */
+  lua_insert(L, -1 - nargs);                  /* ... handler args */
+  lua_pushnumber(L, id);
+  lua_insert(L, -1 - nargs);                  /* ... handler id args */
+  if (once || lua_type(L, -2 - nargs) == LUA_TTHREAD) {
+    watch_release(lp, id);
+    watch_unref(L, 1, id);
+  }
+  if (lua_type(L, -2 - nargs) == LUA_TTHREAD) {
+    lua_State *co = lua_tothread(L, -2 - nargs);
+    int status;
+    lua_xmove(L, co, 1 + nargs);
+    lua_pop(L, 1);
+    status = lua_resume(co, 1 + nargs);
+    if (status != 0 && status != LUA_YIELD) {
+      lua_xmove(co, L, 1);
+      lua_error(L);
+    }
+    lua_settop(co, 0);
+  }
+  else
+    lua_call(L, 1 + nargs, 0);
+}
+
+/* Pushes the arguments for an event on watch id and returns their number,
+ * or -1 if the event is spurious. */
+static int event_args(lua_State *L, struct loop *lp, int id, unsigned events,
+                      int *once)
+{
+  struct watch *w = &lp->w[id];
+  *once = 0;
+  switch (w->kind) {
+  case WATCH_FILE: {
+    char s[3], *p = s;
+    if (w->mode & 1 && events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      *p++ = 'r';
+    if (w->mode & 2 && events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+      *p++ = 'w';
+    lua_pushlstring(L, s, p - s);
+    return 1;
+  }
+  case WATCH_PROC:
+    *once = 1;
+    lua_pushcfunction(L, process_poll);
+    lua_getfenv(L, 1);
+    lua_getfield(L, -1, "objects");
+    lua_rawgeti(L, -1, id + 1);
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    lua_call(L, 1, 2);                        /* exitcode status */
+    if (lua_type(L, -2) == LUA_TBOOLEAN) {
+      lua_pop(L, 2);
+      return -1;
+    }
+    return 2;
+  case WATCH_SIGNAL: {
+    struct signalfd_siginfo si;
+    if (read(w->fd, &si, sizeof si) != sizeof si)
+      return -1;
+    lua_pushnumber(L, si.ssi_signo);
+    return 1;
+  }
+  case WATCH_TIMER: {
+    uint64_t expirations;
+    if (read(w->fd, &expirations, sizeof expirations) != sizeof expirations)
+      return -1;
+    *once = !w->periodic;
+    lua_pushnumber(L, (lua_Number)expirations);
+    return 1;
+  }
+  }
+  return -1;
+}
+
+/* Waits up to timeout_ms for events and dispatches them.  Returns the
+ * number dispatched, or -1 with errno set. */
+static int loop_once(lua_State *L, struct loop *lp, int timeout_ms)
+{
+  struct epoll_event ev[LOOP_EVENTS];
+  int i, n, nargs, once, dispatched = 0;
+  if (lp->nready) {
+    for (i = 0; i < lp->size; i++) {
+      if (lp->w[i].kind != WATCH_PROC || !lp->w[i].ready)
+        continue;
+      if ((nargs = event_args(L, lp, i, 0, &once)) < 0)
+        continue;
+      dispatch(L, lp, i, nargs, 1);
+      dispatched++;
+    }
+    if (lp->epfd == -1)
+      return dispatched;
+    timeout_ms = 0;
+  }
+  do n = epoll_wait(lp->epfd, ev, LOOP_EVENTS, timeout_ms);
+  while (n == -1 && errno == EINTR && timeout_ms == -1);
+  if (n == -1)
+    return errno == EINTR ? dispatched : -1;
+  for (i = 0; i < n && lp->epfd != -1; i++) {
+    int id = ev[i].data.u64 & 0xffffffff;
+    unsigned gen = ev[i].data.u64 >> 32;
+    if (id >= lp->size || lp->w[id].kind == WATCH_FREE || lp->w[id].gen != gen)
+      continue;
+    nargs = event_args(L, lp, id, ev[i].events, &once);
+    if (nargs < 0)
+      continue;
+    dispatch(L, lp, id, nargs, once);
+    dispatched++;
+  }
+  return dispatched;
+}
+
+static int opt_timeout_ms(lua_State *L, int idx)
+{
+  lua_Number t;
+  if (lua_isnoneornil(L, idx))
+    return -1;
+  t = luaL_checknumber(L, idx);
+  return t <= 0 ? 0 : (int)(t * 1000 + 0.999);
+}
+
+/* loop [timeout] -- count/nil error
+ * Dispatches one batch of events. */
+static int loop_step(lua_State *L)
+{
+  struct loop *lp = check_loop(L, 1);
+  int n = loop_once(L, lp, opt_timeout_ms(L, 2));
+  if (n == -1)
+    return push_error(L);
+  lua_pushnumber(L, n);
+  return 1;
+}
+
+/* loop [timeout] -- count/nil error
+ * Dispatches events until there are no watches left, the loop is stopped,
+ * or the timeout expires. */
+static int loop_run(lua_State *L)
+{
+  struct loop *lp = check_loop(L, 1);
+  double deadline = lua_isnoneornil(L, 2) ? -1
+                    : monotime() + luaL_checknumber(L, 2);
+  int n, total = 0;
+  lp->stopped = 0;
+  while (lp->epfd != -1 && lp->count > 0 && !lp->stopped) {
+    if (-1 == (n = loop_once(L, lp, remaining_ms(deadline))))
+      return push_error(L);
+    total += n;
+    if (deadline >= 0 && remaining_ms(deadline) == 0)
+      break;
+  }
+  lua_pushnumber(L, total);
+  return 1;
+}
+
+/* loop -- loop */
+static int loop_stop(lua_State *L)
+{
+  check_loop(L, 1)->stopped = 1;
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* loop -- count */
+static int loop_count(lua_State *L)
+{
+  lua_pushnumber(L, check_loop(L, 1)->count);
+  return 1;
+}
+
+/* loop -- */
+static int loop_close(lua_State *L)
+{
+  struct loop *lp = luaL_checkudata(L, 1, LOOP_HANDLE);
+  int id;
+  if (lp->epfd == -1)
+    return 0;
+  for (id = 0; id < lp->size; id++)
+    if (lp->w[id].kind != WATCH_FREE)
+      watch_release(lp, id);
+  free(lp->w);
+  lp->w = 0;
+  lp->size = 0;
+  close(lp->epfd);
+  lp->epfd = -1;
+  return 0;
+}
+
+/* loop -- string */
+static int loop_tostring(lua_State *L)
+{
+  struct loop *lp = luaL_checkudata(L, 1, LOOP_HANDLE);
+  if (lp->epfd == -1)
+    lua_pushliteral(L, "loop (closed)");
+  else
+    lua_pushfstring(L, "loop (%d watches)", lp->count);
+  return 1;
+}
+
+/* -- loop/nil error */
+static int ex_loop(lua_State *L)
+{
+  struct loop *lp = lua_newuserdata(L, sizeof *lp);
+  lp->epfd = -1;
+  lp->stopped = lp->count = lp->nready = lp->size = 0;
+  lp->w = 0;
+  luaL_getmetatable(L, LOOP_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 0, 1);
+  lua_newtable(L);
+  lua_setfield(L, -2, "objects");
+  lua_setfenv(L, -2);
+  if (-1 == (lp->epfd = epoll_create1(EPOLL_CLOEXEC)))
+    return push_error(L);
+  return 1;
+}
+
+/* ex -- ex */
+int loop_open(lua_State *L)
+{
+  const luaL_reg methods[] = {
+    {"file",     loop_file},
+    {"process",  loop_process},
+    {"signal",   loop_signal},
+    {"timer",    loop_timer},
+    {"remove",   loop_remove},
+    {"step",     loop_step},
+    {"run",      loop_run},
+    {"stop",     loop_stop},
+    {"count",    loop_count},
+    {"close",    loop_close},
+    {0,0} };
+  luaL_newmetatable(L, LOOP_HANDLE);          /* ex M */
+  lua_newtable(L);                            /* ex M I */
+  luaL_register(L, 0, methods);               /* ex M I */
+  lua_setfield(L, -2, "__index");             /* ex M */
+  lua_pushcfunction(L, loop_close);           /* ex M close */
+  lua_setfield(L, -2, "__gc");                /* ex M */
+  lua_pushcfunction(L, loop_tostring);        /* ex M tostring */
+  lua_setfield(L, -2, "__tostring");          /* ex M */
+  lua_pop(L, 1);                              /* ex */
+  lua_pushcfunction(L, ex_loop);              /* ex loop */
+  lua_setfield(L, -2, "loop");                /* ex */
+  return 0;
+}
+
+#else
+
+/* ex -- ex
+ * epoll is not available: there is no ex.loop. */
+int loop_open(lua_State *L)
+{
+  return 0;
+}
+
+#endif
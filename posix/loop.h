@@ -0,0 +1,15 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef LOOP_H
+#define LOOP_H
+
+#include "lua.h"
+
+#define LOOP_HANDLE "loop"
+
+int loop_open(lua_State *L);
+
+#endif/*LOOP_H*/
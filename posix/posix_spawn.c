@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <errno.h>
 
+#include <signal.h>
 #include <unistd.h>
 #include <limits.h>
 #include <sys/types.h>
@@ -18,6 +19,96 @@
 #define OPEN_MAX sysconf(_SC_OPEN_MAX)
 #endif
 
+#ifndef NSIG
+#define NSIG 65
+#endif
+
+
+int posix_spawnattr_init(
+  posix_spawnattr_t *attrp)
+{
+  attrp->flags = 0;
+  attrp->pgroup = 0;
+  sigemptyset(&attrp->sigdefault);
+  sigemptyset(&attrp->sigmask);
+  return 0;
+}
+
+int posix_spawnattr_getflags(
+  const posix_spawnattr_t *restrict attrp,
+  short *restrict flags)
+{
+  *flags = attrp->flags;
+  return 0;
+}
+
+int posix_spawnattr_setflags(
+  posix_spawnattr_t *attrp,
+  short flags)
+{
+  /* scheduling and credential changes are not supported */
+  if (flags & ~(POSIX_SPAWN_SETPGROUP
+                | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK))
+    return EINVAL;
+  attrp->flags = flags;
+  return 0;
+}
+
+int posix_spawnattr_getpgroup(
+  const posix_spawnattr_t *restrict attrp,
+  pid_t *restrict pgroup)
+{
+  *pgroup = attrp->pgroup;
+  return 0;
+}
+
+int posix_spawnattr_setpgroup(
+  posix_spawnattr_t *attrp,
+  pid_t pgroup)
+{
+  attrp->pgroup = pgroup;
+  return 0;
+}
+
+int posix_spawnattr_getsigdefault(
+  const posix_spawnattr_t *restrict attrp,
+  sigset_t *restrict sigdefault)
+{
+  *sigdefault = attrp->sigdefault;
+  return 0;
+}
+
+int posix_spawnattr_setsigdefault(
+  posix_spawnattr_t *restrict attrp,
+  const sigset_t *restrict sigdefault)
+{
+  attrp->sigdefault = *sigdefault;
+  return 0;
+}
+
+int posix_spawnattr_getsigmask(
+  const posix_spawnattr_t *restrict attrp,
+  sigset_t *restrict sigmask)
+{
+  *sigmask = attrp->sigmask;
+  return 0;
+}
+
+int posix_spawnattr_setsigmask(
+  posix_spawnattr_t *restrict attrp,
+  const sigset_t *restrict sigmask)
+{
+  attrp->sigmask = *sigmask;
+  return 0;
+}
+
+int posix_spawnattr_destroy(
+  posix_spawnattr_t *attrp)
+{
+  (void)attrp;
+  return 0;
+}
+
 
 int posix_spawn_file_actions_init(
   posix_spawn_file_actions_t *act)
@@ -51,31 +142,76 @@ int posix_spawn_file_actions_destroy(
   return 0;
 }
 
-int posix_spawnp(
+/* The fork and child setup shared by posix_spawn and posix_spawnp; search
+ * says whether path is looked up in PATH. */
+static int spawn(
   pid_t *restrict ppid,
   const char *restrict path,
   const posix_spawn_file_actions_t *act,
   const posix_spawnattr_t *restrict attrp,
   char *const argv[restrict],
-  char *const envp[restrict])
+  char *const envp[restrict],
+  int search)
 {
   if (!ppid || !path || !argv || !envp)
     return EINVAL;
-  if (attrp)
-    return EINVAL;
   switch (*ppid = fork()) {
-  case -1: return -1;
-  default: return 0;
+  case -1: return errno;
+  default:
+    /* also set the group from the parent, so that it is in place
+     * before the caller can signal it */
+    if (attrp && attrp->flags & POSIX_SPAWN_SETPGROUP)
+      setpgid(*ppid, attrp->pgroup);
+    return 0;
   case 0:
+    if (attrp) {
+      if (attrp->flags & POSIX_SPAWN_SETPGROUP
+          && -1 == setpgid(0, attrp->pgroup))
+        _exit(111);
+      if (attrp->flags & POSIX_SPAWN_SETSIGDEF) {
+        int sig;
+        for (sig = 1; sig < NSIG; sig++)
+          if (sigismember(&attrp->sigdefault, sig) == 1)
+            signal(sig, SIG_DFL);
+      }
+      if (attrp->flags & POSIX_SPAWN_SETSIGMASK)
+        sigprocmask(SIG_SETMASK, &attrp->sigmask, 0);
+    }
     if (act) {
       int i;
       for (i = 0; i < 3; i++)
         if (act->dups[i] != -1 && -1 == dup2(act->dups[i], i))
           _exit(111);
     }
-    environ = (char **)envp;
-    execvp(path, argv);
+    if (search) {
+      environ = (char **)envp;
+      execvp(path, argv);
+    }
+    else
+      execve(path, argv, envp);
     _exit(111);
     /*NOTREACHED*/
   }
 }
+
+int posix_spawn(
+  pid_t *restrict ppid,
+  const char *restrict path,
+  const posix_spawn_file_actions_t *act,
+  const posix_spawnattr_t *restrict attrp,
+  char *const argv[restrict],
+  char *const envp[restrict])
+{
+  return spawn(ppid, path, act, attrp, argv, envp, 0);
+}
+
+int posix_spawnp(
+  pid_t *restrict ppid,
+  const char *restrict path,
+  const posix_spawn_file_actions_t *act,
+  const posix_spawnattr_t *restrict attrp,
+  char *const argv[restrict],
+  char *const envp[restrict])
+{
+  return spawn(ppid, path, act, attrp, argv, envp, 1);
+}
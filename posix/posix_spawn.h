@@ -11,15 +11,21 @@
 #define restrict
 #endif
 
-typedef void *posix_spawnattr_t;
+typedef struct posix_spawnattr posix_spawnattr_t;
+struct posix_spawnattr {
+  short flags;
+  pid_t pgroup;
+  sigset_t sigdefault;
+  sigset_t sigmask;
+};
 
 enum {
-  POSIX_SPAWN_RESETIDS,
-  POSIX_SPAWN_SETPGROUP,
-  POSIX_SPAWN_SETSCHEDPARAM,
-  POSIX_SPAWN_SETSCHEDULER,
-  POSIX_SPAWN_SETSIGDEF,
-  POSIX_SPAWN_SETSIGMASK,
+  POSIX_SPAWN_RESETIDS = 0x01,
+  POSIX_SPAWN_SETPGROUP = 0x02,
+  POSIX_SPAWN_SETSCHEDPARAM = 0x04,
+  POSIX_SPAWN_SETSCHEDULER = 0x08,
+  POSIX_SPAWN_SETSIGDEF = 0x10,
+  POSIX_SPAWN_SETSIGMASK = 0x20,
 };
 
 int posix_spawnattr_init(posix_spawnattr_t *attrp);
@@ -0,0 +1,205 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "spawn.h"
+#include "procstats.h"
+
+/* Samples of /proc/<pid>/{stat,statm,io,status}.  The files are opened
+ * relative to a descriptor for /proc, opened once per process, and read
+ * into a userdata buffer which each call keeps on the stack and shares
+ * between the four files, so a sample costs four open/read/close triples
+ * and no allocation beyond the buffer and the result table. */
+
+extern int push_error(lua_State *L);
+
+#ifdef __linux__
+static int proc_dirfd = -1;
+static int proc_errno;
+static pthread_once_t proc_once = PTHREAD_ONCE_INIT;
+
+static void proc_open(void)
+{
+  proc_dirfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  proc_errno = errno;
+}
+
+/* A buffer held by a userdata at index idx of the stack. */
+struct procbuf {
+  int idx;
+  char *buf;
+  size_t size;
+};
+
+/* Reads /proc/<pid>/<name> into pb, NUL-terminated.  Returns the length,
+ * or -1 with errno set.  A file which fills the buffer is read again into
+ * one twice the size, allocated with the descriptor closed, so that a
+ * memory error cannot leak it. */
+static ssize_t read_procfile(lua_State *L, struct procbuf *pb, pid_t pid,
+                             const char *name)
+{
+  char path[64];
+  ssize_t n = 0, len;
+  int fd;
+  pthread_once(&proc_once, proc_open);
+  if (proc_dirfd == -1) {
+    errno = proc_errno;
+    return -1;
+  }
+  sprintf(path, "%lu/%s", (unsigned long)pid, name);
+  for (;;) {
+    fd = openat(proc_dirfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      return -1;
+    len = 0;
+    while (len + 1 < (ssize_t)pb->size) {
+      n = read(fd, pb->buf + len, pb->size - 1 - len);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      len += n;
+    }
+    close(fd);
+    if (len + 1 < (ssize_t)pb->size)
+      break;
+    pb->size *= 2;
+    pb->buf = lua_newuserdata(L, pb->size);
+    lua_replace(L, pb->idx);
+  }
+  if (n == -1)
+    return -1;
+  pb->buf[len] = '\0';
+  return len;
+}
+
+/* Returns the value following "key:" at the start of a line of buf, or -1
+ * if there is none. */
+static double keyed_value(const char *buf, const char *key)
+{
+  size_t keylen = strlen(key);
+  const char *s;
+  for (s = buf; s; s = strchr(s, '\n'), s = s ? s + 1 : 0)
+    if (0 == strncmp(s, key, keylen) && s[keylen] == ':')
+      return strtod(s + keylen + 1, 0);
+  return -1;
+}
+
+static void setnumber(lua_State *L, const char *k, double v)
+{
+  lua_pushnumber(L, v);
+  lua_setfield(L, -2, k);
+}
+
+/* pid -- stats
+ * Pushes a table of the process' statistics, or returns 0 with errno set. */
+int procstats_push(lua_State *L, pid_t pid)
+{
+  static long ticks, pagesize;
+  struct procbuf pb;
+  const char *s;
+  char *end;
+  double f[24];
+  char state;
+  int i;
+  if (!ticks) {
+    ticks = sysconf(_SC_CLK_TCK);
+    pagesize = sysconf(_SC_PAGESIZE);
+  }
+  pb.size = 4096;
+  pb.buf = lua_newuserdata(L, pb.size);
+  pb.idx = lua_gettop(L);
+  if (-1 == read_procfile(L, &pb, pid, "stat")) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  /* the command name is in parentheses and may itself contain them */
+  if (!(s = strrchr(pb.buf, ')')) || s[1] != ' ') {
+    lua_pop(L, 1);
+    errno = EINVAL;
+    return 0;
+  }
+  state = s[2];
+  s += 3;
+  for (i = 0; i < 24; i++) {           /* fields 4 (ppid) to 27 */
+    f[i] = strtod(s, &end);
+    s = end;
+  }
+  lua_createtable(L, 0, 16);
+  setnumber(L, "pid", pid);
+  lua_pushlstring(L, &state, 1);
+  lua_setfield(L, -2, "state");
+  setnumber(L, "ppid", f[0]);
+  setnumber(L, "minflt", f[6]);
+  setnumber(L, "majflt", f[8]);
+  setnumber(L, "utime", f[10] / ticks);
+  setnumber(L, "stime", f[11] / ticks);
+  setnumber(L, "nice", f[15]);
+  setnumber(L, "threads", f[16]);
+  setnumber(L, "starttime", f[18] / ticks);
+  if (-1 != read_procfile(L, &pb, pid, "statm")) {
+    double size, resident;
+    size = strtod(pb.buf, &end);
+    resident = strtod(end, 0);
+    setnumber(L, "vsize", size * pagesize);
+    setnumber(L, "rss", resident * pagesize);
+  }
+  /* io is only readable by the owner of the process */
+  if (-1 != read_procfile(L, &pb, pid, "io")) {
+    setnumber(L, "rchar", keyed_value(pb.buf, "rchar"));
+    setnumber(L, "wchar", keyed_value(pb.buf, "wchar"));
+    setnumber(L, "read_bytes", keyed_value(pb.buf, "read_bytes"));
+    setnumber(L, "write_bytes", keyed_value(pb.buf, "write_bytes"));
+  }
+  if (-1 != read_procfile(L, &pb, pid, "status")) {
+    setnumber(L, "nvcsw", keyed_value(pb.buf, "voluntary_ctxt_switches"));
+    setnumber(L, "nivcsw", keyed_value(pb.buf, "nonvoluntary_ctxt_switches"));
+    setnumber(L, "maxrss", keyed_value(pb.buf, "VmHWM") * 1024);
+  }
+  lua_remove(L, pb.idx);
+  return 1;
+}
+
+#else
+int procstats_push(lua_State *L, pid_t pid)
+{
+  errno = ENOSYS;
+  return 0;
+}
+#endif
+
+/* {pid or proc, ...} -- {stats or false, ...} */
+int ex_procstats(lua_State *L)
+{
+  size_t i, n;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = lua_objlen(L, 1);
+  lua_createtable(L, n, 0);
+  for (i = 1; i <= n; i++) {
+    pid_t pid;
+    lua_rawgeti(L, 1, i);
+    pid = lua_isnumber(L, -1) ? (pid_t)lua_tonumber(L, -1)
+                              : process_pid(L, -1);
+    lua_pop(L, 1);
+    if (pid <= 0 || !procstats_push(L, pid))
+      lua_pushboolean(L, 0);
+    lua_rawseti(L, -2, i);
+  }
+  return 1;
+}
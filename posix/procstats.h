@@ -0,0 +1,15 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef PROCSTATS_H
+#define PROCSTATS_H
+
+#include <sys/types.h>
+#include "lua.h"
+
+int procstats_push(lua_State *L, pid_t pid);
+int ex_procstats(lua_State *L);
+
+#endif/*PROCSTATS_H*/
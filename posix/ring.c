@@ -0,0 +1,901 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+/* the operations are an enum; this flag arrived after IORING_OP_MKDIRAT */
+#if defined IORING_TIMEOUT_ETIME_SUCCESS && defined STATX_BASIC_STATS
+#define RING_URING 1
+#endif
+#endif
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "spawn.h"
+#include "async.h"
+#include "ring.h"
+
+/* A ring batches file system calls.  Each call made on it is queued and
+ * returns an id; ring:submit() hands the queue to the kernel's io_uring or,
+ * where that is unavailable, to the ex.async worker threads; completions
+ * are collected with ring:wait() and ring:completions().  Every call has a
+ * slot which holds its arguments and result until its completion has been
+ * returned to Lua, so the number of outstanding calls is bounded. */
+
+#define RING_HANDLE "ex.ring"
+#define RING_ENTRIES 256
+#define RING_MAXENTRIES 4096
+
+enum { R_FREE, R_STAT, R_OPEN, R_READ, R_WRITE, R_FSYNC, R_REMOVE, R_MKDIR };
+
+struct ring;
+
+struct ring_op {
+  struct async_task task;       /* for the fallback */
+  struct ring *ring;
+  int op;
+  int fd, flags;
+  off_t offset;                 /* -1 for the current position */
+  size_t len;
+  const char *path;             /* anchored in the ring's environment */
+  const char *data;
+  char *buf;
+  long result;                  /* as from the kernel: >= 0 or -errno */
+  struct stat st;
+#ifdef RING_URING
+  struct statx stx;
+#endif
+  lua_Number id;
+  int next;                     /* free, queued or completed list */
+};
+
+struct ring {
+  int fd;                       /* the io_uring, or -1 for the fallback */
+  struct ring_op *ops;
+  int size;                     /* number of slots */
+  int free;                     /* list of free slots */
+  int queued, queued_tail;      /* fallback: calls not yet submitted */
+  int unsubmitted;              /* calls queued and not submitted */
+  int inflight;                 /* calls submitted and not completed */
+  int ready;                    /* calls completed and not returned */
+  int done, done_tail;          /* completed list, guarded by lock */
+  lua_Number ids;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#ifdef RING_URING
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_size, cq_size, sqes_size;
+  unsigned features;
+#endif
+};
+
+extern int push_error(lua_State *L);
+extern FILE *check_file(lua_State *L, int idx, const char *argname);
+extern FILE **new_file(lua_State *L, int fd, const char *mode);
+extern void push_stat(lua_State *L, const struct stat *st);
+
+/* Appends the slot to the completed list.  Called with the lock held. */
+static void ring_complete(struct ring *r, int slot, long result)
+{
+  struct ring_op *op = &r->ops[slot];
+  op->result = result;
+  op->next = -1;
+  if (r->done == -1) r->done = slot;
+  else r->ops[r->done_tail].next = slot;
+  r->done_tail = slot;
+  r->inflight--;
+  r->ready++;
+}
+
+
+/* Fallback: each call runs on a worker thread. */
+
+static long ring_call(struct ring_op *op)
+{
+  long n = 0;
+  switch (op->op) {
+  case R_STAT:
+    n = stat(op->path, &op->st);
+    break;
+  case R_OPEN:
+    n = open(op->path, op->flags | O_CLOEXEC, 0666);
+    break;
+  case R_READ:
+    n = op->offset < 0 ? read(op->fd, op->buf, op->len)
+                       : pread(op->fd, op->buf, op->len, op->offset);
+    break;
+  case R_WRITE:
+    n = op->offset < 0 ? write(op->fd, op->data, op->len)
+                       : pwrite(op->fd, op->data, op->len, op->offset);
+    break;
+  case R_FSYNC:
+    n = fsync(op->fd);
+    break;
+  case R_REMOVE:
+    n = op->flags ? rmdir(op->path) : unlink(op->path);
+    break;
+  case R_MKDIR:
+    n = mkdir(op->path, 0777);
+    break;
+  }
+  return n == -1 ? -errno : n;
+}
+
+static void ring_task(struct async_task *t)
+{
+  struct ring_op *op = (struct ring_op *)t;
+  struct ring *r = op->ring;
+  long result = ring_call(op);
+  pthread_mutex_lock(&r->lock);
+  ring_complete(r, op - r->ops, result);
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+}
+
+
+#ifdef RING_URING
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags,
+                       void *arg, size_t argsz)
+{
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+/* Checks that the kernel supports every operation a ring uses. */
+static int uring_probe(int fd)
+{
+  static const int needed[] = {
+    IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE,
+    IORING_OP_FSYNC, IORING_OP_UNLINKAT, IORING_OP_MKDIRAT
+  };
+  struct io_uring_probe *probe;
+  size_t size = sizeof *probe + 256 * sizeof probe->ops[0];
+  int i, ok = 0;
+  if (!(probe = calloc(1, size)))
+    return 0;
+  if (0 == syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                   probe, 256)) {
+    ok = 1;
+    for (i = 0; i < (int)(sizeof needed / sizeof *needed); i++)
+      if (needed[i] > probe->last_op
+          || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+        ok = 0;
+  }
+  free(probe);
+  return ok;
+}
+
+static void uring_unmap(struct ring *r)
+{
+  if (r->sqes) munmap(r->sqes, r->sqes_size);
+  if (r->cq_map && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_size);
+  if (r->sq_map) munmap(r->sq_map, r->sq_size);
+  r->sqes = 0;
+  r->sq_map = r->cq_map = 0;
+}
+
+/* Sets up an io_uring for the ring.  Returns -1 if the kernel cannot
+ * provide one. */
+static int uring_init(struct ring *r, unsigned entries)
+{
+  struct io_uring_params p;
+  char *sq, *cq;
+  int err;
+  memset(&p, 0, sizeof p);
+  if (-1 == (r->fd = uring_setup(entries, &p)))
+    return -1;
+  fcntl(r->fd, F_SETFD, FD_CLOEXEC);
+  if (!uring_probe(r->fd)) {
+    errno = ENOSYS;
+    goto fail;
+  }
+  r->features = p.features;
+  r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && r->cq_size > r->sq_size)
+    r->sq_size = r->cq_size;
+  r->sq_map = mmap(0, r->sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_map == MAP_FAILED) {
+    r->sq_map = 0;
+    goto fail;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_map = r->sq_map;
+  else {
+    r->cq_map = mmap(0, r->cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_map == MAP_FAILED) {
+      r->cq_map = 0;
+      goto fail;
+    }
+  }
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(0, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = 0;
+    goto fail;
+  }
+  sq = r->sq_map;
+  cq = r->cq_map;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  r->size = p.cq_entries;
+  return 0;
+fail:
+  err = errno;
+  uring_unmap(r);
+  close(r->fd);
+  r->fd = -1;
+  errno = err;
+  return -1;
+}
+
+/* Moves completions from the kernel's queue to the completed list. */
+static void uring_reap(struct ring *r)
+{
+  unsigned head = *r->cq_head;
+  unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail)
+    return;
+  pthread_mutex_lock(&r->lock);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    ring_complete(r, (int)cqe->user_data, cqe->res);
+  }
+  pthread_mutex_unlock(&r->lock);
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Submits queued calls, waiting for wait of them to complete.  Returns -1
+ * with errno set on failure. */
+static int uring_submit(struct ring *r, unsigned wait)
+{
+  unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+  int n;
+  do n = uring_enter(r->fd, r->unsubmitted, wait, flags, 0, 0);
+  while (n == -1 && errno == EINTR && !wait);
+  if (n > 0) {
+    r->unsubmitted -= n;
+    r->inflight += n;
+  }
+  uring_reap(r);
+  return n == -1 ? -1 : 0;
+}
+
+/* Fills a submission queue entry for the call in slot. */
+static int uring_queue(struct ring *r, int slot)
+{
+  struct ring_op *op = &r->ops[slot];
+  struct io_uring_sqe *sqe;
+  unsigned tail = *r->sq_tail, idx;
+  if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= *r->sq_entries) {
+    if (-1 == uring_submit(r, 0))
+      return -1;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= *r->sq_entries)
+      return errno = EBUSY, -1;
+  }
+  idx = tail & *r->sq_mask;
+  sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof *sqe);
+  sqe->user_data = slot;
+  sqe->fd = AT_FDCWD;
+  switch (op->op) {
+  case R_STAT:
+    sqe->opcode = IORING_OP_STATX;
+    sqe->addr = (unsigned long)op->path;
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (unsigned long)&op->stx;
+    break;
+  case R_OPEN:
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->addr = (unsigned long)op->path;
+    sqe->len = 0666;
+    sqe->open_flags = op->flags | O_CLOEXEC;
+    break;
+  case R_READ:
+  case R_WRITE:
+    sqe->opcode = op->op == R_READ ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = op->fd;
+    sqe->addr = (unsigned long)(op->op == R_READ ? op->buf : op->data);
+    sqe->len = op->len;
+    sqe->off = op->offset;
+    break;
+  case R_FSYNC:
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = op->fd;
+    break;
+  case R_REMOVE:
+    sqe->opcode = IORING_OP_UNLINKAT;
+    sqe->addr = (unsigned long)op->path;
+    sqe->unlink_flags = op->flags ? AT_REMOVEDIR : 0;
+    break;
+  case R_MKDIR:
+    sqe->opcode = IORING_OP_MKDIRAT;
+    sqe->addr = (unsigned long)op->path;
+    sqe->len = 0777;
+    break;
+  }
+  r->sq_array[idx] = idx;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  r->unsubmitted++;
+  return 0;
+}
+
+#endif/*RING_URING*/
+
+
+/* ring -- submitted/nil error
+ * Hands the queued calls to the kernel or the worker threads. */
+static int ring_flush(struct ring *r)
+{
+  int n = r->unsubmitted;
+#ifdef RING_URING
+  if (r->fd != -1)
+    return -1 == uring_submit(r, 0) ? -1 : n - r->unsubmitted;
+#endif
+  while (r->queued != -1) {
+    struct ring_op *op = &r->ops[r->queued];
+    r->queued = op->next;
+    r->unsubmitted--;
+    pthread_mutex_lock(&r->lock);
+    r->inflight++;
+    pthread_mutex_unlock(&r->lock);
+    op->task.run = ring_task;
+    if (-1 == async_task_submit(&op->task))
+      ring_task(&op->task);
+  }
+  return n;
+}
+
+/* Waits until at least n calls have completed, or until deadline. */
+static int ring_wait(struct ring *r, int n, double deadline)
+{
+  if (-1 == ring_flush(r))
+    return -1;
+  pthread_mutex_lock(&r->lock);
+  if (n > r->ready + r->inflight)
+    n = r->ready + r->inflight;
+  pthread_mutex_unlock(&r->lock);
+#ifdef RING_URING
+  if (r->fd != -1) {
+    uring_reap(r);
+    while (r->ready < n) {
+      if (deadline < 0) {
+        if (-1 == uring_submit(r, n - r->ready) && errno != EINTR)
+          return -1;
+      }
+      else {
+        struct pollfd pfd;
+        int ms = remaining_ms(deadline);
+        pfd.fd = r->fd;
+        pfd.events = POLLIN;
+        if (-1 == poll(&pfd, 1, ms) && errno != EINTR)
+          return -1;
+        uring_reap(r);
+        if (ms == 0)
+          break;
+      }
+    }
+    return 0;
+  }
+#endif
+  pthread_mutex_lock(&r->lock);
+  while (r->ready < n) {
+    if (deadline < 0)
+      pthread_cond_wait(&r->cond, &r->lock);
+    else {
+      struct timespec ts;
+      double left = deadline - monotime();
+      if (left <= 0)
+        break;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += (time_t)left;
+      ts.tv_nsec += (long)((left - (time_t)left) * 1e9);
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&r->cond, &r->lock, &ts);
+    }
+  }
+  pthread_mutex_unlock(&r->lock);
+  return 0;
+}
+
+static struct ring *checkring(lua_State *L, int idx)
+{
+  struct ring *r = luaL_checkudata(L, idx, RING_HANDLE);
+  if (!r->ops)
+    luaL_error(L, "attempt to use a closed ring");
+  return r;
+}
+
+/* ring arg1 arg2 -- ring arg1 arg2
+ * Takes a free slot for a call, anchoring its arguments in the ring's
+ * environment.  Returns 0 and sets errno to EBUSY if every slot is in use. */
+static struct ring_op *ring_slot(lua_State *L, struct ring *r, int op)
+{
+  struct ring_op *o;
+  int slot = r->free;
+  if (slot == -1)
+    return errno = EBUSY, (struct ring_op *)0;
+  o = &r->ops[slot];
+  r->free = o->next;
+  o->op = op;
+  o->fd = -1;
+  o->flags = 0;
+  o->offset = -1;
+  o->len = 0;
+  o->path = o->data = 0;
+  o->buf = 0;
+  o->id = ++r->ids;
+  lua_getfenv(L, 1);
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, 2 * slot + 1);
+  lua_pushvalue(L, 3);
+  lua_rawseti(L, -2, 2 * slot + 2);
+  lua_pop(L, 1);
+  return o;
+}
+
+static void ring_release(lua_State *L, struct ring *r, int slot)
+{
+  struct ring_op *o = &r->ops[slot];
+  free(o->buf);
+  o->buf = 0;
+  o->op = R_FREE;
+  o->next = r->free;
+  r->free = slot;
+  lua_getfenv(L, 1);
+  lua_pushnil(L);
+  lua_rawseti(L, -2, 2 * slot + 1);
+  lua_pushnil(L);
+  lua_rawseti(L, -2, 2 * slot + 2);
+  lua_pop(L, 1);
+}
+
+/* ring ... -- id/nil error */
+static int ring_push(lua_State *L, struct ring *r, struct ring_op *o)
+{
+  int slot = o - r->ops;
+#ifdef RING_URING
+  if (r->fd != -1) {
+    if (-1 == uring_queue(r, slot)) {
+      int err = errno;
+      ring_release(L, r, slot);
+      errno = err;
+      return push_error(L);
+    }
+    lua_pushnumber(L, o->id);
+    return 1;
+  }
+#endif
+  o->next = -1;
+  if (r->queued == -1) r->queued = slot;
+  else r->ops[r->queued_tail].next = slot;
+  r->queued_tail = slot;
+  r->unsubmitted++;
+  lua_pushnumber(L, o->id);
+  return 1;
+}
+
+static int check_fd(lua_State *L, int idx)
+{
+  if (lua_type(L, idx) == LUA_TNUMBER)
+    return lua_tonumber(L, idx);
+  return fileno(check_file(L, idx, 0));
+}
+
+/* ring pathname -- id/nil error */
+static int ring_stat(lua_State *L)
+{
+  struct ring *r = checkring(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+  struct ring_op *o;
+  lua_settop(L, 2);
+  if (!(o = ring_slot(L, r, R_STAT)))
+    return push_error(L);
+  o->path = path;
+  return ring_push(L, r, o);
+}
+
+/* ring pathname [mode] -- id/nil error */
+static int ring_openfile(lua_State *L)
+{
+  static const char *const modes[] = { "r", "w", "a", "r+", "w+", "a+", 0 };
+  static const int flags[] = {
+    O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_APPEND,
+    O_RDWR, O_RDWR | O_CREAT | O_TRUNC, O_RDWR | O_CREAT | O_APPEND
+  };
+  struct ring *r = checkring(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+  int mode = luaL_checkoption(L, 3, "r", modes);
+  struct ring_op *o;
+  lua_settop(L, 2);
+  if (!(o = ring_slot(L, r, R_OPEN)))
+    return push_error(L);
+  o->path = path;
+  o->flags = flags[mode];
+  return ring_push(L, r, o);
+}
+
+/* ring file-or-fd count [offset] -- id/nil error */
+static int ring_read(lua_State *L)
+{
+  struct ring *r = checkring(L, 1);
+  int fd = check_fd(L, 2);
+  lua_Number len = luaL_checknumber(L, 3);
+  off_t offset = luaL_optnumber(L, 4, -1);
+  struct ring_op *o;
+  char *buf;
+  luaL_argcheck(L, len >= 0, 3, "negative count");
+  lua_settop(L, 2);
+  if (!(buf = malloc(len ? len : 1)))
+    return luaL_error(L, "not enough memory");
+  if (!(o = ring_slot(L, r, R_READ))) {
+    free(buf);
+    return push_error(L);
+  }
+  o->fd = fd;
+  o->buf = buf;
+  o->len = len;
+  o->offset = offset;
+  return ring_push(L, r, o);
+}
+
+/* ring file-or-fd data [offset] -- id/nil error */
+static int ring_write(lua_State *L)
+{
+  struct ring *r = checkring(L, 1);
+  int fd = check_fd(L, 2);
+  size_t len;
+  const char *data = luaL_checklstring(L, 3, &len);
+  off_t offset = luaL_optnumber(L, 4, -1);
+  struct ring_op *o;
+  lua_settop(L, 3);
+  if (!(o = ring_slot(L, r, R_WRITE)))
+    return push_error(L);
+  o->fd = fd;
+  o->data = data;
+  o->len = len;
+  o->offset = offset;
+  return ring_push(L, r, o);
+}
+
+/* ring file-or-fd -- id/nil error */
+static int ring_fsync(lua_State *L)
+{
+  struct ring *r = checkring(L, 1);
+  int fd = check_fd(L, 2);
+  struct ring_op *o;
+  lua_settop(L, 2);
+  if (!(o = ring_slot(L, r, R_FSYNC)))
+    return push_error(L);
+  o->fd = fd;
+  return ring_push(L, r, o);
+}
+
+/* ring pathname [directory] -- id/nil error */
+static int ring_remove(lua_State *L)
+{
+  struct ring *r = checkring(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+  int dir = lua_toboolean(L, 3);
+  struct ring_op *o;
+  lua_settop(L, 2);
+  if (!(o = ring_slot(L, r, R_REMOVE)))
+    return push_error(L);
+  o->path = path;
+  o->flags = dir;
+  return ring_push(L, r, o);
+}
+
+/* ring pathname -- id/nil error */
+static int ring_mkdir(lua_State *L)
+{
+  struct ring *r = checkring(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+  struct ring_op *o;
+  lua_settop(L, 2);
+  if (!(o = ring_slot(L, r, R_MKDIR)))
+    return push_error(L);
+  o->path = path;
+  return ring_push(L, r, o);
+}
+
+/* ring -- count/nil error */
+static int ring_submit(lua_State *L)
+{
+  struct ring *r = checkring(L, 1);
+  int n = ring_flush(r);
+  if (n == -1)
+    return push_error(L);
+  lua_pushnumber(L, n);
+  return 1;
+}
+
+/* ring [n [timeout]] -- ready/nil error
+ * Submits the queued calls and waits until at least n (default 1) of the
+ * outstanding calls have completed. */
+static int ring_waitfor(lua_State *L)
+{
+  struct ring *r = checkring(L, 1);
+  int n = luaL_optnumber(L, 2, 1);
+  double deadline = lua_isnoneornil(L, 3) ? -1
+                    : monotime() + luaL_checknumber(L, 3);
+  if (-1 == ring_wait(r, n, deadline))
+    return push_error(L);
+  lua_pushnumber(L, r->ready);
+  return 1;
+}
+
+/* ring -- id result/nil error */
+static int ring_next(lua_State *L)
+{
+  struct ring *r = checkring(L, 1);
+  struct ring_op *o;
+  int slot, n = 2;
+#ifdef RING_URING
+  if (r->fd != -1)
+    uring_reap(r);
+#endif
+  pthread_mutex_lock(&r->lock);
+  if ((slot = r->done) != -1) {
+    r->done = r->ops[slot].next;
+    r->ready--;
+  }
+  pthread_mutex_unlock(&r->lock);
+  if (slot == -1)
+    return 0;
+  o = &r->ops[slot];
+  lua_pushnumber(L, o->id);
+  if (o->result < 0) {
+    errno = -o->result;
+    n = 1 + push_error(L);
+  }
+  else switch (o->op) {
+  case R_STAT:
+#ifdef RING_URING
+    if (r->fd != -1) {
+      o->st.st_mode = o->stx.stx_mode;
+      o->st.st_size = o->stx.stx_size;
+      o->st.st_mtime = o->stx.stx_mtime.tv_sec;
+      o->st.st_ino = o->stx.stx_ino;
+      o->st.st_nlink = o->stx.stx_nlink;
+    }
+#endif
+    push_stat(L, &o->st);
+    break;
+  case R_OPEN:
+    if (!*new_file(L, o->result, o->flags & O_WRONLY ? "w"
+                                 : o->flags & O_RDWR ? "r+" : "r")) {
+      close(o->result);
+      n = 1 + push_error(L);
+    }
+    break;
+  case R_READ:
+    if (o->result == 0 && o->len > 0)
+      lua_pushnil(L);
+    else
+      lua_pushlstring(L, o->buf, o->result);
+    break;
+  case R_WRITE:
+    lua_pushnumber(L, o->result);
+    break;
+  default:
+    lua_pushboolean(L, 1);
+  }
+  ring_release(L, r, slot);
+  return n;
+}
+
+/* ring -- iterator ring */
+static int ring_completions(lua_State *L)
+{
+  checkring(L, 1);
+  lua_pushcfunction(L, ring_next);
+  lua_pushvalue(L, 1);
+  return 2;
+}
+
+/* ring -- count */
+static int ring_pending(lua_State *L)
+{
+  struct ring *r = checkring(L, 1);
+  lua_pushnumber(L, r->unsubmitted + r->inflight + r->ready);
+  return 1;
+}
+
+/* ring -- "io_uring"/"threads" */
+static int ring_backend(lua_State *L)
+{
+  struct ring *r = checkring(L, 1);
+  if (r->fd != -1)
+    lua_pushliteral(L, "io_uring");
+  else
+    lua_pushliteral(L, "threads");
+  return 1;
+}
+
+/* ring -- */
+static int ring_close(lua_State *L)
+{
+  struct ring *r = luaL_checkudata(L, 1, RING_HANDLE);
+  int i;
+  if (!r->ops)
+    return 0;
+  /* the kernel or a worker may still be using a slot */
+#ifdef RING_URING
+  if (r->fd != -1) {
+    uring_reap(r);
+    while (r->inflight > 0) {
+      if (-1 == uring_enter(r->fd, 0, r->inflight, IORING_ENTER_GETEVENTS,
+                            0, 0) && errno != EINTR)
+        break;
+      uring_reap(r);
+    }
+    uring_unmap(r);
+    close(r->fd);
+    r->fd = -1;
+  }
+#endif
+  pthread_mutex_lock(&r->lock);
+  while (r->inflight > 0)
+    pthread_cond_wait(&r->cond, &r->lock);
+  pthread_mutex_unlock(&r->lock);
+  for (i = r->done; i != -1; i = r->ops[i].next)
+    if (r->ops[i].op == R_OPEN && r->ops[i].result >= 0)
+      close(r->ops[i].result);
+  for (i = 0; i < r->size; i++)
+    free(r->ops[i].buf);
+  free(r->ops);
+  r->ops = 0;
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->cond);
+  return 0;
+}
+
+/* ring -- string */
+static int ring_tostring(lua_State *L)
+{
+  struct ring *r = luaL_checkudata(L, 1, RING_HANDLE);
+  if (!r->ops)
+    lua_pushliteral(L, "ring (closed)");
+  else
+    lua_pushfstring(L, "ring (%p)", (void *)r);
+  return 1;
+}
+
+/* [entries [backend]] -- ring/nil error */
+static int ex_ring(lua_State *L)
+{
+  static const char *const backends[] = { "auto", "io_uring", "threads", 0 };
+  int entries = luaL_optnumber(L, 1, RING_ENTRIES);
+  int backend = luaL_checkoption(L, 2, "auto", backends);
+  struct ring *r;
+  int i;
+  luaL_argcheck(L, entries >= 1 && entries <= RING_MAXENTRIES, 1,
+                "out of range");
+  r = lua_newuserdata(L, sizeof *r);
+  memset(r, 0, sizeof *r);
+  r->fd = -1;
+  r->free = r->queued = r->done = -1;
+  r->size = 2 * entries;
+#ifdef RING_URING
+  if (backend != 2 && -1 == uring_init(r, entries) && backend == 1)
+    return push_error(L);
+#else
+  if (backend == 1) {
+    errno = ENOSYS;
+    return push_error(L);
+  }
+#endif
+  if (!(r->ops = calloc(r->size, sizeof *r->ops))) {
+#ifdef RING_URING
+    if (r->fd != -1) {
+      uring_unmap(r);
+      close(r->fd);
+    }
+#endif
+    return luaL_error(L, "not enough memory");
+  }
+  for (i = r->size - 1; i >= 0; i--) {
+    r->ops[i].ring = r;
+    r->ops[i].next = r->free;
+    r->free = i;
+  }
+  pthread_mutex_init(&r->lock, 0);
+  pthread_cond_init(&r->cond, 0);
+  luaL_getmetatable(L, RING_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_newtable(L);
+  lua_setfenv(L, -2);
+  return 1;
+}
+
+/* ex -- ex */
+int ring_open(lua_State *L)
+{
+  const luaL_reg methods[] = {
+    {"stat",        ring_stat},
+    {"open",        ring_openfile},
+    {"read",        ring_read},
+    {"write",       ring_write},
+    {"fsync",       ring_fsync},
+    {"remove",      ring_remove},
+    {"mkdir",       ring_mkdir},
+    {"submit",      ring_submit},
+    {"wait",        ring_waitfor},
+    {"completions", ring_completions},
+    {"pending",     ring_pending},
+    {"backend",     ring_backend},
+    {"close",       ring_close},
+    {0,0} };
+  luaL_newmetatable(L, RING_HANDLE);          /* ex M */
+  lua_pushvalue(L, -1);                       /* ex M M */
+  lua_setfield(L, -2, "__index");             /* ex M */
+  luaL_register(L, 0, methods);               /* ex M */
+  /* opened files take the environment of io.open, through ring_next */
+  lua_getglobal(L, "io");                     /* ex M io */
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -2, "completions");       /* ex M io completions */
+    lua_getfield(L, -2, "open");              /* ex M io completions io_open */
+    lua_getfenv(L, -1);                       /* ex M io completions io_open E */
+    lua_setfenv(L, -3);                       /* ex M io completions io_open */
+    lua_pop(L, 2);                            /* ex M io */
+  }
+  lua_pop(L, 1);                              /* ex M */
+  lua_pushcfunction(L, ring_close);           /* ex M close */
+  lua_setfield(L, -2, "__gc");                /* ex M */
+  lua_pushcfunction(L, ring_tostring);        /* ex M tostring */
+  lua_setfield(L, -2, "__tostring");          /* ex M */
+  lua_pop(L, 1);                              /* ex */
+  lua_pushcfunction(L, ex_ring);              /* ex ring */
+  lua_setfield(L, -2, "ring");                /* ex */
+  return 0;
+}
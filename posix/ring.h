@@ -0,0 +1,13 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef RING_H
+#define RING_H
+
+#include "lua.h"
+
+int ring_open(lua_State *L);
+
+#endif/*RING_H*/
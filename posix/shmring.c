@@ -0,0 +1,538 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "spawn.h"
+#include "shmring.h"
+
+/* A shared-memory ring carries messages between processes.  It lives in a
+ * memfd, or a POSIX shared memory object when named, which children attach
+ * to by inheriting the file.  The mapping starts with a header:
+ *
+ *   magic size mpmc | producer end | consumer end | data...
+ *
+ * Each end keeps a byte position, which only grows (modulo 2^32), and a
+ * futex word bumped whenever the position moves, for the other end to wait
+ * on when the ring is empty or full.  A message is a 4-byte length and its
+ * bytes, padded to 4 bytes; one which would not fit before the end of the
+ * data leaves a SHM_WRAP length behind it and starts again at the front.
+ *
+ * With one producer and one consumer no locks are taken: each end writes
+ * only its own position.  In "mpmc" mode each end is serialised by a futex
+ * lock, held only while a message is copied. */
+
+#define SHMRING_HANDLE "ex.shm.ring"
+#define SHM_MAGIC 0x65785231            /* "exR1" */
+#define SHM_WRAP 0xffffffffu
+#define SHM_DATA 256                    /* offset of the data */
+#define SHM_DEFSIZE (1 << 20)
+#define SHM_MINSIZE 1024
+#define SHM_MAXSIZE (1 << 30)
+#define SHM_SPIN 2000                   /* polls before sleeping */
+
+struct shm_end {
+  uint32_t pos;                 /* bytes published, or consumed */
+  uint32_t seq;                 /* futex word, bumped when pos moves */
+  uint32_t waiters;             /* processes waiting for seq to move */
+  uint32_t lock;                /* mpmc: 0 free, 1 held, 2 contended */
+  uint64_t count;               /* messages published, or consumed */
+  char pad[40];                 /* an end to a cache line */
+};
+
+struct shm_header {
+  uint32_t magic;
+  uint32_t size;                /* of the data, a power of 2 */
+  uint32_t mpmc;
+  char pad[52];
+  struct shm_end prod, cons;
+};
+
+struct shmring {
+  int fd;
+  struct shm_header *h;         /* 0 once closed */
+  char *data;
+  uint32_t size;                /* h->size as checked when attached */
+  size_t mapsize;
+};
+
+extern int push_error(lua_State *L);
+extern FILE *check_file(lua_State *L, int idx, const char *argname);
+extern FILE **new_file(lua_State *L, int fd, const char *mode);
+
+#define load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* Waits while *word is val, until deadline (forever if negative).  Returns
+ * 0 when woken, which may be spurious, or -1 with ETIMEDOUT.  Without
+ * futexes, sleeps briefly instead. */
+static int shm_wait(uint32_t *word, uint32_t val, double deadline)
+{
+  struct timespec ts, *pts = 0;
+  double left = 0.001;
+  if (deadline >= 0) {
+    left = deadline - monotime();
+    if (left <= 0)
+      return errno = ETIMEDOUT, -1;
+    ts.tv_sec = (time_t)left;
+    ts.tv_nsec = (long)((left - ts.tv_sec) * 1e9);
+    pts = &ts;
+  }
+#ifdef __linux__
+  syscall(SYS_futex, word, FUTEX_WAIT, val, pts, 0, 0);
+#else
+  (void)pts;
+  if (load(word) == val) {
+    if (left > 0.001)
+      left = 0.001;
+    ts.tv_sec = 0;
+    ts.tv_nsec = (long)(left * 1e9);
+    nanosleep(&ts, 0);
+  }
+#endif
+  return 0;
+}
+
+static void shm_wake(uint32_t *word, int n)
+{
+#ifdef __linux__
+  syscall(SYS_futex, word, FUTEX_WAKE, n, 0, 0, 0);
+#else
+  (void)word;
+  (void)n;
+#endif
+}
+
+/* Moves an end's position and wakes whoever waits on it. */
+static void shm_advance(struct shm_end *e, uint32_t pos)
+{
+  store(&e->pos, pos);
+  e->count++;
+  __atomic_add_fetch(&e->seq, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&e->waiters, __ATOMIC_SEQ_CST))
+    shm_wake(&e->seq, INT_MAX);
+}
+
+/* Waits for e->seq to move from seq, spinning a while first since the
+ * other end is usually running too on another CPU.  Returns 0, or -1 with
+ * ETIMEDOUT. */
+static int shm_block(struct shm_end *e, uint32_t seq, double deadline)
+{
+  static int spin = -1;
+  int i, ret;
+  if (spin == -1)
+    spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+  for (i = 0; i < spin; i++)
+    if (load(&e->seq) != seq)
+      return 0;
+  __atomic_add_fetch(&e->waiters, 1, __ATOMIC_SEQ_CST);
+  ret = shm_wait(&e->seq, seq, deadline);
+  __atomic_sub_fetch(&e->waiters, 1, __ATOMIC_SEQ_CST);
+  return ret;
+}
+
+static void shm_lock(uint32_t *lock)
+{
+  uint32_t c = 0;
+  if (__atomic_compare_exchange_n(lock, &c, 1, 0, __ATOMIC_ACQUIRE,
+                                  __ATOMIC_RELAXED))
+    return;
+  if (c != 2)
+    c = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+  while (c != 0) {
+#ifdef __linux__
+    syscall(SYS_futex, lock, FUTEX_WAIT, 2, 0, 0, 0);
+#else
+    sched_yield();
+#endif
+    c = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+  }
+}
+
+static void shm_unlock(uint32_t *lock)
+{
+  if (__atomic_exchange_n(lock, 0, __ATOMIC_RELEASE) == 2)
+    shm_wake(lock, 1);
+}
+
+#define RECSIZE(len) (((size_t)(len) + 7) & ~(size_t)3)
+
+/* Copies a message in if there is room.  Returns 1, or 0 if full. */
+static int shm_tryput(struct shmring *r, const char *s, size_t len)
+{
+  struct shm_header *h = r->h;
+  uint32_t head = h->prod.pos, tail = load(&h->cons.pos);
+  uint32_t off = head & (r->size - 1), gap = r->size - off;
+  uint32_t rec = RECSIZE(len), need = rec > gap ? gap + rec : rec;
+  if (r->size - (head - tail) < need)
+    return 0;
+  if (rec > gap) {
+    *(uint32_t *)(r->data + off) = SHM_WRAP;
+    head += gap;
+    off = 0;
+  }
+  *(uint32_t *)(r->data + off) = len;
+  memcpy(r->data + off + 4, s, len);
+  shm_advance(&h->prod, head + rec);
+  return 1;
+}
+
+/* -- message?  Pushes the next message if there is one.  Returns 1, 0 if
+ * empty, or -1 with EBADMSG if the positions or a length, which any
+ * process attached to the ring may have written, are out of bounds. */
+static int shm_tryget(lua_State *L, struct shmring *r)
+{
+  struct shm_header *h = r->h;
+  uint32_t tail = h->cons.pos, head = load(&h->prod.pos);
+  uint32_t off, len;
+  if (head == tail)
+    return 0;
+  off = tail & (r->size - 1);
+  if (off & 3)
+    return errno = EBADMSG, -1;
+  if ((len = *(uint32_t *)(r->data + off)) == SHM_WRAP) {
+    if (r->size - off >= head - tail)
+      return errno = EBADMSG, -1;
+    tail += r->size - off;
+    off = 0;
+    len = *(uint32_t *)(r->data + off);
+  }
+  if (len > r->size - off - 4 || RECSIZE(len) > (uint32_t)(head - tail))
+    return errno = EBADMSG, -1;
+  lua_pushlstring(L, r->data + off + 4, len);
+  shm_advance(&h->cons, tail + RECSIZE(len));
+  return 1;
+}
+
+/* Maps fd, initialising the ring when create is set, else waiting up to a
+ * second for its creator to do so. */
+static int shm_attach(struct shmring *r, int create, uint32_t size, int mpmc)
+{
+  struct stat st;
+  struct timespec ts;
+  double deadline = monotime() + 1;
+  void *p;
+  if (create && -1 == ftruncate(r->fd, SHM_DATA + size))
+    return -1;
+  for (;;) {
+    if (-1 == fstat(r->fd, &st))
+      return -1;
+    if (st.st_size >= SHM_DATA) {
+      if (MAP_FAILED == (p = mmap(0, st.st_size, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, r->fd, 0)))
+        return -1;
+      r->h = p;
+      r->data = (char *)p + SHM_DATA;
+      r->mapsize = st.st_size;
+      if (create) {
+        r->h->size = r->size = size;
+        r->h->mpmc = mpmc;
+        store(&r->h->magic, SHM_MAGIC);
+        return 0;
+      }
+      if (load(&r->h->magic) == SHM_MAGIC) {
+        size = r->h->size;
+        if (size >= SHM_MINSIZE && !(size & (size - 1))
+            && SHM_DATA + (off_t)size <= st.st_size) {
+          r->size = size;
+          return 0;
+        }
+        deadline = 0;
+      }
+      munmap(p, st.st_size);
+      r->h = 0;
+    }
+    if (monotime() > deadline)
+      return errno = EINVAL, -1;
+    ts.tv_sec = 0;
+    ts.tv_nsec = 1000000;
+    nanosleep(&ts, 0);
+  }
+}
+
+static struct shmring *checkring(lua_State *L, int idx)
+{
+  struct shmring *r = luaL_checkudata(L, idx, SHMRING_HANDLE);
+  if (!r->h) luaL_error(L, "attempt to use a closed ring");
+  return r;
+}
+
+static double opt_deadline(lua_State *L, int idx)
+{
+  double timeout = luaL_optnumber(L, idx, -1);
+  if (timeout < 0)
+    return -1;
+  return monotime() + timeout;
+}
+
+/* [name/file] [size] [options] -- ring/nil error */
+static int ex_shmring(lua_State *L)
+{
+  static const char *const modes[] = { "spsc", "mpmc", 0 };
+  lua_Number n = luaL_optnumber(L, 2, SHM_DEFSIZE);
+  uint32_t size = SHM_MINSIZE;
+  int create = 1, mpmc = 0;
+  struct shmring *r;
+  if (n > SHM_MAXSIZE)
+    return luaL_argerror(L, 2, "ring too large");
+  while (size < n)
+    size <<= 1;
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "mode");
+    if (!lua_isnil(L, -1)) {
+      const char *mode = luaL_checkstring(L, -1);
+      for (; modes[mpmc] && strcmp(mode, modes[mpmc]); mpmc++)
+        ;
+      if (!modes[mpmc])
+        return luaL_error(L, "bad mode option (%s)", mode);
+    }
+    lua_pop(L, 1);
+  }
+  r = lua_newuserdata(L, sizeof *r);
+  r->fd = -1;
+  r->h = 0;
+  luaL_getmetatable(L, SHMRING_HANDLE);
+  lua_setmetatable(L, -2);
+  switch (lua_type(L, 1)) {
+  case LUA_TNONE:
+  case LUA_TNIL:
+#ifdef SYS_memfd_create
+    r->fd = syscall(SYS_memfd_create, "ex.shm.ring", 1 /* MFD_CLOEXEC */);
+#else
+    {
+      FILE *f = tmpfile();
+      if (f) {
+        r->fd = dup(fileno(f));
+        fclose(f);
+        if (r->fd != -1)
+          fcntl(r->fd, F_SETFD, FD_CLOEXEC);
+      }
+    }
+#endif
+    break;
+  case LUA_TSTRING:
+    r->fd = shm_open(lua_tostring(L, 1), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (r->fd == -1 && errno == EEXIST) {
+      create = 0;
+      r->fd = shm_open(lua_tostring(L, 1), O_RDWR, 0);
+    }
+    break;
+  default:
+    {
+      struct stat st;
+      r->fd = dup(fileno(check_file(L, 1, NULL)));
+      if (r->fd != -1) {
+        fcntl(r->fd, F_SETFD, FD_CLOEXEC);
+        if (0 == fstat(r->fd, &st))
+          create = st.st_size == 0;
+      }
+    }
+  }
+  if (r->fd == -1 || -1 == shm_attach(r, create, size, mpmc))
+    return push_error(L);
+  return 1;
+}
+
+/* ring message [timeout] -- true/nil error */
+static int shmring_put(lua_State *L)
+{
+  struct shmring *r = checkring(L, 1);
+  size_t len;
+  const char *s = luaL_checklstring(L, 2, &len);
+  double deadline = opt_deadline(L, 3);
+  struct shm_header *h = r->h;
+  if (RECSIZE(len) > r->size / 2)
+    return luaL_argerror(L, 2, "message too large for the ring");
+  for (;;) {
+    uint32_t seq = load(&h->cons.seq);
+    int ok;
+    if (h->mpmc) shm_lock(&h->prod.lock);
+    ok = shm_tryput(r, s, len);
+    if (h->mpmc) shm_unlock(&h->prod.lock);
+    if (ok)
+      break;
+    if (-1 == shm_block(&h->cons, seq, deadline)) {
+      lua_pushnil(L);
+      lua_pushliteral(L, "timeout");
+      return 2;
+    }
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* ring [timeout] -- message/nil error */
+static int shmring_get(lua_State *L)
+{
+  struct shmring *r = checkring(L, 1);
+  double deadline = opt_deadline(L, 2);
+  struct shm_header *h = r->h;
+  for (;;) {
+    uint32_t seq = load(&h->prod.seq);
+    int ok;
+    if (h->mpmc) shm_lock(&h->cons.lock);
+    ok = shm_tryget(L, r);
+    if (h->mpmc) shm_unlock(&h->cons.lock);
+    if (ok == -1)
+      return push_error(L);
+    if (ok)
+      return 1;
+    if (-1 == shm_block(&h->prod, seq, deadline)) {
+      lua_pushnil(L);
+      lua_pushliteral(L, "timeout");
+      return 2;
+    }
+  }
+}
+
+/* ring [max] -- {message...}/nil error */
+static int shmring_drain(lua_State *L)
+{
+  struct shmring *r = checkring(L, 1);
+  lua_Number max = luaL_optnumber(L, 2, -1);
+  struct shm_header *h = r->h;
+  int i = 0, ok = 0;
+  lua_settop(L, 1);
+  lua_newtable(L);
+  if (h->mpmc) shm_lock(&h->cons.lock);
+  while ((max < 0 || i < max) && 1 == (ok = shm_tryget(L, r)))
+    lua_rawseti(L, 2, ++i);
+  if (h->mpmc) shm_unlock(&h->cons.lock);
+  if (ok == -1)
+    return push_error(L);
+  return 1;
+}
+
+/* ring -- file/nil error
+ * The file takes the environment of io.open, as io.pipe. */
+static int shmring_file(lua_State *L)
+{
+  struct shmring *r = checkring(L, 1);
+  int fd = dup(r->fd);
+  if (fd == -1)
+    return push_error(L);
+  if (!*new_file(L, fd, "r+")) {
+    close(fd);
+    return push_error(L);
+  }
+  return 1;
+}
+
+/* ring -- stats */
+static int shmring_stats(lua_State *L)
+{
+  struct shm_header *h = checkring(L, 1)->h;
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, h->size);
+  lua_setfield(L, -2, "size");
+  lua_pushnumber(L, (uint32_t)(load(&h->prod.pos) - load(&h->cons.pos)));
+  lua_setfield(L, -2, "used");
+  lua_pushnumber(L, h->prod.count);
+  lua_setfield(L, -2, "puts");
+  lua_pushnumber(L, h->cons.count);
+  lua_setfield(L, -2, "gets");
+  lua_pushstring(L, h->mpmc ? "mpmc" : "spsc");
+  lua_setfield(L, -2, "mode");
+  return 1;
+}
+
+/* ring -- */
+static int shmring_close(lua_State *L)
+{
+  struct shmring *r = luaL_checkudata(L, 1, SHMRING_HANDLE);
+  if (r->h) {
+    munmap(r->h, r->mapsize);
+    r->h = 0;
+  }
+  if (r->fd != -1) {
+    close(r->fd);
+    r->fd = -1;
+  }
+  return 0;
+}
+
+/* ring -- string */
+static int shmring_tostring(lua_State *L)
+{
+  struct shmring *r = luaL_checkudata(L, 1, SHMRING_HANDLE);
+  if (r->h)
+    lua_pushfstring(L, "shm ring (%d, %s)", (int)r->h->size,
+                    r->h->mpmc ? "mpmc" : "spsc");
+  else
+    lua_pushliteral(L, "shm ring (closed)");
+  return 1;
+}
+
+/* name -- true/nil error */
+static int ex_shmunlink(lua_State *L)
+{
+  if (-1 == shm_unlink(luaL_checkstring(L, 1)))
+    return push_error(L);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* ex -- ex */
+int shmring_open(lua_State *L)
+{
+  const luaL_reg methods[] = {
+    {"put",      shmring_put},
+    {"get",      shmring_get},
+    {"drain",    shmring_drain},
+    {"file",     shmring_file},
+    {"stats",    shmring_stats},
+    {"close",    shmring_close},
+    {0,0} };
+  luaL_newmetatable(L, SHMRING_HANDLE);       /* ex M */
+  lua_pushvalue(L, -1);                       /* ex M M */
+  lua_setfield(L, -2, "__index");             /* ex M */
+  luaL_register(L, 0, methods);               /* ex M */
+  lua_getglobal(L, "io");                     /* ex M io */
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -2, "file");              /* ex M io file */
+    lua_getfield(L, -2, "open");              /* ex M io file io_open */
+    lua_getfenv(L, -1);                       /* ex M io file io_open E */
+    lua_setfenv(L, -3);                       /* ex M io file io_open */
+    lua_pop(L, 2);                            /* ex M io */
+  }
+  lua_pop(L, 1);                              /* ex M */
+  lua_pushcfunction(L, shmring_close);        /* ex M close */
+  lua_setfield(L, -2, "__gc");                /* ex M */
+  lua_pushcfunction(L, shmring_tostring);     /* ex M tostring */
+  lua_setfield(L, -2, "__tostring");          /* ex M */
+  lua_pop(L, 1);                              /* ex */
+  lua_newtable(L);                            /* ex S */
+  lua_pushcfunction(L, ex_shmring);           /* ex S ring */
+  lua_setfield(L, -2, "ring");                /* ex S */
+  lua_pushcfunction(L, ex_shmunlink);         /* ex S unlink */
+  lua_setfield(L, -2, "unlink");              /* ex S */
+  lua_setfield(L, -2, "shm");                 /* ex */
+  return 0;
+}
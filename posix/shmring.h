@@ -0,0 +1,13 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include "lua.h"
+
+int shmring_open(lua_State *L);
+
+#endif/*SHMRING_H*/
@@ -3,25 +3,82 @@
  * http://lua-users.org/wiki/ExtensionProposal
  * Copyright 2007 Mark Edgar < medgar at gmail com >
  */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 #if MISSING_POSIX_SPAWN
 #include "posix_spawn.h"
 #else
 #include <spawn.h>
 #endif
 
-#include "environ.h"
-
 #include "lua.h"
 #include "lauxlib.h"
 
 #include "spawn.h"
+#include "jobserver.h"
+#include "lines.h"
+#include "procstats.h"
+#include "envsnap.h"
+#include "which.h"
+
+/* settings for which spawn_param_execute() forks instead of using
+ * posix_spawn */
+enum {
+  SPAWN_SETSID = 0x01,
+  SPAWN_CPUS = 0x02,
+  SPAWN_NICE = 0x04,
+  SPAWN_IOPRIO = 0x08,
+  SPAWN_UMASK = 0x10,
+  SPAWN_RLIMITS = 0x20
+};
+#define SPAWN_RLIMITS_MAX 16
 
 struct spawn_params {
   lua_State *L;
   const char *command, **argv, **envp;
+  const char *path;     /* resolved pathname to execute, if known */
   posix_spawn_file_actions_t redirect;
+  posix_spawnattr_t attr;
+  short flags;
+  pid_t pgid;
+  int dups[3];          /* the redirections, replayed by spawn_fork() */
+  int sched;            /* SPAWN_* settings which posix_spawn cannot apply */
+#ifdef __linux__
+  cpu_set_t cpus;
+#endif
+  int nice, ioprio;
+  mode_t umask;
+  int nrlimits;
+  struct {
+    int resource;
+    struct rlimit limit;
+  } rlimits[SPAWN_RLIMITS_MAX];
+  struct jobserver *js;
+  int capture[3];
+  const char *input;
+  size_t inputlen;
+  /* between spawn_param_prepare() and spawn_param_finish() */
+  struct process *proc;
+  int child[3];
+  int token;
 };
 
 extern int push_error(lua_State *L);
@@ -30,8 +87,16 @@ struct spawn_params *spawn_param_init(lua_State *L)
 {
   struct spawn_params *p = lua_newuserdata(L, sizeof *p);
   p->L = L;
-  p->command = 0;
+  p->command = p->path = 0;
   p->argv = p->envp = 0;
+  p->flags = 0;
+  p->pgid = -1;
+  p->dups[0] = p->dups[1] = p->dups[2] = -1;
+  p->sched = 0;
+  p->nrlimits = 0;
+  p->js = 0;
+  p->capture[0] = p->capture[1] = p->capture[2] = 0;
+  p->input = 0;
   posix_spawn_file_actions_init(&p->redirect);
   return p;
 }
@@ -41,6 +106,13 @@ void spawn_param_filename(struct spawn_params *p, const char *filename)
   p->command = filename;
 }
 
+/* Executes pathname without searching PATH; argv[0] stays the command
+ * name.  The string must remain valid until spawn_param_execute(). */
+void spawn_param_path(struct spawn_params *p, const char *pathname)
+{
+  p->path = pathname;
+}
+
 /* Converts a Lua array of strings to a null-terminated array of char pointers.
  * Pops a (0-based) Lua array and replaces it with a userdatum which is the
  * null-terminated C array of char pointers.  The elements of this array point
@@ -108,55 +180,1303 @@ void spawn_param_env(struct spawn_params *p)
   p->envp = make_vector(L);             /* ... envtab arr vector */
 }
 
-void spawn_param_redirect(struct spawn_params *p, const char *stdname, int fd)
+static int stdindex(const char *stdname)
 {
-  int d;
   switch (stdname[3]) {
-  case 'i': d = STDIN_FILENO; break;
-  case 'o': d = STDOUT_FILENO; break;
-  case 'e': d = STDERR_FILENO; break;
+  case 'i': return STDIN_FILENO;
+  case 'o': return STDOUT_FILENO;
+  default: return STDERR_FILENO;
+  }
+}
+
+static void param_dup2(struct spawn_params *p, int fd, int i)
+{
+  p->dups[i] = fd;
+  posix_spawn_file_actions_adddup2(&p->redirect, fd, i);
+}
+
+void spawn_param_redirect(struct spawn_params *p, const char *stdname, int fd)
+{
+  param_dup2(p, fd, stdindex(stdname));
+}
+
+/* Connects stdout or stderr to a pipe (CAPTURE_PIPE) or an anonymous file
+ * (CAPTURE_FILE) which proc:communicate() collects. */
+void spawn_param_capture(struct spawn_params *p, const char *stdname, int kind)
+{
+  p->capture[stdindex(stdname)] = kind;
+}
+
+/* Feeds data to stdin through a pipe.  The string must remain valid until
+ * spawn_param_execute() is called. */
+void spawn_param_input(struct spawn_params *p, const char *data, size_t len)
+{
+  p->capture[STDIN_FILENO] = CAPTURE_PIPE;
+  p->input = data;
+  p->inputlen = len;
+}
+
+/* pgid 0 starts a new process group led by the child */
+void spawn_param_pgroup(struct spawn_params *p, pid_t pgid)
+{
+  p->flags |= POSIX_SPAWN_SETPGROUP;
+  p->pgid = pgid;
+}
+
+/* start a new session, and so a new process group, led by the child */
+void spawn_param_setsid(struct spawn_params *p)
+{
+  p->sched |= SPAWN_SETSID;
+}
+
+/* Adds cpu to the set the child may run on.  Returns -1 if the system
+ * cannot restrict affinity or cpu is out of range. */
+int spawn_param_cpu(struct spawn_params *p, int cpu)
+{
+#ifdef __linux__
+  if (cpu < 0 || cpu >= CPU_SETSIZE)
+    return -1;
+  if (!(p->sched & SPAWN_CPUS)) {
+    CPU_ZERO(&p->cpus);
+    p->sched |= SPAWN_CPUS;
   }
-  posix_spawn_file_actions_adddup2(&p->redirect, fd, d);
+  CPU_SET(cpu, &p->cpus);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/* the absolute nice value of the child */
+void spawn_param_nice(struct spawn_params *p, int nice)
+{
+  p->sched |= SPAWN_NICE;
+  p->nice = nice;
+}
+
+/* Sets the I/O scheduling class (IOPRIO_CLASS_*) and level of the child.
+ * Returns -1 if the system has no I/O priorities. */
+int spawn_param_ioprio(struct spawn_params *p, int class, int level)
+{
+#ifdef SYS_ioprio_set
+  p->sched |= SPAWN_IOPRIO;
+  p->ioprio = class << 13 | level;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+void spawn_param_umask(struct spawn_params *p, mode_t mask)
+{
+  p->sched |= SPAWN_UMASK;
+  p->umask = mask;
+}
+
+/* Returns -1 if too many limits are given. */
+int spawn_param_rlimit(struct spawn_params *p, int resource,
+                       rlim_t soft, rlim_t hard)
+{
+  if (p->nrlimits == SPAWN_RLIMITS_MAX)
+    return -1;
+  p->rlimits[p->nrlimits].resource = resource;
+  p->rlimits[p->nrlimits].limit.rlim_cur = soft;
+  p->rlimits[p->nrlimits].limit.rlim_max = hard;
+  p->nrlimits++;
+  p->sched |= SPAWN_RLIMITS;
+  return 0;
+}
+
+/* acquire a job slot from the jobserver before spawning */
+void spawn_param_jobserver(struct spawn_params *p, struct jobserver *js)
+{
+  p->js = js;
 }
 
+/* The parent's side of a captured standard stream. */
+struct stream {
+  int fd;               /* -1 once closed */
+  int kind;             /* CAPTURE_PIPE or CAPTURE_FILE, 0 if not captured */
+  char *buf;
+  size_t len, size;
+  size_t pos;           /* for stdin, how much of buf has been written */
+};
+
 struct process {
-  int status;
+  int status;           /* exit code, 128+signal, or -1 while running */
+  int wstatus;          /* raw status from wait4() */
+  struct rusage usage;
   pid_t pid;
+  pid_t pgid;           /* -1 unless spawned into its own process group */
+  int pidfd;
+  unsigned long serial;  /* of the reaper's entry, or 0 if there is none */
+  struct jobserver *js; /* jobserver the token came from, if any */
+  int token;
+  struct stream io[3];
 };
 
-int spawn_param_execute(struct spawn_params *p)
+static void stream_close(struct stream *s)
+{
+  if (s->fd != -1) {
+    close(s->fd);
+    s->fd = -1;
+  }
+}
+
+static void stream_free(struct stream *s)
+{
+  stream_close(s);
+  free(s->buf);
+  s->buf = 0;
+  s->len = s->size = s->pos = 0;
+  s->kind = 0;
+}
+
+/* Ensures room for at least need more bytes. */
+static int stream_reserve(struct stream *s, size_t need)
+{
+  if (s->size - s->len < need) {
+    size_t size = s->size ? s->size : 65536;
+    char *buf;
+    while (size - s->len < need)
+      size *= 2;
+    if (!(buf = realloc(s->buf, size))) {
+      errno = ENOMEM;
+      return -1;
+    }
+    s->buf = buf;
+    s->size = size;
+  }
+  return 0;
+}
+
+static int stream_append(struct stream *s, const char *data, size_t len)
+{
+  if (-1 == stream_reserve(s, len))
+    return -1;
+  memcpy(s->buf + s->len, data, len);
+  s->len += len;
+  return 0;
+}
+
+/* An anonymous file for output of unknown size; it needs no draining
+ * while the child runs. */
+static int anonfile(void)
+{
+  FILE *f;
+  int fd;
+#ifdef SYS_memfd_create
+  fd = syscall(SYS_memfd_create, "ex-capture", 1 /* MFD_CLOEXEC */);
+  if (fd != -1)
+    return fd;
+#endif
+  if (!(f = tmpfile()))
+    return -1;
+  fd = dup(fileno(f));
+  fclose(f);
+  if (fd != -1)
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+/* Creates the parent's ends of captured streams and adds the child's ends
+ * to the file actions.  child[] receives descriptors to close after the
+ * spawn. */
+static int capture_open(struct spawn_params *p, struct process *proc,
+                        int child[3])
+{
+  int i, fd[2];
+  child[0] = child[1] = child[2] = -1;
+  for (i = 0; i < 3; i++) {
+    if (!p->capture[i])
+      continue;
+    proc->io[i].kind = p->capture[i];
+    if (p->capture[i] == CAPTURE_FILE) {
+      if (-1 == (proc->io[i].fd = anonfile()))
+        return -1;
+      param_dup2(p, proc->io[i].fd, i);
+      continue;
+    }
+    if (-1 == pipe(fd))
+      return -1;
+    fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+    child[i] = i == STDIN_FILENO ? fd[0] : fd[1];
+    proc->io[i].fd = i == STDIN_FILENO ? fd[1] : fd[0];
+    fcntl(proc->io[i].fd, F_SETFL, O_NONBLOCK);
+    param_dup2(p, child[i], i);
+  }
+  if (p->input && -1 == stream_append(&proc->io[0], p->input, p->inputlen))
+    return -1;
+  return 0;
+}
+
+/* The process holds token until it is reaped or collected. */
+void process_settoken(struct process *p, struct jobserver *js, int token)
+{
+  jobserver_ref(js);
+  p->js = js;
+  p->token = token;
+}
+
+static void process_releasetoken(struct process *p)
+{
+  if (p->js) {
+    jobserver_release(p->js, p->token);
+    jobserver_unref(p->js);
+    p->js = 0;
+  }
+}
+
+/* Returns a descriptor which becomes readable when the process terminates,
+ * or -1 if the system cannot provide one. */
+static int process_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  return -1;
+#endif
+}
+
+#ifndef NSIG
+#define NSIG 65
+#endif
+
+/* Fills caught with the signals which have a handler.  A child must not
+ * run them between fork and exec, which resets them to their defaults. */
+static void caught_signals(sigset_t *caught)
+{
+  struct sigaction sa;
+  int sig;
+  sigemptyset(caught);
+  for (sig = 1; sig < NSIG; sig++)
+    if (0 == sigaction(sig, 0, &sa)
+        && sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN)
+      sigaddset(caught, sig);
+}
+
+/* In the child: applies the parameters and executes the command.  Returns
+ * only on failure, with errno set. */
+static void spawn_child(struct spawn_params *p)
+{
+  sigset_t set;
+  int i;
+  if (p->sched & SPAWN_SETSID) {
+    if (-1 == setsid())
+      return;
+  }
+  else if (p->flags & POSIX_SPAWN_SETPGROUP && -1 == setpgid(0, p->pgid))
+    return;
+  for (i = 0; i < 3; i++) {
+    if (p->dups[i] == -1)
+      continue;
+    if (p->dups[i] == i) {
+      if (-1 == fcntl(i, F_SETFD, 0))
+        return;
+    }
+    else if (-1 == dup2(p->dups[i], i))
+      return;
+  }
+  if (p->sched & SPAWN_UMASK)
+    umask(p->umask);
+  for (i = 0; i < p->nrlimits; i++)
+    if (-1 == setrlimit(p->rlimits[i].resource, &p->rlimits[i].limit))
+      return;
+#ifdef __linux__
+  if (p->sched & SPAWN_CPUS
+      && -1 == sched_setaffinity(0, sizeof p->cpus, &p->cpus))
+    return;
+#endif
+#ifdef SYS_ioprio_set
+  if (p->sched & SPAWN_IOPRIO
+      && -1 == syscall(SYS_ioprio_set, 1 /*IOPRIO_WHO_PROCESS*/, 0, p->ioprio))
+    return;
+#endif
+  if (p->sched & SPAWN_NICE && -1 == setpriority(PRIO_PROCESS, 0, p->nice))
+    return;
+  /* the launching thread may block signals: an ex.async worker blocks
+   * them all, and ex.loop those it watches */
+  caught_signals(&set);
+  for (i = 1; i < NSIG; i++)
+    if (sigismember(&set, i) == 1)
+      signal(i, SIG_DFL);
+  sigemptyset(&set);
+  sigprocmask(SIG_SETMASK, &set, 0);
+  execve(p->path, (char *const *)p->argv, (char *const *)p->envp);
+}
+
+/* Used instead of posix_spawn() when the child needs settings which
+ * posix_spawn cannot express.  A close-on-exec pipe carries errno back from
+ * a child which failed before exec.  Returns 0 or an error number. */
+static int spawn_fork(struct spawn_params *p, pid_t *ppid)
+{
+  int fd[2], err;
+  ssize_t n;
+  if (-1 == pipe(fd))
+    return errno;
+  fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+  switch (*ppid = fork()) {
+  case -1:
+    err = errno;
+    close(fd[0]);
+    close(fd[1]);
+    return err;
+  case 0:
+    close(fd[0]);
+    spawn_child(p);
+    err = errno;
+    write(fd[1], &err, sizeof err);
+    _exit(127);
+    /*NOTREACHED*/
+  }
+  close(fd[1]);
+  if (!(p->sched & SPAWN_SETSID) && p->flags & POSIX_SPAWN_SETPGROUP)
+    setpgid(*ppid, p->pgid);
+  do n = read(fd[0], &err, sizeof err);
+  while (n == -1 && errno == EINTR);
+  close(fd[0]);
+  if (n != sizeof err)
+    return 0;
+  while (-1 == waitpid(*ppid, 0, 0) && errno == EINTR)
+    ;
+  return err;
+}
+
+static int sigchld_init(void);
+static unsigned long child_add(pid_t pid);
+
+/* Spawning is split in three so that the middle part, which makes no use
+ * of the Lua state, can run on a worker thread (see async.c). */
+
+/* ... -- ... proc/nil error
+ * Returns 1 with the proc pushed, or 2 with nil and an error message. */
+int spawn_param_prepare(struct spawn_params *p)
 {
   lua_State *L = p->L;
-  int ret;
   struct process *proc;
+  int i;
+  if (!p->path) {
+    /* searched here, in the environment snapshot: posix_spawnp and execvp
+     * would read PATH from environ on the launching thread */
+    if (strchr(p->command, '/'))
+      p->path = p->command;
+    else if (which_search(L, p->command))
+      p->path = lua_tostring(L, -1);
+  }
   if (!p->argv) {
     p->argv = lua_newuserdata(L, 2 * sizeof *p->argv);
     p->argv[0] = p->command;
     p->argv[1] = 0;
   }
-  if (!p->envp)
-    p->envp = (const char **)environ;
-  proc = lua_newuserdata(L, sizeof *proc);
+  if (!p->envp) {
+    /* a copy, so that setenv() cannot change it under a worker thread */
+    p->envp = env_copy(L);
+  }
+  p->proc = proc = lua_newuserdata(L, sizeof *proc);
+  proc->status = -1;
+  proc->pid = 0;
+  proc->pgid = -1;
+  proc->pidfd = -1;
+  proc->serial = 0;
+  proc->js = 0;
+  for (i = 0; i < 3; i++) {
+    proc->io[i].fd = -1;
+    proc->io[i].kind = 0;
+    proc->io[i].buf = 0;
+    proc->io[i].len = proc->io[i].size = proc->io[i].pos = 0;
+  }
   luaL_getmetatable(L, PROCESS_HANDLE);
   lua_setmetatable(L, -2);
-  proc->status = -1;
-  ret = posix_spawnp(&proc->pid, p->command, &p->redirect, 0,
-                     (char *const *)p->argv, (char *const *)p->envp);
+  if (-1 == capture_open(p, proc, p->child)
+      || (p->js && (p->token = jobserver_acquire(p->js, -1)) < 0)) {
+    for (i = 0; i < 3; i++)
+      if (p->child[i] != -1) close(p->child[i]);
+    posix_spawn_file_actions_destroy(&p->redirect);
+    return push_error(L);
+  }
+  return 1;
+}
+
+/* Starts the process.  Returns 0 or an error number. */
+int spawn_param_launch(struct spawn_params *p)
+{
+  struct process *proc = p->proc;
+  int ret;
+  if (!p->path)
+    ret = ENOENT;
+  else if (p->sched)
+    ret = spawn_fork(p, &proc->pid);
+  else {
+    sigset_t set;
+    /* as in spawn_child(): no signal blocked, and no handler run */
+    posix_spawnattr_init(&p->attr);
+    posix_spawnattr_setflags(&p->attr, p->flags | POSIX_SPAWN_SETSIGMASK
+                                       | POSIX_SPAWN_SETSIGDEF);
+    if (p->flags & POSIX_SPAWN_SETPGROUP)
+      posix_spawnattr_setpgroup(&p->attr, p->pgid);
+    sigemptyset(&set);
+    posix_spawnattr_setsigmask(&p->attr, &set);
+    caught_signals(&set);
+    posix_spawnattr_setsigdefault(&p->attr, &set);
+    ret = posix_spawn(&proc->pid, p->path, &p->redirect, &p->attr,
+                      (char *const *)p->argv, (char *const *)p->envp);
+    posix_spawnattr_destroy(&p->attr);
+  }
   posix_spawn_file_actions_destroy(&p->redirect);
-  return ret != 0 ? push_error(L) : 1;
+  return ret;
+}
+
+/* ... proc -- ... proc/nil error */
+int spawn_param_finish(struct spawn_params *p, int err)
+{
+  lua_State *L = p->L;
+  struct process *proc = p->proc;
+  int i;
+  for (i = 0; i < 3; i++)
+    if (p->child[i] != -1) close(p->child[i]);
+  if (err != 0) {
+    proc->pid = 0;
+    if (p->js)
+      jobserver_release(p->js, p->token);
+    if (err > 0)
+      errno = err;
+    return push_error(L);
+  }
+  if (p->js)
+    process_settoken(proc, p->js, p->token);
+  if (p->sched & SPAWN_SETSID)
+    proc->pgid = proc->pid;
+  else if (p->flags & POSIX_SPAWN_SETPGROUP)
+    proc->pgid = p->pgid == 0 ? proc->pid : p->pgid;
+  proc->pidfd = process_pidfd(proc->pid);
+  if (-1 != sigchld_init())
+    proc->serial = child_add(proc->pid);
+  return 1;
+}
+
+int spawn_param_execute(struct spawn_params *p)
+{
+  int n = spawn_param_prepare(p);
+  if (n != 1)
+    return n;
+  return spawn_param_finish(p, spawn_param_launch(p));
+}
+
+
+/* Self-pipe which the SIGCHLD handler writes to; used to wait with a timeout
+ * for processes which have no pidfd. */
+static int sigchld_pipe[2] = { -1, -1 };
+static struct sigaction sigchld_prev;
+
+static void reaper_sweep(pid_t pid);
+
+static void sigchld_handler(int sig, siginfo_t *info, void *context)
+{
+  int saved = errno;
+  ssize_t ignored;
+  reaper_sweep(info ? info->si_pid : 0);
+  ignored = write(sigchld_pipe[1], "", 1);
+  (void)ignored;
+  errno = saved;
+  /* chain to any handler which was installed before ours */
+  if (sigchld_prev.sa_flags & SA_SIGINFO)
+    sigchld_prev.sa_sigaction(sig, info, context);
+  else if (sigchld_prev.sa_handler != SIG_DFL
+           && sigchld_prev.sa_handler != SIG_IGN)
+    sigchld_prev.sa_handler(sig);
+}
+
+static int sigchld_init(void)
+{
+  struct sigaction sa;
+  int i;
+  if (sigchld_pipe[0] != -1)
+    return sigchld_pipe[0];
+  if (-1 == pipe(sigchld_pipe))
+    return -1;
+  for (i = 0; i < 2; i++) {
+    fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+    fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+  }
+  sa.sa_sigaction = sigchld_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa, &sigchld_prev);
+  return sigchld_pipe[0];
+}
+
+static void sigchld_drain(void)
+{
+  char buf[64];
+  while (read(sigchld_pipe[0], buf, sizeof buf) > 0)
+    ;
+}
+
+/* The reaper.  Every child is entered in a table which the SIGCHLD handler
+ * reaps into, so that waiting for a child which has already terminated
+ * costs no system call, and children whose proc is collected without being
+ * waited for do not linger as zombies.  Only the handler completes an
+ * entry, publishing it by setting state last.  Any thread may spawn or
+ * wait, so the table is guarded by a spin lock, which the handler can take
+ * as a mutex could not be; threads take it with SIGCHLD blocked, so that
+ * the handler never spins on the lock of the thread it interrupted.
+ * Reaped pids may be reused before their procs are waited for, so the main
+ * thread finds its entry by serial as well as pid. */
+enum {
+  CHILD_FREE,           /* never used; ends a probe sequence */
+  CHILD_RUNNING,
+  CHILD_DETACHED,       /* running, and to be forgotten once reaped */
+  CHILD_DONE,           /* reaped; wstatus and usage are valid */
+  CHILD_DELETED
+};
+
+struct child {
+  pid_t pid;
+  unsigned long serial;
+  volatile sig_atomic_t state;
+  int wstatus;
+  struct rusage usage;
+};
+
+static struct child *children;
+static size_t children_size;    /* a power of 2 */
+static size_t children_used;    /* entries which are not CHILD_FREE */
+static unsigned long children_serial;
+static int autoreap = 1;
+static char children_busy;
+
+static void children_lock(void)
+{
+  while (__atomic_test_and_set(&children_busy, __ATOMIC_ACQUIRE))
+    ;
+}
+
+static void children_unlock(void)
+{
+  __atomic_clear(&children_busy, __ATOMIC_RELEASE);
+}
+
+static void reaper_lock(sigset_t *old)
+{
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &set, old);
+  children_lock();
+}
+
+static void reaper_unlock(const sigset_t *old)
+{
+  children_unlock();
+  pthread_sigmask(SIG_SETMASK, old, 0);
+}
+
+/* the running child with the given pid; there is at most one */
+static struct child *child_running(pid_t pid)
+{
+  size_t i, mask = children_size - 1;
+  if (!children)
+    return 0;
+  for (i = pid & mask; children[i].state != CHILD_FREE; i = (i + 1) & mask)
+    if (children[i].pid == pid && (children[i].state == CHILD_RUNNING
+                                   || children[i].state == CHILD_DETACHED))
+      return &children[i];
+  return 0;
+}
+
+static struct child *child_lookup(struct process *p)
+{
+  size_t i, mask = children_size - 1;
+  if (!children || !p->serial)
+    return 0;
+  for (i = p->pid & mask; children[i].state != CHILD_FREE; i = (i + 1) & mask)
+    if (children[i].serial == p->serial && children[i].state != CHILD_DELETED)
+      return &children[i];
+  return 0;
+}
+
+/* Called from the signal handler: reaps the child if it has terminated,
+ * returning 1 if it did. */
+static int child_reap(struct child *c)
+{
+  struct rusage usage;
+  int status;
+  pid_t pid;
+  if (c->state != CHILD_RUNNING && c->state != CHILD_DETACHED)
+    return 0;
+  do pid = wait4(c->pid, &status, WNOHANG, &usage);
+  while (pid == -1 && errno == EINTR);
+  if (pid <= 0)
+    return 0;
+  if (c->state == CHILD_DETACHED)
+    c->state = CHILD_DELETED;
+  else {
+    c->wstatus = status;
+    c->usage = usage;
+    c->state = CHILD_DONE;
+  }
+  return 1;
+}
+
+/* Called from the signal handler.  Signals coalesce, so after the child
+ * which raised it, the terminated children are peeked at one by one; a
+ * terminated child which is not ours hides the rest, which are then all
+ * checked. */
+static void reaper_sweep(pid_t pid)
+{
+  struct child *c;
+  siginfo_t info;
+  size_t i;
+  children_lock();
+  if (!children)
+    goto done;
+  if (pid > 0 && (c = child_running(pid)))
+    child_reap(c);
+  for (;;) {
+    info.si_pid = 0;
+    if (-1 == waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT)
+        || info.si_pid == 0)
+      goto done;
+    if (!(c = child_running(info.si_pid)) || !child_reap(c))
+      break;
+  }
+  for (i = 0; i < children_size; i++)
+    child_reap(&children[i]);
+done:
+  children_unlock();
+}
+
+static void child_insert(struct child *table, size_t size, struct child *c)
+{
+  size_t i, mask = size - 1;
+  for (i = c->pid & mask; table[i].state != CHILD_FREE; i = (i + 1) & mask)
+    ;
+  table[i] = *c;
+}
+
+/* Enters a new child in the table, returning its serial, or 0 if there is
+ * no memory, when the child is not reaped automatically. */
+static unsigned long child_add(pid_t pid)
+{
+  struct child c, *prev = 0;
+  sigset_t old;
+  reaper_lock(&old);
+  if (2 * (children_used + 1) > children_size) {
+    /* rebuild, dropping deleted entries, at no more than 1/4 full */
+    struct child *table;
+    size_t i, live = 0, size = 64;
+    for (i = 0; i < children_size; i++)
+      if (children[i].state != CHILD_FREE && children[i].state != CHILD_DELETED)
+        live++;
+    while (size < 4 * (live + 1))
+      size *= 2;
+    if (!(table = calloc(size, sizeof *table))) {
+      reaper_unlock(&old);
+      return 0;
+    }
+    prev = children;
+    for (i = 0; i < children_size; i++)
+      if (prev[i].state != CHILD_FREE && prev[i].state != CHILD_DELETED)
+        child_insert(table, size, &prev[i]);
+    children = table;
+    children_size = size;
+    children_used = live;
+  }
+  c.pid = pid;
+  c.serial = ++children_serial;
+  c.state = CHILD_RUNNING;
+  child_insert(children, children_size, &c);
+  children_used++;
+  reaper_unlock(&old);
+  free(prev);
+  return c.serial;
+}
+
+/* Gives up the child of a proc being collected.  If it is still running, it
+ * is reaped by the handler when it terminates (unless autoreap is off). */
+static void process_detach(struct process *p)
+{
+  struct child *c;
+  sigset_t old;
+  int status;
+  reaper_lock(&old);
+  c = child_lookup(p);
+  if (!autoreap || (c && c->state == CHILD_DONE)
+      || 0 < waitpid(p->pid, &status, WNOHANG)) {
+    if (c)
+      c->state = CHILD_DELETED;
+  }
+  else if (c)
+    c->state = CHILD_DETACHED;
+  reaper_unlock(&old);
+}
+
+/* Returns whether the process has been reaped, when its pid may already
+ * belong to another process.  Call with the reaper locked. */
+static int process_done(struct process *p)
+{
+  struct child *c;
+  return p->status != -1 || ((c = child_lookup(p)) && c->state == CHILD_DONE);
+}
+
+/* [enable] -- enabled
+ * Whether children whose procs are collected are reaped automatically. */
+int process_autoreap(lua_State *L)
+{
+  int prev = autoreap;
+  if (!lua_isnoneornil(L, 1))
+    autoreap = lua_toboolean(L, 1);
+  lua_pushboolean(L, prev);
+  return 1;
+}
+
+/* -- seconds on the monotonic clock */
+double monotime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the number of milliseconds until deadline (in seconds on the
+ * monotonic clock), or -1 for no deadline. */
+int remaining_ms(double deadline)
+{
+  double left;
+  if (deadline < 0) return -1;
+  left = deadline - monotime();
+  return left <= 0 ? 0 : (int)(left * 1000 + 0.999);
+}
+
+static void process_closefd(struct process *p)
+{
+  if (p->pidfd != -1) {
+    close(p->pidfd);
+    p->pidfd = -1;
+  }
+}
+
+/* Returns 1 if the process has terminated, 0 if it is still running and -1
+ * on error.  Without WNOHANG in options, waits for it to terminate with
+ * the reaper unlocked, then reaps it under the lock. */
+static int process_reap(struct process *p, int options)
+{
+  struct child *c;
+  siginfo_t info;
+  sigset_t old;
+  int status;
+  pid_t pid;
+  if (p->status != -1)
+    return 1;
+  for (;;) {
+    reaper_lock(&old);
+    if ((c = child_lookup(p)) && c->state == CHILD_DONE) {
+      pid = p->pid;
+      status = c->wstatus;
+      p->usage = c->usage;
+    }
+    else {
+      do pid = wait4(p->pid, &status, WNOHANG, &p->usage);
+      while (pid == -1 && errno == EINTR);
+    }
+    if (pid > 0 && c)
+      c->state = CHILD_DELETED;
+    reaper_unlock(&old);
+    if (pid != 0 || (options & WNOHANG))
+      break;
+    /* if the handler reaps it first, this fails and the table has it */
+    while (-1 == waitid(P_PID, p->pid, &info, WEXITED | WNOWAIT)
+           && errno == EINTR)
+      ;
+  }
+  if (pid == -1) return -1;
+  if (pid == 0) return 0;
+  p->wstatus = status;
+  p->status = WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                  : WEXITSTATUS(status);
+  process_closefd(p);
+  process_releasetoken(p);
+  return 1;
+}
+
+static lua_Number timeval_seconds(const struct timeval *tv)
+{
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* -- exitcode status */
+int process_pushstatus(lua_State *L, struct process *p)
+{
+  lua_pushnumber(L, p->status);
+  lua_createtable(L, 0, 12);
+  lua_pushnumber(L, p->pid);
+  lua_setfield(L, -2, "pid");
+  if (WIFSIGNALED(p->wstatus)) {
+    lua_pushnumber(L, WTERMSIG(p->wstatus));
+    lua_setfield(L, -2, "signal");
+#ifdef WCOREDUMP
+    lua_pushboolean(L, WCOREDUMP(p->wstatus));
+#else
+    lua_pushboolean(L, 0);
+#endif
+    lua_setfield(L, -2, "coredump");
+  }
+  else {
+    lua_pushnumber(L, WEXITSTATUS(p->wstatus));
+    lua_setfield(L, -2, "exitcode");
+  }
+  lua_pushnumber(L, timeval_seconds(&p->usage.ru_utime));
+  lua_setfield(L, -2, "utime");
+  lua_pushnumber(L, timeval_seconds(&p->usage.ru_stime));
+  lua_setfield(L, -2, "stime");
+#ifdef __APPLE__
+  lua_pushnumber(L, p->usage.ru_maxrss);
+#else
+  lua_pushnumber(L, p->usage.ru_maxrss * 1024.0);
+#endif
+  lua_setfield(L, -2, "maxrss");
+  lua_pushnumber(L, p->usage.ru_minflt);
+  lua_setfield(L, -2, "minflt");
+  lua_pushnumber(L, p->usage.ru_majflt);
+  lua_setfield(L, -2, "majflt");
+  lua_pushnumber(L, p->usage.ru_nvcsw);
+  lua_setfield(L, -2, "nvcsw");
+  lua_pushnumber(L, p->usage.ru_nivcsw);
+  lua_setfield(L, -2, "nivcsw");
+  return 2;
 }
 
-/* proc -- exitcode/nil error */
+static double opt_deadline(lua_State *L, int idx)
+{
+  lua_Number timeout;
+  if (lua_isnoneornil(L, idx))
+    return -1;
+  timeout = luaL_checknumber(L, idx);
+  return monotime() + (timeout > 0 ? timeout : 0);
+}
+
+static int push_timeout(lua_State *L)
+{
+  lua_pushnil(L);
+  lua_pushliteral(L, "timeout");
+  return 2;
+}
+
+/* Waits for any of the processes to terminate, returning its index or -1 on
+ * timeout (deadline is in seconds on the monotonic clock, or negative for
+ * none).  Returns -2 on error with errno set.  After the first pass, only
+ * processes whose pidfd became readable are reaped, plus those without a
+ * pidfd when SIGCHLD arrives. */
+int process_waitfor(lua_State *L, struct process **procs, int n,
+                    double deadline)
+{
+  struct pollfd *fds;
+  int *which;
+  int i, j, nfds = 0, ret, sigfd = -1;
+  int full = 1, sigchld = 0, timedout = 0;
+  fds = lua_newuserdata(L, (n + 1) * (sizeof *fds + sizeof *which));
+  which = (int *)(fds + n + 1);
+  for (i = 0; i < n; i++) {
+    if (procs[i]->status != -1)
+      ;
+    else if (procs[i]->pidfd != -1) {
+      fds[nfds].fd = procs[i]->pidfd;
+      fds[nfds].events = POLLIN;
+      which[nfds++] = i;
+    }
+    else if (sigfd == -1) {
+      if (-1 == (sigfd = sigchld_init()))
+        goto error;
+      fds[nfds].fd = sigfd;
+      fds[nfds].events = POLLIN;
+      which[nfds++] = -1;
+    }
+  }
+  for (;;) {
+    if (full || sigchld) {
+      for (i = 0; i < n; i++) {
+        if (!full && procs[i]->pidfd != -1)
+          continue;
+        ret = process_reap(procs[i], WNOHANG);
+        if (ret == -1) goto error;
+        if (ret == 1) goto done;
+      }
+    }
+    if (timedout)
+      break;
+    ret = poll(fds, nfds, remaining_ms(deadline));
+    if (ret == -1 && errno != EINTR)
+      goto error;
+    if (sigfd != -1)
+      sigchld_drain();
+    full = ret <= 0;
+    sigchld = 0;
+    timedout = ret == 0 && remaining_ms(deadline) == 0;
+    for (j = 0; ret > 0 && j < nfds; j++) {
+      if (!fds[j].revents)
+        continue;
+      if ((i = which[j]) == -1) {
+        sigchld = 1;
+        continue;
+      }
+      ret = process_reap(procs[i], WNOHANG);
+      if (ret == -1) goto error;
+      if (ret == 1) goto done;
+      ret = 1;
+    }
+  }
+  lua_pop(L, 1);
+  return -1;
+done:
+  lua_pop(L, 1);
+  return i;
+error:
+  lua_pop(L, 1);
+  return -2;
+}
+
+/* Writes without letting a closed pipe raise SIGPIPE in the caller. */
+static ssize_t write_nosigpipe(int fd, const void *buf, size_t len)
+{
+  sigset_t pipeset, pending, old;
+  ssize_t ret;
+  int blocked, saved;
+  sigemptyset(&pipeset);
+  sigaddset(&pipeset, SIGPIPE);
+  sigpending(&pending);
+  blocked = sigismember(&pending, SIGPIPE);
+  sigprocmask(SIG_BLOCK, &pipeset, &old);
+  ret = write(fd, buf, len);
+  if (ret == -1 && errno == EPIPE && !blocked) {
+    struct timespec zero = { 0, 0 };
+    saved = errno;
+    sigtimedwait(&pipeset, 0, &zero);
+    errno = saved;
+  }
+  sigprocmask(SIG_SETMASK, &old, 0);
+  return ret;
+}
+
+/* Moves data through the captured pipes until every one is closed.
+ * Returns 1 when done, 0 on timeout and -1 on error. */
+static int process_pump(struct process *p, double deadline)
+{
+  struct pollfd fds[3];
+  int which[3];
+  int i, j, nfds, ret;
+  for (;;) {
+    struct stream *in = &p->io[STDIN_FILENO];
+    if (in->fd != -1 && in->pos == in->len)
+      stream_close(in);
+    for (nfds = 0, i = 0; i < 3; i++) {
+      if (p->io[i].fd == -1 || p->io[i].kind != CAPTURE_PIPE)
+        continue;
+      fds[nfds].fd = p->io[i].fd;
+      fds[nfds].events = i == STDIN_FILENO ? POLLOUT : POLLIN;
+      which[nfds++] = i;
+    }
+    if (nfds == 0)
+      return 1;
+    ret = poll(fds, nfds, remaining_ms(deadline));
+    if (ret == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (ret == 0 && remaining_ms(deadline) == 0)
+      return 0;
+    for (j = 0; j < nfds; j++) {
+      struct stream *s = &p->io[which[j]];
+      ssize_t n;
+      if (!fds[j].revents)
+        continue;
+      if (which[j] == STDIN_FILENO) {
+        n = write_nosigpipe(s->fd, s->buf + s->pos, s->len - s->pos);
+        if (n > 0)
+          s->pos += n;
+        else if (n == -1 && errno == EPIPE) {
+          /* the child does not want the rest */
+          s->pos = s->len;
+          stream_close(s);
+        }
+      }
+      else {
+        if (-1 == stream_reserve(s, 65536))
+          return -1;
+        n = read(s->fd, s->buf + s->len, s->size - s->len);
+        if (n > 0)
+          s->len += n;
+        else if (n == 0)
+          stream_close(s);
+      }
+      if (n == -1 && errno != EAGAIN && errno != EINTR && errno != EPIPE)
+        return -1;
+    }
+  }
+}
+
+static int process_pending(struct process *p)
+{
+  int i;
+  for (i = 0; i < 3; i++)
+    if (p->io[i].fd != -1 && p->io[i].kind == CAPTURE_PIPE)
+      return 1;
+  return 0;
+}
+
+/* proc -- exitcode status/nil error
+ * proc timeout -- exitcode status/nil "timeout"
+ * Captured pipes are drained into their buffers first, so that waiting
+ * cannot deadlock on a child blocked writing to a full pipe. */
 int process_wait(lua_State *L)
 {
   struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
-  if (p->status == -1) {
-    int status;
-    if (-1 == waitpid(p->pid, &status, 0))
+  double deadline = opt_deadline(L, 2);
+  if (process_pending(p)) {
+    switch (process_pump(p, deadline)) {
+    case -1: return push_error(L);
+    case 0: return push_timeout(L);
+    }
+  }
+  if (deadline < 0) {
+    if (-1 == process_reap(p, 0))
       return push_error(L);
-    p->status = WEXITSTATUS(status);
   }
-  lua_pushnumber(L, p->status);
+  else {
+    switch (process_waitfor(L, &p, 1, deadline)) {
+    case -2: return push_error(L);
+    case -1: return push_timeout(L);
+    }
+  }
+  return process_pushstatus(L, p);
+}
+
+/* -- output/nil */
+static int push_stream(lua_State *L, struct stream *s)
+{
+  if (s->kind == CAPTURE_FILE && s->fd != -1) {
+    struct stat st;
+    void *data;
+    if (-1 == fstat(s->fd, &st))
+      return -1;
+    if (st.st_size == 0)
+      lua_pushliteral(L, "");
+    else {
+      data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, s->fd, 0);
+      if (data == MAP_FAILED)
+        return -1;
+      lua_pushlstring(L, data, st.st_size);
+      munmap(data, st.st_size);
+    }
+  }
+  else if (s->kind)
+    lua_pushlstring(L, s->buf ? s->buf : "", s->len);
+  else
+    lua_pushnil(L);
+  stream_free(s);
+  return 0;
+}
+
+/* proc [input [timeout]] -- stdout stderr exitcode status/nil error */
+int process_communicate(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  double deadline = opt_deadline(L, 3);
+  if (!lua_isnoneornil(L, 2)) {
+    size_t len;
+    const char *input = luaL_checklstring(L, 2, &len);
+    if (p->io[STDIN_FILENO].fd == -1)
+      return luaL_error(L, "process stdin is not a pipe");
+    if (-1 == stream_append(&p->io[STDIN_FILENO], input, len))
+      return push_error(L);
+  }
+  switch (process_pump(p, deadline)) {
+  case -1: return push_error(L);
+  case 0: return push_timeout(L);
+  }
+  if (deadline < 0) {
+    if (-1 == process_reap(p, 0))
+      return push_error(L);
+  }
+  else {
+    switch (process_waitfor(L, &p, 1, deadline)) {
+    case -2: return push_error(L);
+    case -1: return push_timeout(L);
+    }
+  }
+  lua_settop(L, 1);
+  if (-1 == push_stream(L, &p->io[STDOUT_FILENO])
+      || -1 == push_stream(L, &p->io[STDERR_FILENO]))
+    return push_error(L);
+  stream_free(&p->io[STDIN_FILENO]);
+  return 2 + process_pushstatus(L, p);
+}
+
+/* proc -- exitcode status/false/nil error */
+int process_poll(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  switch (process_reap(p, WNOHANG)) {
+  case -1: return push_error(L);
+  case 0: lua_pushboolean(L, 0); break;
+  case 1: return process_pushstatus(L, p);
+  }
+  return 1;
+}
+
+/* procs [timeout] -- proc exitcode status/nil error */
+int process_waitany(lua_State *L)
+{
+  struct process **procs;
+  double deadline = opt_deadline(L, 2);
+  int i, n;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = lua_objlen(L, 1);
+  if (n == 0)
+    return luaL_argerror(L, 1, "no processes to wait for");
+  procs = lua_newuserdata(L, n * sizeof *procs);
+  luaL_getmetatable(L, PROCESS_HANDLE);         /* procs ... vec P */
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i + 1);                   /* procs ... vec P proc */
+    procs[i] = lua_touserdata(L, -1);
+    if (!procs[i] || !lua_getmetatable(L, -1) || !lua_rawequal(L, -1, -3))
+      return luaL_error(L, "bad process at index %d (%s expected, got %s)",
+                        i + 1, PROCESS_HANDLE, luaL_typename(L, -1));
+    lua_pop(L, 2);                              /* procs ... vec P */
+  }
+  switch (i = process_waitfor(L, procs, n, deadline)) {
+  case -2: return push_error(L);
+  case -1: return push_timeout(L);
+  }
+  lua_rawgeti(L, 1, i + 1);
+  return 1 + process_pushstatus(L, procs[i]);
+}
+
+static const struct { const char *name; int sig; } signals[] = {
+  {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+  {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+  {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+  {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU},
+  {0, 0}
+};
+
+/* Accepts a signal number or a name such as "TERM" or "SIGTERM". */
+int check_signal(lua_State *L, int idx, int def)
+{
+  const char *name;
+  int i;
+  if (lua_isnoneornil(L, idx))
+    return def;
+  if (lua_type(L, idx) == LUA_TNUMBER)
+    return lua_tonumber(L, idx);
+  name = luaL_checkstring(L, idx);
+  if (0 == strncmp(name, "SIG", 3))
+    name += 3;
+  for (i = 0; signals[i].name; i++)
+    if (0 == strcmp(name, signals[i].name))
+      return signals[i].sig;
+  return luaL_argerror(L, idx, "unknown signal name");
+}
+
+/* proc [signal [group]] -- proc/nil error */
+int process_kill(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  int sig = check_signal(L, 2, SIGTERM);
+  int ret;
+  if (lua_toboolean(L, 3)) {
+    if (p->pgid == -1)
+      return luaL_error(L, "process was not spawned in its own process group");
+    ret = killpg(p->pgid, sig);
+  }
+  else {
+    sigset_t old;
+    reaper_lock(&old);
+    if (process_done(p)) {
+      /* the pid may already belong to another process */
+      errno = ESRCH;
+      ret = -1;
+    }
+#ifdef SYS_pidfd_send_signal
+    else if (p->pidfd != -1)
+      ret = syscall(SYS_pidfd_send_signal, p->pidfd, sig, NULL, 0);
+#endif
+    else
+      ret = kill(p->pid, sig);
+    reaper_unlock(&old);
+  }
+  if (ret == -1)
+    return push_error(L);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* proc [stdname [opts]] -- iter state
+ * The iterator takes over the pipe, along with anything already drained
+ * into the buffer. */
+int process_lines(lua_State *L)
+{
+  static const char *const names[] = { "stdout", "stderr", 0 };
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  int i = luaL_checkoption(L, 2, "stdout", names);
+  struct stream *s = &p->io[i + 1];
+  int fd = s->fd;
+  if (s->kind != CAPTURE_PIPE)
+    return luaL_error(L, "process %s is not captured to a pipe", names[i]);
+  s->fd = -1;
+  lines_push(L, fd, 1, s->buf, s->len, 3);
+  s->len = 0;
+  return 2;
+}
+
+/* proc -- */
+int process_gc(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  int i;
+  if (p->status == -1 && p->pid > 0)
+    process_detach(p);
+  process_closefd(p);
+  process_releasetoken(p);
+  for (i = 0; i < 3; i++)
+    stream_free(&p->io[i]);
+  return 0;
+}
+
+/* Returns a new descriptor which becomes readable when the process at idx
+ * terminates, -2 if it has already been reaped, or -1 with errno set. */
+int process_waitfd(lua_State *L, int idx)
+{
+  struct process *p = luaL_checkudata(L, idx, PROCESS_HANDLE);
+  int fd;
+  if (p->status != -1)
+    return -2;
+  if (p->pidfd == -1) {
+    errno = ENOSYS;
+    return -1;
+  }
+  if (-1 != (fd = dup(p->pidfd)))
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+/* Returns the pid of the process at idx, or 0 once it has been reaped, when
+ * the pid may already belong to another process. */
+pid_t process_pid(lua_State *L, int idx)
+{
+  struct process *p = luaL_checkudata(L, idx, PROCESS_HANDLE);
+  return process_done(p) ? 0 : p->pid;
+}
+
+/* proc -- stats/nil error */
+int process_stats(lua_State *L)
+{
+  pid_t pid = process_pid(L, 1);
+  if (!pid)
+    errno = ESRCH;
+  if (!pid || !procstats_push(L, pid))
+    return push_error(L);
   return 1;
 }
 
@@ -7,20 +7,59 @@
 #define SPAWN_H
 
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/resource.h>
 #include "lua.h"
 
 #define PROCESS_HANDLE "process"
+#define CAPTURE_PIPE 1
+#define CAPTURE_FILE 2
 struct process;
 struct spawn_params;
+struct jobserver;
 
 struct spawn_params *spawn_param_init(lua_State *L);
 void spawn_param_filename(struct spawn_params *p, const char *filename);
+void spawn_param_path(struct spawn_params *p, const char *pathname);
 void spawn_param_args(struct spawn_params *p);
 void spawn_param_env(struct spawn_params *p);
 void spawn_param_redirect(struct spawn_params *p, const char *stdname, int fd);
+void spawn_param_pgroup(struct spawn_params *p, pid_t pgid);
+void spawn_param_jobserver(struct spawn_params *p, struct jobserver *js);
+void spawn_param_setsid(struct spawn_params *p);
+int spawn_param_cpu(struct spawn_params *p, int cpu);
+void spawn_param_nice(struct spawn_params *p, int nice);
+int spawn_param_ioprio(struct spawn_params *p, int class, int level);
+void spawn_param_umask(struct spawn_params *p, mode_t mask);
+int spawn_param_rlimit(struct spawn_params *p, int resource,
+                       rlim_t soft, rlim_t hard);
+void spawn_param_capture(struct spawn_params *p, const char *stdname, int kind);
+void spawn_param_input(struct spawn_params *p, const char *data, size_t len);
+int spawn_param_prepare(struct spawn_params *p);
+int spawn_param_launch(struct spawn_params *p);
+int spawn_param_finish(struct spawn_params *p, int err);
 int spawn_param_execute(struct spawn_params *p);
 
 int process_wait(lua_State *L);
+int process_poll(lua_State *L);
+int process_waitany(lua_State *L);
+int process_kill(lua_State *L);
+int process_communicate(lua_State *L);
+int process_lines(lua_State *L);
+int process_stats(lua_State *L);
+int process_gc(lua_State *L);
+int process_autoreap(lua_State *L);
+
+int check_signal(lua_State *L, int idx, int def);
+int process_waitfor(lua_State *L, struct process **procs, int n,
+                    double deadline);
+int process_pushstatus(lua_State *L, struct process *p);
+pid_t process_pid(lua_State *L, int idx);
+int process_waitfd(lua_State *L, int idx);
+void process_settoken(struct process *p, struct jobserver *js, int token);
+
+double monotime(void);
+int remaining_ms(double deadline);
 int process_tostring(lua_State *L);
 
 #endif/*SPAWN_H*/
@@ -0,0 +1,574 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "statcache.h"
+
+/* The cache maps absolute pathnames, exactly as given, to stat results;
+ * relative ones name another file after a chdir, so they are not cached.
+ * It is split into shards, each a chained hash with its own lock and a FIFO
+ * of its entries for eviction, so that lookups from worker threads seldom
+ * contend.  An entry is valid while its generation is the cache's; bumping
+ * the generation drops everything at once.  On Linux a thread also reads
+ * inotify events for the directories of cached paths and drops the entries
+ * they name (and the directory's own entry, whose times change with its
+ * contents); a directory which is moved or deleted, itself or by name in a
+ * watched parent, drops every entry below it.  A drop also counts in its
+ * shard's sequence, so that a result stat()ed before the drop is not
+ * inserted after it.  Only the directories holding cached paths are
+ * watched: a rename of an ancestor further up, or a change to the target
+ * of a symbolic link on the way, is not seen until the generation moves. */
+
+#define SHARDS 16
+#define STATCACHE_ENTRIES 4096
+
+struct entry {
+  struct entry *next;           /* in the bucket */
+  struct entry *newer;          /* in the shard's FIFO */
+  struct entry **pprev;         /* the link to this entry in its bucket */
+  struct entry **pfifo;         /* the link to this entry in the FIFO */
+  unsigned long hash;
+  unsigned gen;
+  struct stat st;
+  char path[1];
+};
+
+struct shard {
+  pthread_mutex_t lock;
+  struct entry **buckets;
+  unsigned mask;
+  int count;
+  struct entry *oldest, **newest;
+  unsigned long seq;            /* drops, whether or not an entry was found */
+  unsigned long hits, misses, evictions, invalidations;
+};
+
+static struct shard shards[SHARDS];
+static int capacity;            /* entries per shard; 0 when disabled */
+static volatile unsigned generation;
+static pthread_mutex_t config = PTHREAD_MUTEX_INITIALIZER;
+static int states;              /* Lua states which opened the module */
+
+extern int push_error(lua_State *L);
+
+static unsigned long hash_path(const char *s, size_t len)
+{
+  unsigned long h = 5381;
+  while (len--)
+    h = (h * 33) ^ (unsigned char)*s++;
+  return h;
+}
+
+static struct shard *shard_of(unsigned long hash)
+{
+  return &shards[(hash >> 8) % SHARDS];
+}
+
+/* Unlinks and frees e.  Called with the shard locked. */
+static void entry_drop(struct shard *sh, struct entry *e)
+{
+  if ((*e->pprev = e->next))
+    e->next->pprev = e->pprev;
+  if ((*e->pfifo = e->newer))
+    e->newer->pfifo = e->pfifo;
+  else
+    sh->newest = e->pfifo;
+  sh->count--;
+  free(e);
+}
+
+static struct entry *entry_find(struct shard *sh, const char *path,
+                                size_t len, unsigned long hash)
+{
+  struct entry *e = sh->buckets[hash & sh->mask];
+  for (; e; e = e->next)
+    if (e->hash == hash && 0 == memcmp(e->path, path, len + 1))
+      return e;
+  return 0;
+}
+
+#ifdef __linux__
+
+/* Drops the entry for path, if any. */
+static void statcache_drop(const char *path, size_t len)
+{
+  unsigned long hash = hash_path(path, len);
+  struct shard *sh = shard_of(hash);
+  struct entry *e;
+  pthread_mutex_lock(&sh->lock);
+  sh->seq++;
+  if (sh->buckets && (e = entry_find(sh, path, len, hash))) {
+    entry_drop(sh, e);
+    sh->invalidations++;
+  }
+  pthread_mutex_unlock(&sh->lock);
+}
+
+/* Drops the entries for every path which starts with prefix. */
+static void statcache_drop_under(const char *prefix, size_t len)
+{
+  int i;
+  for (i = 0; i < SHARDS; i++) {
+    struct shard *sh = &shards[i];
+    struct entry *e, *next;
+    pthread_mutex_lock(&sh->lock);
+    sh->seq++;
+    for (e = sh->oldest; e; e = next) {
+      next = e->newer;
+      if (0 == strncmp(e->path, prefix, len)) {
+        entry_drop(sh, e);
+        sh->invalidations++;
+      }
+    }
+    pthread_mutex_unlock(&sh->lock);
+  }
+}
+
+/* Watched directories, indexed by watch descriptor.  The kernel returns
+ * one descriptor for every spelling of a directory, so each keeps the
+ * prefixes through which cached paths reached it. */
+struct watched {
+  char **prefixes;
+  int count;
+};
+
+static int ino_fd = -1;
+static int ino_stop[2] = { -1, -1 };
+static pthread_t ino_thread;
+static pthread_mutex_t ino_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct watched *watched;
+static int nwatched;
+
+#define INO_EVENTS (IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE \
+                    | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                    | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* Drops the entry for prefix name or, without a name, that of the
+ * directory itself.  A prefix is a cached path up to its last slash.  With
+ * under set, drops those below the directory too. */
+static void drop_named(const char *prefix, const char *name, int under)
+{
+  char buf[4096];
+  size_t plen = strlen(prefix), nlen;
+  if (!name) {
+    if (plen == 1)
+      statcache_drop(prefix, plen);
+    else
+      statcache_drop(prefix, plen - 1);
+    if (under)
+      statcache_drop_under(prefix, plen);
+    return;
+  }
+  nlen = strlen(name);
+  if (plen + nlen + 1 >= sizeof buf)
+    return;
+  memcpy(buf, prefix, plen);
+  memcpy(buf + plen, name, nlen + 1);
+  statcache_drop(buf, plen + nlen);
+  if (under) {
+    memcpy(buf + plen + nlen, "/", 2);
+    statcache_drop_under(buf, plen + nlen + 1);
+  }
+}
+
+static void *ino_main(void *arg)
+{
+  static char buf[65536]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct pollfd pfd[2];
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, 0);
+  pfd[0].fd = ino_fd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = ino_stop[0];
+  pfd[1].events = POLLIN;
+  for (;;) {
+    ssize_t n;
+    char *p;
+    if (-1 == poll(pfd, 2, -1) && errno != EINTR)
+      break;
+    if (pfd[1].revents)
+      break;
+    if ((n = read(ino_fd, buf, sizeof buf)) <= 0)
+      continue;
+    for (p = buf; p < buf + n;
+         p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      int i;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        __sync_add_and_fetch(&generation, 1);
+        continue;
+      }
+      pthread_mutex_lock(&ino_lock);
+      if (ev->wd >= 0 && ev->wd < nwatched) {
+        struct watched *w = &watched[ev->wd];
+        for (i = 0; i < w->count; i++) {
+          if (ev->len > 0)
+            drop_named(w->prefixes[i], ev->name,
+                       (ev->mask & IN_ISDIR)
+                       && (ev->mask & (IN_DELETE | IN_MOVED_FROM)));
+          if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                          | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+            drop_named(w->prefixes[i], 0,
+                       ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED));
+        }
+        if (ev->mask & IN_IGNORED) {
+          for (i = 0; i < w->count; i++)
+            free(w->prefixes[i]);
+          free(w->prefixes);
+          w->prefixes = 0;
+          w->count = 0;
+        }
+      }
+      pthread_mutex_unlock(&ino_lock);
+    }
+  }
+  return arg;
+}
+
+/* Watches the directory of a cached path.  Failures only mean that the
+ * entry relies on the generation. */
+static void ino_watch(const char *path)
+{
+  size_t plen = strrchr(path, '/') - path + 1;
+  char dir[4096];
+  int wd, i;
+  if (ino_fd == -1 || plen >= sizeof dir)
+    return;
+  memcpy(dir, path, plen);
+  dir[plen > 1 ? plen - 1 : plen] = '\0';
+  if (-1 == (wd = inotify_add_watch(ino_fd, dir, INO_EVENTS)))
+    return;
+  memcpy(dir, path, plen);
+  dir[plen] = '\0';
+  pthread_mutex_lock(&ino_lock);
+  if (wd >= nwatched) {
+    int n = wd + 64;
+    struct watched *w = realloc(watched, n * sizeof *w);
+    if (!w)
+      goto done;
+    memset(w + nwatched, 0, (n - nwatched) * sizeof *w);
+    watched = w;
+    nwatched = n;
+  }
+  for (i = 0; i < watched[wd].count; i++)
+    if (0 == strcmp(watched[wd].prefixes[i], dir))
+      goto done;
+  {
+    char **p = realloc(watched[wd].prefixes,
+                       (watched[wd].count + 1) * sizeof *p);
+    if (!p)
+      goto done;
+    watched[wd].prefixes = p;
+    if ((p[watched[wd].count] = strdup(dir)))
+      watched[wd].count++;
+  }
+done:
+  pthread_mutex_unlock(&ino_lock);
+}
+
+static int ino_start(void)
+{
+  int i, err;
+  if (-1 == (ino_fd = inotify_init1(IN_CLOEXEC)))
+    return -1;
+  if (-1 == pipe(ino_stop)) {
+    err = errno;
+    close(ino_fd);
+    ino_fd = -1;
+    errno = err;
+    return -1;
+  }
+  for (i = 0; i < 2; i++)
+    fcntl(ino_stop[i], F_SETFD, FD_CLOEXEC);
+  if ((err = pthread_create(&ino_thread, 0, ino_main, 0))) {
+    close(ino_fd);
+    close(ino_stop[0]);
+    close(ino_stop[1]);
+    ino_fd = ino_stop[0] = ino_stop[1] = -1;
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+static void ino_stop_thread(void)
+{
+  int i, j;
+  if (ino_fd == -1)
+    return;
+  close(ino_stop[1]);
+  pthread_join(ino_thread, 0);
+  close(ino_stop[0]);
+  close(ino_fd);
+  ino_fd = ino_stop[0] = ino_stop[1] = -1;
+  for (i = 0; i < nwatched; i++) {
+    for (j = 0; j < watched[i].count; j++)
+      free(watched[i].prefixes[j]);
+    free(watched[i].prefixes);
+  }
+  free(watched);
+  watched = 0;
+  nwatched = 0;
+}
+
+#else
+
+#define ino_watch(path) ((void)0)
+#define ino_start() (errno = ENOSYS, -1)
+#define ino_stop_thread() ((void)0)
+
+#endif
+
+
+/* Looks an absolute path up in the cache, or stats it and caches the
+ * result.  Returns 0, or -1 with errno set. */
+int statcache_stat(const char *path, struct stat *st)
+{
+  size_t len;
+  unsigned long hash;
+  struct shard *sh;
+  struct entry *e;
+  unsigned gen;
+  unsigned long seq;
+  if (!capacity || *path != '/')
+    return stat(path, st);
+  len = strlen(path);
+  hash = hash_path(path, len);
+  sh = shard_of(hash);
+  gen = generation;
+  pthread_mutex_lock(&sh->lock);
+  if (!sh->buckets) {
+    /* disabled since capacity was read */
+    pthread_mutex_unlock(&sh->lock);
+    return stat(path, st);
+  }
+  if ((e = entry_find(sh, path, len, hash))) {
+    if (e->gen == gen) {
+      *st = e->st;
+      sh->hits++;
+      pthread_mutex_unlock(&sh->lock);
+      return 0;
+    }
+    entry_drop(sh, e);
+  }
+  sh->misses++;
+  seq = sh->seq;
+  pthread_mutex_unlock(&sh->lock);
+  /* watch before the stat, so that no change can fall between them */
+  ino_watch(path);
+  if (-1 == stat(path, st))
+    return -1;
+  if (!(e = malloc(sizeof *e + len)))
+    return 0;
+  e->hash = hash;
+  e->gen = gen;
+  e->st = *st;
+  memcpy(e->path, path, len + 1);
+  pthread_mutex_lock(&sh->lock);
+  /* a drop since the miss may be for a change which this stat missed */
+  if (!sh->buckets || sh->seq != seq || entry_find(sh, path, len, hash)) {
+    pthread_mutex_unlock(&sh->lock);
+    free(e);
+    return 0;
+  }
+  if (sh->count >= capacity) {
+    entry_drop(sh, sh->oldest);
+    sh->evictions++;
+  }
+  e->pprev = &sh->buckets[hash & sh->mask];
+  if ((e->next = *e->pprev))
+    e->next->pprev = &e->next;
+  *e->pprev = e;
+  e->newer = 0;
+  e->pfifo = sh->newest;
+  *sh->newest = e;
+  sh->newest = &e->newer;
+  sh->count++;
+  pthread_mutex_unlock(&sh->lock);
+  return 0;
+}
+
+static void statcache_clear(void)
+{
+  int i;
+  for (i = 0; i < SHARDS; i++) {
+    struct shard *sh = &shards[i];
+    pthread_mutex_lock(&sh->lock);
+    while (sh->oldest)
+      entry_drop(sh, sh->oldest);
+    free(sh->buckets);
+    sh->buckets = 0;
+    pthread_mutex_unlock(&sh->lock);
+  }
+}
+
+/* [options] -- true/nil error */
+static int statcache_enable(lua_State *L)
+{
+  int entries = STATCACHE_ENTRIES, inotify = 1, i;
+  unsigned buckets;
+  if (!lua_isnoneornil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "entries");
+    if (!lua_isnil(L, -1))
+      entries = luaL_checknumber(L, -1);
+    lua_getfield(L, 1, "inotify");
+    if (!lua_isnil(L, -1))
+      inotify = lua_toboolean(L, -1);
+    lua_pop(L, 2);
+  }
+  if (entries < SHARDS)
+    return luaL_error(L, "bad entries option (at least %d expected)", SHARDS);
+  pthread_mutex_lock(&config);
+  capacity = 0;
+  ino_stop_thread();
+  statcache_clear();
+  __sync_add_and_fetch(&generation, 1);
+  for (buckets = 1; buckets < (unsigned)(entries / SHARDS); buckets <<= 1)
+    ;
+  for (i = 0; i < SHARDS; i++) {
+    struct shard *sh = &shards[i];
+    pthread_mutex_lock(&sh->lock);
+    sh->buckets = calloc(buckets, sizeof *sh->buckets);
+    sh->mask = buckets - 1;
+    sh->count = 0;
+    sh->oldest = 0;
+    sh->newest = &sh->oldest;
+    sh->hits = sh->misses = sh->evictions = sh->invalidations = 0;
+    pthread_mutex_unlock(&sh->lock);
+    if (!sh->buckets) {
+      statcache_clear();
+      pthread_mutex_unlock(&config);
+      return luaL_error(L, "not enough memory");
+    }
+  }
+  if (inotify && -1 == ino_start()) {
+    statcache_clear();
+    pthread_mutex_unlock(&config);
+    return push_error(L);
+  }
+  capacity = entries / SHARDS;
+  pthread_mutex_unlock(&config);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* -- */
+static int statcache_disable(lua_State *L)
+{
+  (void)L;
+  pthread_mutex_lock(&config);
+  capacity = 0;
+  ino_stop_thread();
+  statcache_clear();
+  pthread_mutex_unlock(&config);
+  return 0;
+}
+
+/* -- generation */
+static int statcache_bump(lua_State *L)
+{
+  lua_pushnumber(L, __sync_add_and_fetch(&generation, 1));
+  return 1;
+}
+
+/* -- stats */
+static int statcache_stats(lua_State *L)
+{
+  unsigned long hits = 0, misses = 0, evictions = 0, invalidations = 0;
+  int i, count = 0;
+  for (i = 0; i < SHARDS; i++) {
+    struct shard *sh = &shards[i];
+    pthread_mutex_lock(&sh->lock);
+    hits += sh->hits;
+    misses += sh->misses;
+    evictions += sh->evictions;
+    invalidations += sh->invalidations;
+    count += sh->count;
+    pthread_mutex_unlock(&sh->lock);
+  }
+  lua_createtable(L, 0, 7);
+  lua_pushboolean(L, capacity > 0);
+  lua_setfield(L, -2, "enabled");
+  lua_pushnumber(L, hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, evictions);
+  lua_setfield(L, -2, "evictions");
+  lua_pushnumber(L, invalidations);
+  lua_setfield(L, -2, "invalidations");
+  lua_pushnumber(L, count);
+  lua_setfield(L, -2, "entries");
+  lua_pushnumber(L, generation);
+  lua_setfield(L, -2, "generation");
+  return 1;
+}
+
+/* Stops the inotify thread when the last Lua state is closed, before the
+ * code it runs can be unloaded; the cache is shared by every state. */
+static int statcache_gc(lua_State *L)
+{
+  int last;
+  pthread_mutex_lock(&config);
+  last = --states == 0;
+  pthread_mutex_unlock(&config);
+  return last ? statcache_disable(L) : 0;
+}
+
+/* ex -- ex */
+int statcache_open(lua_State *L)
+{
+  const luaL_reg functions[] = {
+    {"enable",   statcache_enable},
+    {"disable",  statcache_disable},
+    {"bump",     statcache_bump},
+    {"stats",    statcache_stats},
+    {0,0} };
+  static int initialized;
+  int i;
+  pthread_mutex_lock(&config);
+  if (!initialized) {
+    for (i = 0; i < SHARDS; i++) {
+      pthread_mutex_init(&shards[i].lock, 0);
+      shards[i].newest = &shards[i].oldest;
+    }
+    initialized = 1;
+  }
+  states++;
+  pthread_mutex_unlock(&config);
+  lua_newtable(L);                            /* ex S */
+  luaL_register(L, 0, functions);             /* ex S */
+  lua_newuserdata(L, 1);                      /* ex S sentinel */
+  lua_createtable(L, 0, 1);                   /* ex S sentinel M */
+  lua_pushcfunction(L, statcache_gc);         /* ex S sentinel M gc */
+  lua_setfield(L, -2, "__gc");                /* ex S sentinel M */
+  lua_setmetatable(L, -2);                    /* ex S sentinel */
+  lua_setfield(L, LUA_REGISTRYINDEX, "ex.statcache"); /* ex S */
+  lua_setfield(L, -2, "statcache");           /* ex */
+  return 0;
+}
@@ -0,0 +1,16 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef STATCACHE_H
+#define STATCACHE_H
+
+#include <sys/stat.h>
+
+#include "lua.h"
+
+int statcache_stat(const char *path, struct stat *st);
+int statcache_open(lua_State *L);
+
+#endif/*STATCACHE_H*/
@@ -0,0 +1,380 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "spawn.h"
+#include "timers.h"
+
+/* A hierarchical timer wheel.  Time is counted in ticks of a fixed
+ * resolution.  Level 0 has a slot for each of the next 64 ticks, and each
+ * higher level a slot for each of the next 64 spans of the level below; a
+ * slot of a higher level is cascaded into the lower levels when the wheel
+ * reaches it.  Timers are nodes of doubly linked lists held in one array,
+ * so adding and cancelling are O(1).  A bitmap of occupied slots per level
+ * lets expiry skip empty stretches and answers the next-deadline query.
+ * The value of each timer is kept in the environment table. */
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 5
+#define WHEEL_SPAN(l) ((tick_t)1 << WHEEL_BITS * (l))
+#define TIMERS_MAX (1 << 24)            /* ids are generation * MAX + index */
+
+typedef unsigned long long tick_t;
+
+struct tnode {
+  tick_t expires;
+  int prev, next;       /* within the slot, or next free node */
+  int slot;             /* level * WHEEL_SIZE + index, or -1 if free */
+  unsigned gen;
+};
+
+struct timers {
+  double resolution;    /* seconds per tick */
+  double origin;        /* monotonic time of tick 0 */
+  tick_t now;           /* the next tick to expire */
+  int heads[WHEEL_LEVELS * WHEEL_SIZE];
+  unsigned long long occupied[WHEEL_LEVELS];
+  struct tnode *nodes;
+  int size, free, count;
+};
+
+static struct timers *check_timers(lua_State *L, int idx)
+{
+  return luaL_checkudata(L, idx, TIMERS_HANDLE);
+}
+
+static void slot_link(struct timers *t, int i, int slot)
+{
+  struct tnode *n = &t->nodes[i];
+  n->slot = slot;
+  n->prev = -1;
+  n->next = t->heads[slot];
+  if (n->next != -1)
+    t->nodes[n->next].prev = i;
+  t->heads[slot] = i;
+  t->occupied[slot / WHEEL_SIZE] |= 1ULL << slot % WHEEL_SIZE;
+}
+
+static void slot_unlink(struct timers *t, int i)
+{
+  struct tnode *n = &t->nodes[i];
+  if (n->prev != -1)
+    t->nodes[n->prev].next = n->next;
+  else if (-1 == (t->heads[n->slot] = n->next))
+    t->occupied[n->slot / WHEEL_SIZE] &= ~(1ULL << n->slot % WHEEL_SIZE);
+  if (n->next != -1)
+    t->nodes[n->next].prev = n->prev;
+}
+
+/* Files node i in the slot for its expiry, relative to t->now. */
+static void wheel_add(struct timers *t, int i)
+{
+  tick_t expires = t->nodes[i].expires;
+  tick_t delta;
+  int level;
+  if (expires < t->now)
+    expires = t->now;
+  delta = expires - t->now;
+  for (level = 0; level < WHEEL_LEVELS - 1; level++)
+    if (delta < WHEEL_SPAN(level + 1))
+      break;
+  if (delta >= WHEEL_SPAN(WHEEL_LEVELS))
+    /* beyond the wheel: park it in the farthest slot, to be refiled */
+    expires = t->now + WHEEL_SPAN(WHEEL_LEVELS) - 1;
+  slot_link(t, i, level * WHEEL_SIZE
+                  + (int)(expires >> WHEEL_BITS * level & WHEEL_MASK));
+}
+
+/* Refiles the timers of a slot into lower levels. */
+static void wheel_cascade(struct timers *t, int level, int index)
+{
+  int slot = level * WHEEL_SIZE + index;
+  int i = t->heads[slot];
+  t->heads[slot] = -1;
+  t->occupied[level] &= ~(1ULL << index);
+  while (i != -1) {
+    int next = t->nodes[i].next;
+    wheel_add(t, i);
+    i = next;
+  }
+}
+
+/* The first tick at or after when, so that timers never expire early. */
+static tick_t tick_at(struct timers *t, double when)
+{
+  double ticks = ceil((when - t->origin) / t->resolution);
+  return ticks < 0 ? 0 : (tick_t)ticks;
+}
+
+/* The last tick which has started by when. */
+static tick_t tick_before(struct timers *t, double when)
+{
+  double ticks = floor((when - t->origin) / t->resolution);
+  return ticks < 0 ? 0 : (tick_t)ticks;
+}
+
+static int lowest_level(struct timers *t)
+{
+  int level;
+  for (level = 0; level < WHEEL_LEVELS; level++)
+    if (t->occupied[level])
+      return level;
+  return -1;
+}
+
+/* timers seconds value -- id */
+static int timers_add(lua_State *L)
+{
+  struct timers *t = check_timers(L, 1);
+  lua_Number seconds = luaL_checknumber(L, 2);
+  int i;
+  luaL_checkany(L, 3);
+  if (t->free == -1) {
+    int size = t->size ? 2 * t->size : 64;
+    struct tnode *nodes;
+    if (size > TIMERS_MAX)
+      return luaL_error(L, "too many timers");
+    if (!(nodes = realloc(t->nodes, size * sizeof *nodes)))
+      return luaL_error(L, "not enough memory");
+    for (i = t->size; i < size; i++) {
+      nodes[i].slot = -1;
+      nodes[i].gen = 0;
+      nodes[i].next = i + 1 < size ? i + 1 : -1;
+    }
+    t->free = t->size;
+    t->nodes = nodes;
+    t->size = size;
+  }
+  i = t->free;
+  t->free = t->nodes[i].next;
+  t->nodes[i].expires = tick_at(t, monotime() + (seconds > 0 ? seconds : 0));
+  wheel_add(t, i);
+  t->count++;
+  lua_getfenv(L, 1);
+  lua_pushvalue(L, 3);
+  lua_rawseti(L, -2, i + 1);
+  lua_pushnumber(L, (lua_Number)t->nodes[i].gen * TIMERS_MAX + i);
+  return 1;
+}
+
+static void timers_release(lua_State *L, struct timers *t, int i)
+{
+  struct tnode *n = &t->nodes[i];
+  n->slot = -1;
+  n->gen++;
+  n->next = t->free;
+  t->free = i;
+  t->count--;
+  lua_getfenv(L, 1);
+  lua_pushnil(L);
+  lua_rawseti(L, -2, i + 1);
+  lua_pop(L, 1);
+}
+
+/* timers id -- true/false */
+static int timers_cancel(lua_State *L)
+{
+  struct timers *t = check_timers(L, 1);
+  lua_Number id = luaL_checknumber(L, 2);
+  lua_Number gen = floor(id / TIMERS_MAX);
+  int i = (int)(id - gen * TIMERS_MAX);
+  int found = id >= 0 && i >= 0 && i < t->size && t->nodes[i].slot != -1
+              && t->nodes[i].gen == gen;
+  if (found) {
+    slot_unlink(t, i);
+    timers_release(L, t, i);
+  }
+  lua_pushboolean(L, found);
+  return 1;
+}
+
+/* Advances the wheel through tick end.  Returns the first of the timers
+ * which expired, chained through next in order of expiry, or -1. */
+static int wheel_advance(struct timers *t, tick_t end)
+{
+  int head = -1, tail = -1;
+  while (t->now <= end) {
+    int index = (int)(t->now & WHEEL_MASK);
+    int level;
+    if (index == 0)
+      for (level = 1; level < WHEEL_LEVELS; level++) {
+        int li = (int)(t->now >> WHEEL_BITS * level & WHEEL_MASK);
+        wheel_cascade(t, level, li);
+        if (li != 0)
+          break;
+      }
+    if (t->heads[index] != -1) {
+      int i = t->heads[index];
+      if (tail == -1)
+        head = i;
+      else
+        t->nodes[tail].next = i;
+      while (t->nodes[i].next != -1)
+        i = t->nodes[i].next;
+      tail = i;
+      t->heads[index] = -1;
+      t->occupied[0] &= ~(1ULL << index);
+    }
+    t->now++;
+    /* skip to the next tick which can have work: an occupied level 0
+     * slot, or the next cascade of the lowest occupied level */
+    if (!t->occupied[0] && (t->now & WHEEL_MASK) != 0) {
+      tick_t next = end + 1;
+      if (-1 != (level = lowest_level(t))) {
+        tick_t span = WHEEL_SPAN(level);
+        tick_t cascade = (t->now + span - 1) / span * span;
+        if (cascade < next)
+          next = cascade;
+      }
+      t->now = next;
+    }
+  }
+  return head;
+}
+
+/* timers [now] -- {value, ...}
+ * Advances the wheel to now (in seconds on the monotonic clock, default
+ * the current time) and returns the values of the timers which expired, in
+ * order of expiry. */
+static int timers_expire(lua_State *L)
+{
+  struct timers *t = check_timers(L, 1);
+  tick_t end = tick_before(t, luaL_optnumber(L, 2, monotime()));
+  int i = wheel_advance(t, end), n = 0;
+  lua_settop(L, 1);
+  lua_newtable(L);                            /* t list */
+  lua_getfenv(L, 1);                          /* t list env */
+  while (i != -1) {
+    int next = t->nodes[i].next;
+    lua_rawgeti(L, -1, i + 1);
+    lua_rawseti(L, -3, ++n);
+    timers_release(L, t, i);
+    i = next;
+  }
+  lua_pop(L, 1);
+  return 1;
+}
+
+/* Returns the first tick at which the wheel may have work. */
+static tick_t next_tick(struct timers *t)
+{
+  tick_t best = ~(tick_t)0;
+  int level;
+  for (level = 0; level < WHEEL_LEVELS; level++) {
+    unsigned long long mask = t->occupied[level];
+    tick_t base = t->now >> WHEEL_BITS * level;
+    tick_t d, tick;
+    if (!mask)
+      continue;
+    /* the nearest occupied slot whose tick (for level 0) or cascade (for
+     * the others) is still to come */
+    d = level == 0 || (t->now & (WHEEL_SPAN(level) - 1)) == 0 ? 0 : 1;
+    for (; d <= WHEEL_SIZE; d++)
+      if (mask >> ((base + d) & WHEEL_MASK) & 1)
+        break;
+    tick = (base + d) << WHEEL_BITS * level;
+    if (tick < best)
+      best = tick;
+  }
+  return best;
+}
+
+/* timers -- seconds/nil
+ * The time until the next timer may expire, for use as a timeout, or nil if
+ * there are none.  Timers beyond the first level are reported at the start
+ * of their slot, which may be early but is never late. */
+static int timers_next(lua_State *L)
+{
+  struct timers *t = check_timers(L, 1);
+  double when;
+  if (t->count == 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  when = t->origin + next_tick(t) * t->resolution - monotime();
+  lua_pushnumber(L, when > 0 ? when : 0);
+  return 1;
+}
+
+/* timers -- count */
+static int timers_count(lua_State *L)
+{
+  lua_pushnumber(L, check_timers(L, 1)->count);
+  return 1;
+}
+
+/* timers -- */
+static int timers_gc(lua_State *L)
+{
+  struct timers *t = check_timers(L, 1);
+  free(t->nodes);
+  t->nodes = 0;
+  t->size = t->count = 0;
+  t->free = -1;
+  return 0;
+}
+
+/* timers -- string */
+static int timers_tostring(lua_State *L)
+{
+  lua_pushfstring(L, "timers (%d pending)", check_timers(L, 1)->count);
+  return 1;
+}
+
+/* [resolution] -- timers */
+static int ex_timers(lua_State *L)
+{
+  lua_Number resolution = luaL_optnumber(L, 1, 0.001);
+  struct timers *t;
+  int i;
+  luaL_argcheck(L, resolution > 0, 1, "resolution must be positive");
+  t = lua_newuserdata(L, sizeof *t);
+  t->resolution = resolution;
+  t->origin = monotime();
+  t->now = 0;
+  for (i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; i++)
+    t->heads[i] = -1;
+  memset(t->occupied, 0, sizeof t->occupied);
+  t->nodes = 0;
+  t->size = t->count = 0;
+  t->free = -1;
+  luaL_getmetatable(L, TIMERS_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_newtable(L);
+  lua_setfenv(L, -2);
+  return 1;
+}
+
+/* ex -- ex */
+int timers_open(lua_State *L)
+{
+  const luaL_reg methods[] = {
+    {"add",      timers_add},
+    {"cancel",   timers_cancel},
+    {"expire",   timers_expire},
+    {"next",     timers_next},
+    {"count",    timers_count},
+    {0,0} };
+  luaL_newmetatable(L, TIMERS_HANDLE);        /* ex M */
+  lua_newtable(L);                            /* ex M I */
+  luaL_register(L, 0, methods);               /* ex M I */
+  lua_setfield(L, -2, "__index");             /* ex M */
+  lua_pushcfunction(L, timers_gc);            /* ex M gc */
+  lua_setfield(L, -2, "__gc");                /* ex M */
+  lua_pushcfunction(L, timers_tostring);      /* ex M tostring */
+  lua_setfield(L, -2, "__tostring");          /* ex M */
+  lua_pop(L, 1);                              /* ex */
+  lua_pushcfunction(L, ex_timers);            /* ex timers */
+  lua_setfield(L, -2, "timers");              /* ex */
+  return 0;
+}
@@ -0,0 +1,15 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef TIMERS_H
+#define TIMERS_H
+
+#include "lua.h"
+
+#define TIMERS_HANDLE "timers"
+
+int timers_open(lua_State *L);
+
+#endif/*TIMERS_H*/
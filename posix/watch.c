@@ -0,0 +1,565 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "spawn.h"
+#include "watch.h"
+
+extern int push_error(lua_State *L);
+
+#ifdef __linux__
+
+/* A watcher is an inotify descriptor.  Its environment table maps watch
+ * descriptors to the directories (or files) they watch and back:
+ *   { wds = { [wd] = path }, paths = { [path] = wd } }
+ * Events are read in batches; a batch holds each path and event once, in
+ * the order they first occurred. */
+
+#define WATCH_HANDLE "ex.watch"
+#define WATCH_BUFSIZE 65536
+
+struct watcher {
+  int fd;
+  int recursive;
+  uint32_t mask;        /* the events asked for */
+  double latency;       /* seconds to wait for more events after the first */
+  char buf[WATCH_BUFSIZE]   /* for reading events */
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+};
+
+static const char *const event_names[] = {
+  "create", "delete", "modify", "attrib", "move", 0
+};
+static const uint32_t event_masks[] = {
+  IN_CREATE,
+  IN_DELETE | IN_DELETE_SELF,
+  IN_MODIFY | IN_CLOSE_WRITE,
+  IN_ATTRIB,
+  IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF
+};
+
+/* a recursive watcher must see new directories, even if it does not
+ * report them */
+#define WATCH_TREE (IN_CREATE | IN_MOVED_TO)
+
+static struct watcher *check_watcher(lua_State *L, int idx)
+{
+  struct watcher *w = luaL_checkudata(L, idx, WATCH_HANDLE);
+  if (w->fd == -1)
+    luaL_error(L, "attempt to use a closed watcher");
+  return w;
+}
+
+/* Pushes field k of the watcher's environment. */
+static void getenvfield(lua_State *L, int idx, const char *k)
+{
+  lua_getfenv(L, idx);
+  lua_getfield(L, -1, k);
+  lua_replace(L, -2);
+}
+
+/* name -- name */
+static uint32_t event_mask(lua_State *L)
+{
+  const char *name = lua_tostring(L, -1);
+  int i;
+  for (i = 0; name && event_names[i]; i++)
+    if (0 == strcmp(name, event_names[i]))
+      return event_masks[i];
+  return luaL_error(L, "bad event (%s)", name ? name : luaL_typename(L, -1));
+}
+
+/* watcher ... path -- watcher ... path
+ * Watches a single path.  Returns the watch descriptor, or -1 with errno
+ * set. */
+static int watch_path(lua_State *L, struct watcher *w)
+{
+  uint32_t mask = w->mask | IN_DELETE_SELF | IN_MOVE_SELF;
+  int wd;
+  if (w->recursive)
+    mask |= WATCH_TREE;
+  wd = inotify_add_watch(w->fd, lua_tostring(L, -1), mask);
+  if (wd == -1)
+    return -1;
+  getenvfield(L, 1, "wds");                   /* path wds */
+  getenvfield(L, 1, "paths");                 /* path wds paths */
+  /* a directory moved within the tree keeps its descriptor */
+  lua_rawgeti(L, -2, wd);                     /* path wds paths old */
+  if (!lua_isnil(L, -1)) {
+    lua_pushnil(L);
+    lua_rawset(L, -3);                        /* path wds paths */
+  }
+  else
+    lua_pop(L, 1);
+  lua_pushvalue(L, -3);                       /* path wds paths path */
+  lua_pushnumber(L, wd);                      /* path wds paths path wd */
+  lua_rawset(L, -3);                          /* path wds paths */
+  lua_pushvalue(L, -3);                       /* path wds paths path */
+  lua_rawseti(L, -3, wd);                     /* path wds paths */
+  lua_pop(L, 2);                              /* path */
+  return wd;
+}
+
+/* ... path -- ... path
+ * Adds the event to the batch at events unless it is already there; the
+ * set of those seen follows the batch on the stack. */
+static void push_event(lua_State *L, int events, const char *event, int isdir)
+{
+  lua_pushvalue(L, -1);                       /* path path */
+  lua_pushlstring(L, "", 1);
+  lua_pushstring(L, event);
+  lua_concat(L, 3);                           /* path key */
+  lua_pushvalue(L, -1);                       /* path key key */
+  lua_rawget(L, events + 1);                  /* path key seen? */
+  if (!lua_isnil(L, -1)) {
+    lua_pop(L, 2);
+    return;
+  }
+  lua_pop(L, 1);                              /* path key */
+  lua_pushboolean(L, 1);                      /* path key true */
+  lua_rawset(L, events + 1);                  /* path */
+  lua_createtable(L, 0, 3);                   /* path E */
+  lua_pushvalue(L, -2);
+  lua_setfield(L, -2, "path");
+  lua_pushstring(L, event);
+  lua_setfield(L, -2, "event");
+  lua_pushboolean(L, isdir);
+  lua_setfield(L, -2, "directory");
+  lua_rawseti(L, events, lua_objlen(L, events) + 1); /* path */
+}
+
+/* ... path -- ... path
+ * Adds an "error" event for a directory which could not be watched. */
+static void push_error_event(lua_State *L, int events)
+{
+  const char *message = strerror(errno);
+  lua_createtable(L, 0, 3);                   /* path E */
+  lua_pushvalue(L, -2);
+  lua_setfield(L, -2, "path");
+  lua_pushliteral(L, "error");
+  lua_setfield(L, -2, "event");
+  lua_pushstring(L, message);
+  lua_setfield(L, -2, "error");
+  lua_rawseti(L, events, lua_objlen(L, events) + 1); /* path */
+}
+
+/* Whether a directory found in a tree went before it could be watched. */
+static int gone(int err)
+{
+  return err == ENOENT || err == ENOTDIR;
+}
+
+static int is_dir(const char *path, struct dirent *e)
+{
+  struct stat st;
+#ifdef DT_DIR
+  if (e && e->d_type != DT_UNKNOWN)
+    return e->d_type == DT_DIR;
+#endif
+  return 0 == lstat(path, &st) && S_ISDIR(st.st_mode);
+}
+
+/* watcher ... path -- watcher ... path
+ * Watches the directory at path and, for a recursive watcher, those below
+ * it.  Given a batch at events, each entry found is reported as created,
+ * since it may have been created before its directory was watched, and a
+ * directory below which cannot be watched as an error.  Otherwise such a
+ * directory fails the call, and replaces path.  Returns -1 with errno set
+ * on failure. */
+static int watch_tree(lua_State *L, struct watcher *w, int events)
+{
+  DIR *d;
+  struct dirent *e;
+  if (-1 == watch_path(L, w))
+    return -1;
+  if (!w->recursive)
+    return 0;
+  if (!(d = opendir(lua_tostring(L, -1))))
+    return gone(errno) ? 0 : -1;
+  luaL_checkstack(L, 4, "directory tree too deep");
+  while ((e = readdir(d))) {
+    int dir;
+    if (e->d_name[0] == '.' && (!e->d_name[1]
+        || (e->d_name[1] == '.' && !e->d_name[2])))
+      continue;
+    lua_pushvalue(L, -1);
+    lua_pushliteral(L, "/");
+    lua_pushstring(L, e->d_name);
+    lua_concat(L, 3);                         /* ... path child */
+    dir = is_dir(lua_tostring(L, -1), e);
+    if (events && (w->mask & IN_CREATE))
+      push_event(L, events, "create", dir);
+    if (dir && -1 == watch_tree(L, w, events) && !gone(errno)) {
+      if (events)
+        push_error_event(L, events);
+      else {
+        int err = errno;
+        lua_replace(L, -2);                   /* ... child */
+        closedir(d);
+        errno = err;
+        return -1;
+      }
+    }
+    lua_pop(L, 1);
+  }
+  closedir(d);
+  return 0;
+}
+
+/* watcher path -- true/nil error */
+static int watcher_add(lua_State *L)
+{
+  struct watcher *w = check_watcher(L, 1);
+  luaL_checkstring(L, 2);
+  lua_settop(L, 2);
+  if (-1 == watch_tree(L, w, 0)) {
+    int err = errno;
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", lua_tostring(L, 2), strerror(err));
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* watcher path -- true/nil error */
+static int watcher_remove(lua_State *L)
+{
+  struct watcher *w = check_watcher(L, 1);
+  luaL_checkstring(L, 2);
+  lua_settop(L, 2);
+  getenvfield(L, 1, "paths");                 /* path paths */
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);                          /* path paths wd */
+  if (lua_isnil(L, -1)) {
+    errno = ENOENT;
+    return push_error(L);
+  }
+  /* the mapping goes when IN_IGNORED arrives */
+  if (-1 == inotify_rm_watch(w->fd, lua_tonumber(L, -1)))
+    return push_error(L);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static const char *event_name(uint32_t mask)
+{
+  if (mask & IN_CREATE) return "create";
+  if (mask & (IN_DELETE | IN_DELETE_SELF)) return "delete";
+  if (mask & (IN_MODIFY | IN_CLOSE_WRITE)) return "modify";
+  if (mask & IN_ATTRIB) return "attrib";
+  if (mask & IN_MOVED_FROM) return "move_from";
+  if (mask & IN_MOVED_TO) return "move_to";
+  if (mask & IN_MOVE_SELF) return "move";
+  return 0;
+}
+
+/* watcher ... events seen -- watcher ... events seen
+ * Reads the events available and adds them to the batch.  Returns -1 on
+ * error, otherwise 0. */
+static int watcher_drain(lua_State *L, struct watcher *w)
+{
+  int events = lua_gettop(L) - 1;
+  char *buf = w->buf;
+  for (;;) {
+    ssize_t n = read(w->fd, buf, sizeof w->buf);
+    char *p;
+    if (n == -1)
+      return errno == EAGAIN ? 0 : errno == EINTR ? 0 : -1;
+    for (p = buf; p < buf + n;
+         p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      const char *name;
+      int isdir = (ev->mask & IN_ISDIR) != 0;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "overflow");
+        lua_setfield(L, -2, "event");
+        lua_rawseti(L, events, lua_objlen(L, events) + 1);
+        continue;
+      }
+      getenvfield(L, 1, "wds");               /* events seen wds */
+      lua_rawgeti(L, -1, ev->wd);             /* events seen wds dir */
+      if (lua_isnil(L, -1)) {
+        lua_pop(L, 2);
+        continue;
+      }
+      if (ev->mask & IN_IGNORED) {
+        getenvfield(L, 1, "paths");           /* events seen wds dir paths */
+        lua_pushvalue(L, -2);
+        lua_pushnil(L);
+        lua_rawset(L, -3);
+        lua_pushnil(L);
+        lua_rawseti(L, -4, ev->wd);
+        lua_pop(L, 3);                        /* events seen */
+        continue;
+      }
+      lua_replace(L, -2);                     /* events seen dir */
+      if (ev->len > 0) {
+        lua_pushliteral(L, "/");
+        lua_pushstring(L, ev->name);
+        lua_concat(L, 3);                     /* events seen path */
+      }
+      if ((name = event_name(ev->mask & w->mask)))
+        push_event(L, events, name, isdir);
+      if (w->recursive && isdir && (ev->mask & WATCH_TREE)
+          && -1 == watch_tree(L, w, events) && !gone(errno))
+        push_error_event(L, events);
+      lua_pop(L, 1);                          /* events seen */
+    }
+  }
+}
+
+/* watcher timeout -- events/nil error
+ * Waits up to timeout seconds (default: forever) for events, then collects
+ * a batch of them. */
+static int watcher_batch(lua_State *L, struct watcher *w, double timeout)
+{
+  double deadline = timeout < 0 ? -1 : monotime() + timeout;
+  struct pollfd pfd;
+  pfd.fd = w->fd;
+  pfd.events = POLLIN;
+  lua_newtable(L);                            /* events */
+  lua_newtable(L);                            /* events seen */
+  for (;;) {
+    int ret = poll(&pfd, 1, remaining_ms(deadline));
+    if (ret == -1 && errno != EINTR)
+      return -1;
+    if (ret > 0) {
+      if (w->latency > 0) {
+        /* let related events arrive, so that they coalesce */
+        struct timespec ts;
+        ts.tv_sec = (time_t)w->latency;
+        ts.tv_nsec = (long)((w->latency - ts.tv_sec) * 1e9);
+        while (-1 == nanosleep(&ts, &ts) && errno == EINTR)
+          ;
+      }
+      if (-1 == watcher_drain(L, w))
+        return -1;
+      if (lua_objlen(L, -2) > 0)
+        break;
+    }
+    if (deadline >= 0 && remaining_ms(deadline) == 0)
+      break;
+  }
+  lua_pop(L, 1);                              /* events */
+  return 0;
+}
+
+/* watcher [timeout] -- events/nil error */
+static int watcher_read(lua_State *L)
+{
+  struct watcher *w = check_watcher(L, 1);
+  double timeout = luaL_optnumber(L, 2, -1);
+  lua_settop(L, 1);
+  if (-1 == watcher_batch(L, w, timeout))
+    return push_error(L);
+  return 1;
+}
+
+/* -- event path directory */
+static int watcher_next(lua_State *L)
+{
+  struct watcher *w = check_watcher(L, lua_upvalueindex(1));
+  double timeout = lua_tonumber(L, lua_upvalueindex(2));
+  int i = lua_tonumber(L, lua_upvalueindex(3));
+  lua_settop(L, 0);
+  lua_pushvalue(L, lua_upvalueindex(1));      /* watcher */
+  lua_pushvalue(L, lua_upvalueindex(4));      /* watcher batch */
+  if (!lua_istable(L, -1) || (size_t)i > lua_objlen(L, -1)) {
+    lua_pop(L, 1);                            /* watcher */
+    if (-1 == watcher_batch(L, w, timeout))
+      return luaL_error(L, "watch: %s", strerror(errno));
+    if (lua_objlen(L, -1) == 0)
+      return 0;
+    lua_pushvalue(L, -1);
+    lua_replace(L, lua_upvalueindex(4));      /* watcher batch */
+    i = 1;
+  }
+  lua_rawgeti(L, -1, i);                      /* watcher batch E */
+  lua_pushnumber(L, i + 1);
+  lua_replace(L, lua_upvalueindex(3));
+  lua_getfield(L, -1, "event");
+  lua_getfield(L, -2, "path");
+  lua_getfield(L, -3, "directory");
+  return 3;
+}
+
+/* watcher [timeout] -- iterator
+ * The iterator ends when no event arrives within timeout seconds. */
+static int watcher_events(lua_State *L)
+{
+  check_watcher(L, 1);
+  lua_settop(L, 1);
+  lua_pushnumber(L, luaL_optnumber(L, 2, -1));
+  lua_pushnumber(L, 1);
+  lua_pushnil(L);
+  lua_pushcclosure(L, watcher_next, 4);
+  return 1;
+}
+
+/* watcher -- fd */
+static int watcher_fd(lua_State *L)
+{
+  lua_pushnumber(L, check_watcher(L, 1)->fd);
+  return 1;
+}
+
+/* watcher -- */
+static int watcher_close(lua_State *L)
+{
+  struct watcher *w = luaL_checkudata(L, 1, WATCH_HANDLE);
+  if (w->fd != -1) {
+    close(w->fd);
+    w->fd = -1;
+  }
+  return 0;
+}
+
+/* watcher -- string */
+static int watcher_tostring(lua_State *L)
+{
+  struct watcher *w = luaL_checkudata(L, 1, WATCH_HANDLE);
+  if (w->fd == -1)
+    lua_pushliteral(L, "watcher (closed)");
+  else
+    lua_pushfstring(L, "watcher (%d)", w->fd);
+  return 1;
+}
+
+/* pathname-or-list [options] -- watcher/nil error */
+int ex_watch(lua_State *L)
+{
+  struct watcher *w;
+  int i, n;
+  if (!lua_istable(L, 1))
+    luaL_checkstring(L, 1);
+  lua_settop(L, 2);
+  w = lua_newuserdata(L, sizeof *w);          /* paths o w */
+  w->fd = -1;
+  w->recursive = 0;
+  w->mask = 0;
+  w->latency = 0;
+  luaL_getmetatable(L, WATCH_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 0, 2);
+  lua_newtable(L);
+  lua_setfield(L, -2, "wds");
+  lua_newtable(L);
+  lua_setfield(L, -2, "paths");
+  lua_setfenv(L, -2);
+  if (!lua_isnil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "recursive");
+    w->recursive = lua_toboolean(L, -1);
+    lua_getfield(L, 2, "latency");
+    w->latency = lua_isnil(L, -1) ? 0 : luaL_checknumber(L, -1);
+    lua_getfield(L, 2, "events");
+    if (lua_isstring(L, -1))
+      w->mask = event_mask(L);
+    else if (lua_istable(L, -1)) {
+      n = lua_objlen(L, -1);
+      for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, -1, i);
+        w->mask |= event_mask(L);
+        lua_pop(L, 1);
+      }
+    }
+    else if (!lua_isnil(L, -1))
+      return luaL_error(L, "bad events option (string or table expected, got %s)",
+                        luaL_typename(L, -1));
+    lua_pop(L, 3);
+  }
+  if (!w->mask)
+    for (i = 0; event_names[i]; i++)
+      w->mask |= event_masks[i];
+  if (-1 == (w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)))
+    return push_error(L);
+  /* watch_path expects the watcher at 1 */
+  lua_replace(L, 2);                          /* paths w */
+  lua_insert(L, 1);                           /* w paths */
+  n = lua_istable(L, 2) ? (int)lua_objlen(L, 2) : 1;
+  for (i = 1; i <= n; i++) {
+    if (lua_istable(L, 2))
+      lua_rawgeti(L, 2, i);
+    else
+      lua_pushvalue(L, 2);
+    if (!lua_isstring(L, -1))
+      return luaL_error(L, "bad path %d (string expected, got %s)", i,
+                        luaL_typename(L, -1));
+    if (-1 == watch_tree(L, w, 0)) {
+      int err = errno;
+      lua_pushfstring(L, "%s: %s", lua_tostring(L, -1), strerror(err));
+      close(w->fd);
+      w->fd = -1;
+      lua_pushnil(L);
+      lua_insert(L, -2);
+      return 2;
+    }
+    lua_pop(L, 1);
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* ex -- ex */
+int watch_open(lua_State *L)
+{
+  const luaL_reg methods[] = {
+    {"read",     watcher_read},
+    {"events",   watcher_events},
+    {"add",      watcher_add},
+    {"remove",   watcher_remove},
+    {"fd",       watcher_fd},
+    {"close",    watcher_close},
+    {0,0} };
+  luaL_newmetatable(L, WATCH_HANDLE);         /* ex M */
+  lua_newtable(L);                            /* ex M I */
+  luaL_register(L, 0, methods);               /* ex M I */
+  lua_setfield(L, -2, "__index");             /* ex M */
+  lua_pushcfunction(L, watcher_close);        /* ex M close */
+  lua_setfield(L, -2, "__gc");                /* ex M */
+  lua_pushcfunction(L, watcher_tostring);     /* ex M tostring */
+  lua_setfield(L, -2, "__tostring");          /* ex M */
+  lua_pop(L, 1);                              /* ex */
+  return 0;
+}
+
+#else
+
+/* pathname-or-list [options] -- nil error */
+int ex_watch(lua_State *L)
+{
+  errno = ENOSYS;
+  return push_error(L);
+}
+
+/* ex -- ex */
+int watch_open(lua_State *L)
+{
+  return 0;
+}
+
+#endif
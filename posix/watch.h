@@ -0,0 +1,14 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "lua.h"
+
+int ex_watch(lua_State *L);
+int watch_open(lua_State *L);
+
+#endif/*WATCH_H*/
@@ -0,0 +1,251 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "spawn.h"
+#include "which.h"
+#include "envsnap.h"
+
+/* The cache lives in the registry:
+ *   { ttl = seconds, [PATH] = { checked = time, dirs = { signature, ... },
+ *                               names = { [name] = pathname } } }
+ * Directory signatures are rechecked at most once per ttl; a change to any
+ * directory of a PATH drops everything resolved through it. */
+#define PATHCACHE "ex.pathcache"
+
+extern int push_error(lua_State *L);
+
+static int is_executable(const char *pathname)
+{
+  struct stat st;
+  return 0 == stat(pathname, &st) && S_ISREG(st.st_mode)
+         && 0 == access(pathname, X_OK);
+}
+
+/* Searches path for name, pushing the pathname found.  Returns 0 if there
+ * is none. */
+static int search(lua_State *L, const char *name, const char *path)
+{
+  char buf[PATH_MAX];
+  size_t namelen = strlen(name);
+  const char *dir, *end;
+  for (dir = path; ; dir = end + 1) {
+    size_t len;
+    end = strchr(dir, ':');
+    if (!end) end = strchr(dir, '\0');
+    len = end - dir;
+    if (len == 0)
+      dir = ".", len = 1;
+    if (len + 1 + namelen < sizeof buf) {
+      memcpy(buf, dir, len);
+      buf[len] = '/';
+      memcpy(buf + len + 1, name, namelen + 1);
+      if (is_executable(buf)) {
+        lua_pushstring(L, buf);
+        return 1;
+      }
+    }
+    if (!*end)
+      return 0;
+  }
+}
+
+/* Only PATHs made of absolute directories can be cached; anything else
+ * depends on the working directory. */
+static int cacheable(const char *path)
+{
+  const char *p;
+  if (*path != '/')
+    return 0;
+  for (p = path; (p = strchr(p, ':')); p++)
+    if (p[1] != '/')
+      return 0;
+  return 1;
+}
+
+/* path -- signatures */
+static void push_signatures(lua_State *L, const char *path)
+{
+  char buf[PATH_MAX], sig[64];
+  const char *dir, *end;
+  int i = 0;
+  lua_newtable(L);
+  for (dir = path; ; dir = end + 1) {
+    size_t len;
+    struct stat st;
+    end = strchr(dir, ':');
+    if (!end) end = strchr(dir, '\0');
+    len = end - dir;
+    if (len < sizeof buf) {
+      memcpy(buf, dir, len);
+      buf[len] = '\0';
+      if (-1 == stat(buf, &st))
+        strcpy(sig, "-");
+      else
+        sprintf(sig, "%lu:%ld:%ld", (unsigned long)st.st_ino,
+                (long)st.st_mtime,
+#ifdef __linux__
+                (long)st.st_mtim.tv_nsec
+#else
+                0L
+#endif
+                );
+      lua_pushstring(L, sig);
+      lua_rawseti(L, -2, ++i);
+    }
+    if (!*end)
+      break;
+  }
+}
+
+static int same_signatures(lua_State *L, int a, int b)
+{
+  int i, n = lua_objlen(L, a), same = n == (int)lua_objlen(L, b);
+  for (i = 1; same && i <= n; i++) {
+    lua_rawgeti(L, a, i);
+    lua_rawgeti(L, b, i);
+    same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+  }
+  return same;
+}
+
+/* Looks name up through the cache, if it is enabled, and pushes the
+ * pathname found.  Returns 0, pushing nothing, if the cache is disabled or
+ * cannot be used or the name is not found. */
+int which_cached(lua_State *L, const char *name)
+{
+  const char *path;
+  double ttl, now;
+  int p, cache, entry;
+  if (strchr(name, '/') || !env_pushliteral(L, "PATH"))
+    return 0;
+  p = lua_gettop(L);
+  path = lua_tostring(L, p);
+  if (!cacheable(path)) {
+    lua_settop(L, p - 1);
+    return 0;
+  }
+  lua_getfield(L, LUA_REGISTRYINDEX, PATHCACHE);
+  if (lua_isnil(L, -1)) {
+    lua_settop(L, p - 1);
+    return 0;
+  }
+  cache = lua_gettop(L);
+  lua_getfield(L, cache, "ttl");
+  ttl = lua_tonumber(L, -1);
+  lua_getfield(L, cache, path);                 /* C ttl entry */
+  entry = lua_gettop(L);
+  now = monotime();
+  if (lua_isnil(L, entry)) {
+    lua_createtable(L, 0, 3);
+    lua_replace(L, entry);
+    lua_pushnumber(L, now);
+    lua_setfield(L, entry, "checked");
+    push_signatures(L, path);
+    lua_setfield(L, entry, "dirs");
+    lua_newtable(L);
+    lua_setfield(L, entry, "names");
+    lua_pushvalue(L, entry);
+    lua_setfield(L, cache, path);
+  }
+  else {
+    lua_getfield(L, entry, "checked");
+    if (now - lua_tonumber(L, -1) >= ttl) {
+      lua_pushnumber(L, now);
+      lua_setfield(L, entry, "checked");
+      push_signatures(L, path);                 /* C ttl entry checked sigs */
+      lua_getfield(L, entry, "dirs");
+      if (!same_signatures(L, -1, -2)) {
+        lua_pushvalue(L, -2);
+        lua_setfield(L, entry, "dirs");
+        lua_newtable(L);
+        lua_setfield(L, entry, "names");
+      }
+      lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+  }
+  lua_getfield(L, entry, "names");              /* C ttl entry names */
+  lua_getfield(L, -1, name);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    if (!search(L, name, path)) {
+      lua_settop(L, p - 1);
+      return 0;
+    }
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, name);
+  }
+  lua_replace(L, p);
+  lua_settop(L, p);
+  return 1;
+}
+
+/* Looks name up in the PATH of the environment, and pushes the pathname
+ * found.  Returns 0, pushing nothing, if it is not found. */
+int which_search(lua_State *L, const char *name)
+{
+  const char *path = "/bin:/usr/bin";
+  int top = lua_gettop(L);
+  if (env_pushliteral(L, "PATH"))
+    path = lua_tostring(L, -1);
+  if (!search(L, name, path)) {
+    lua_settop(L, top);
+    return 0;
+  }
+  if (lua_gettop(L) > top + 1)
+    lua_replace(L, top + 1);
+  return 1;
+}
+
+/* name [path] -- pathname/nil error */
+int ex_which(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 1);
+  const char *path = luaL_optstring(L, 2, 0);
+  if (strchr(name, '/')) {
+    if (is_executable(name)) {
+      lua_settop(L, 1);
+      return 1;
+    }
+    return push_error(L);
+  }
+  if (path ? search(L, name, path)
+           : which_cached(L, name) || which_search(L, name))
+    return 1;
+  lua_pushnil(L);
+  lua_pushfstring(L, "%s: command not found", name);
+  return 2;
+}
+
+/* enable [ttl] -- true */
+int ex_pathcache(lua_State *L)
+{
+  if (lua_toboolean(L, 1)) {
+    lua_createtable(L, 0, 1);
+    lua_pushnumber(L, luaL_optnumber(L, 2, 1));
+    lua_setfield(L, -2, "ttl");
+  }
+  else
+    lua_pushnil(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, PATHCACHE);
+  lua_pushboolean(L, 1);
+  return 1;
+}
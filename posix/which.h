@@ -0,0 +1,16 @@
+/*
+ * "ex" API implementation
+ * http://lua-users.org/wiki/ExtensionProposal
+ * Copyright 2007 Mark Edgar < medgar at gmail com >
+ */
+#ifndef WHICH_H
+#define WHICH_H
+
+#include "lua.h"
+
+int which_cached(lua_State *L, const char *name);
+int which_search(lua_State *L, const char *name);
+int ex_which(lua_State *L);
+int ex_pathcache(lua_State *L);
+
+#endif/*WHICH_H*/
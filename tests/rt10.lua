@@ -0,0 +1,15 @@
+#!/usr/bin/env lua
+require "ex"
+
+print"os.spawnmany()"
+local commands = {}
+for i = 1, 8 do
+  commands[i] = {"sh", "-c", "sleep 0.$0; exit $0", tostring(i)}
+end
+local statuses = assert(os.spawnmany(commands, {
+  jobs = 3,
+  on_exit = function(i, exitcode) print("finished", i, exitcode) end,
+}))
+for i, status in ipairs(statuses) do
+  print("expect", i, status.exitcode)
+end
@@ -0,0 +1,27 @@
+#!/usr/bin/env lua
+require "ex"
+
+print"ex.jobserver.new()"
+local js = assert(ex.jobserver.new(2, {fifo=true}))
+print(js, js:makeflags())
+
+local other = assert(ex.jobserver.new(1, {fifo=true}))
+print("expect true", other:makeflags() ~= js:makeflags())
+other:close()
+
+print"js:acquire()"
+local t1 = assert(js:acquire())
+local t2 = assert(js:acquire())
+print("expect nil timeout", js:acquire(0.1))
+js:release(t2)
+js:release(t1)
+
+print"ex.jobserver.client()"
+local client = assert(ex.jobserver.client(js:makeflags()))
+print(client)
+
+print"os.spawnmany() with a jobserver"
+local commands = {}
+for i = 1, 6 do commands[i] = {"sleep", "0.2"} end
+print(#assert(os.spawnmany(commands, {jobs=6, jobserver=js})))
+js:close()
@@ -0,0 +1,15 @@
+#!/usr/bin/env lua
+require "ex"
+
+print"os.pipeline()"
+local pipeline = assert(os.pipeline(
+  {"printf", "b\na\nc\n"},
+  {"sort"},
+  {"head", "-n", "2"},
+  {pipesize = 1024 * 1024}))
+print("expect 0", (pipeline:wait()))
+
+print"pipefail"
+pipeline = assert(os.pipeline({"false"}, {"cat"}, {pipefail = true}))
+local exitcode, statuses = pipeline:wait()
+print("expect 1 1 0", exitcode, statuses[1].exitcode, statuses[2].exitcode)
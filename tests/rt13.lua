@@ -0,0 +1,14 @@
+#!/usr/bin/env lua
+require "ex"
+
+print"proc:communicate()"
+local proc = assert(os.spawn{"sh", "-c", "cat; echo oops >&2",
+  stdin = "", stdout = "capture", stderr = "capture"})
+local input = string.rep("x", 1024 * 1024)
+local out, err, exitcode = assert(proc:communicate(input))
+print("expect true oops 0", out == input, err, exitcode)
+
+print"memfd capture"
+proc = assert(os.spawn{"seq", "100000", stdout = "memfd"})
+out = assert(proc:communicate())
+print("expect 588895", #out)
@@ -0,0 +1,38 @@
+#!/usr/bin/env lua
+require "ex"
+
+print"proc:lines()"
+local proc = assert(os.spawn{"seq", "5", stdout = "capture"})
+for line in proc:lines("stdout") do io.write(line, " ") end
+print()
+print(assert(proc:wait()))
+
+print"ex.lines() in batches"
+proc = assert(os.spawn{"seq", "100000", stdout = "capture"})
+local count = 0
+for batch in proc:lines("stdout", {batch = 1000}) do count = count + #batch end
+print("expect 100000", count)
+proc:wait()
+
+print"ex.lines() with views"
+local i, o = assert(io.pipe())
+o:write("one\ntwo\nthree")
+o:close()
+for chunk, pos in ex.lines(i, {views = true}) do
+  for k = 1, #pos, 2 do
+    print(chunk:sub(pos[k], pos[k] + pos[k+1] - 1))
+  end
+end
+i:close()
+
+print"ex.lines() after reading with stdio"
+local name = os.tmpname()
+local f = assert(io.open(name, "w"))
+f:write("one\ntwo\nthree\n")
+f:close()
+f = assert(io.open(name))
+print("expect one", f:read"*l")
+for line in ex.lines(f) do io.write(line, " ") end
+print("(expect two three)")
+f:close()
+os.remove(name)
@@ -0,0 +1,12 @@
+#!/usr/bin/env lua
+require "ex"
+
+print"os.xargs()"
+local items = {}
+for i = 1, 200000 do items[i] = string.format("item-%06d", i) end
+local exitcode, statuses = assert(os.xargs({"true"}, items, {jobs = 4}))
+print("expect 0", exitcode, "batches:", #statuses)
+
+print"max_args"
+exitcode, statuses = assert(os.xargs("echo", {"a", "b", "c"}, {max_args = 2}))
+print("expect 0 2", exitcode, #statuses)
@@ -0,0 +1,37 @@
+#!/usr/bin/env lua
+require "ex"
+
+print"os.which()"
+print("expect a pathname", os.which("sh"))
+print("expect nil", os.which("no-such-command-here"))
+print("expect nil", os.which("sh", "/nonexistent"))
+print("expect /bin/sh", os.which("/bin/sh"))
+
+print"ex.pathcache()"
+assert(ex.pathcache(true, 0.1))
+local t = os.clock()
+for i = 1, 200 do assert(os.spawn("true")):wait() end
+print("cached spawns:", os.clock() - t)
+assert(ex.pathcache(false))
+t = os.clock()
+for i = 1, 200 do assert(os.spawn("true")):wait() end
+print("uncached spawns:", os.clock() - t)
+
+print"invalidation"
+local dir = os.tmpname()
+os.remove(dir)
+assert(os.mkdir(dir))
+local path = os.getenv("PATH")
+assert(os.setenv("PATH", dir .. ":" .. path))
+assert(ex.pathcache(true, 0))
+local before = os.which("true")
+local f = assert(io.open(dir .. "/true", "w"))
+f:write("#!/bin/sh\nexit 3\n")
+f:close()
+os.spawn("chmod", {args={"+x", dir .. "/true"}}):wait()
+print("expect " .. dir .. "/true", os.which("true"), "was", before)
+print("expect 3", os.spawn("true"):wait())
+os.remove(dir .. "/true")
+os.remove(dir)
+assert(os.setenv("PATH", path))
+ex.pathcache(false)
@@ -0,0 +1,37 @@
+#!/usr/bin/env lua
+require "ex"
+
+print"os.cpucount() and affinity"
+local n = os.cpucount()
+local cpus = assert(os.getaffinity())
+print("expect equal", n, #cpus)
+
+print"cpus"
+local proc = assert(os.spawn{"sh", "-c", "grep Cpus_allowed_list /proc/self/status",
+                             cpus = {cpus[1]}, stdout = "capture"})
+local out = proc:communicate()
+print("expect " .. cpus[1], out)
+
+print"nice, umask, rlimits"
+proc = assert(os.spawn{"sh", "-c", "echo $(nice) $(umask) $(ulimit -n)",
+                       nice = 5, umask = 18, rlimits = {nofile = 64},
+                       stdout = "capture"})
+print("expect 5 0022 64", (proc:communicate()))
+
+print"ioprio"
+proc = assert(os.spawn{"ionice", "-p", "0", ioprio = "idle", stdout = "capture"})
+print("expect idle", (proc:communicate()))
+
+print"setsid"
+proc = assert(os.spawn{"sleep", "5", setsid = true})
+print("expect true", proc:kill("TERM", true))
+print("expect 143", proc:wait())
+
+print"failure in the child"
+print("expect nil error", os.spawn{"true", nice = -20})
+print("expect nil error", os.spawn{"no-such-command", cpus = {cpus[1]}})
+
+print"os.setaffinity()"
+assert(os.setaffinity{cpus[1]})
+print("expect 1", os.cpucount())
+assert(os.setaffinity(cpus))
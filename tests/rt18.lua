@@ -0,0 +1,25 @@
+#!/usr/bin/env lua
+require "ex"
+
+print"proc:stats()"
+local proc = assert(os.spawn{"sh", "-c", "head -c 1000000 /dev/zero > /dev/null; sleep 1"})
+os.sleep(0.2)
+local s = assert(proc:stats())
+for _, k in ipairs{"pid", "ppid", "state", "utime", "stime", "threads",
+                   "rss", "vsize", "rchar", "wchar", "nvcsw"} do
+  print(k, s[k])
+end
+print("expect 1", s.threads)
+proc:wait()
+print("expect nil error", proc:stats())
+
+print"os.procstats()"
+local procs = {}
+for i = 1, 50 do procs[i] = assert(os.spawn{"sleep", "1"}) end
+local t = os.clock()
+local stats = os.procstats(procs)
+print("50 samples:", os.clock() - t)
+print("expect 50", #stats, stats[50].state)
+for i = 1, 50 do procs[i]:wait() end
+stats = os.procstats{procs[1], 1}
+print("expect false table", stats[1], stats[2])
@@ -0,0 +1,34 @@
+#!/usr/bin/env lua
+require "ex"
+
+local function zombies()
+  local proc = os.spawn{"sh", "-c", "ps -o stat= --ppid " .. ex.procstats({os.spawn"true"})[1].ppid,
+                        stdout = "capture"}
+  local out = proc:communicate() or ""
+  local n = 0
+  for _ in out:gmatch"Z" do n = n + 1 end
+  return n
+end
+
+print"collected procs are reaped"
+for i = 1, 100 do os.spawn{"sleep", "0.1"} end
+collectgarbage()
+os.sleep(0.5)
+print("expect 0", zombies())
+
+print"statuses are kept until waited for"
+local procs = {}
+for i = 1, 20 do procs[i] = assert(os.spawn{"sh", "-c", "exit " .. i}) end
+os.sleep(0.5)
+print("expect 0", zombies())
+local ok = true
+for i = 1, 20 do ok = ok and procs[i]:wait() == i end
+print("expect true", ok)
+print("expect nil error", procs[1]:kill())
+
+print"ex.autoreap(false)"
+print("expect true", ex.autoreap(false))
+for i = 1, 10 do os.spawn"true" end
+collectgarbage()
+os.sleep(0.5)
+print("expect false", ex.autoreap(true))
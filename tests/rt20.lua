@@ -0,0 +1,53 @@
+#!/usr/bin/env lua
+require "ex"
+
+local loop = assert(ex.loop())
+
+print"timers"
+local ticks = 0
+local t = loop:timer(0.01, 0.01, function(id, n)
+  ticks = ticks + n
+  if ticks >= 5 then loop:remove(id) end
+end)
+loop:timer(0.02, function(id, n) print("expect 1", n) end)
+print("expect n", loop:run(1), "ticks", ticks)
+
+print"files"
+local r, w = io.pipe()
+loop:file(r, "r", function(id, mode)
+  print("expect r", mode, r:read"*l")
+  loop:remove(id)
+end)
+loop:file(w, "w", function(id, mode)
+  w:write("hello\n") w:flush()
+  loop:remove(id)
+end)
+loop:run(1)
+
+print"processes and coroutines"
+local procs = {}
+for i = 1, 10 do procs[i] = assert(os.spawn{"sh", "-c", "sleep 0.1; exit " .. i}) end
+local sum = 0
+for i = 1, 10 do
+  local co = coroutine.create(function(id, exitcode, status)
+    sum = sum + exitcode
+  end)
+  loop:process(procs[i], co)
+end
+loop:run(5)
+print("expect 55", sum)
+
+print"signals"
+loop:signal("USR1", function(id, sig) print("expect 10", sig) loop:stop() end)
+os.spawn{"sh", "-c", "kill -USR1 $PPID"}
+loop:run(1)
+
+print"a watched signal stays deliverable to children"
+loop:signal("TERM", function() end)
+local p = assert(os.spawn{"sleep", "5"})
+p:kill("TERM")
+print("expect 143", p:wait(2))
+p = assert(os.spawn{"sleep", "5", setsid=true})
+p:kill("TERM")
+print("expect 143", p:wait(2))
+loop:close()
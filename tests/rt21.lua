@@ -0,0 +1,39 @@
+#!/usr/bin/env lua
+require "ex"
+
+print"os.sleep() and the monotonic clock"
+local t0, n0 = os.monotonic(), os.clock_ns()
+os.sleep(0.25)
+print("expect 0.25", os.monotonic() - t0, (os.clock_ns() - n0) / 1e9)
+os.sleep(250, 1000)
+print("expect 0.5", os.monotonic() - t0)
+
+print"ex.timers()"
+local timers = ex.timers(0.001)
+local ids = {}
+for i = 1, 100000 do ids[i] = timers:add(i % 100 / 1000, i) end
+print("expect 100000", timers:count())
+for i = 1, 100000, 2 do assert(timers:cancel(ids[i])) end
+print("expect false", timers:cancel(ids[1]))
+print("expect 50000", timers:count())
+local seen, last = 0, -1
+while timers:count() > 0 do
+  os.sleep(timers:next())
+  for _, v in ipairs(timers:expire()) do
+    assert(v % 2 == 0)
+    assert(v % 100 >= last or last == -1)
+    last = v % 100
+    seen = seen + 1
+  end
+end
+print("expect 50000", seen)
+print("expect nil", timers:next())
+
+print"far timers are never early"
+local start = os.monotonic()
+timers:add(0.3, "far")
+while true do
+  os.sleep(timers:next())
+  local v = timers:expire()
+  if v[1] then print("expect far >= 0.3", v[1], os.monotonic() - start) break end
+end
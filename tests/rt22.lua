@@ -0,0 +1,73 @@
+#!/usr/bin/env lua
+require "ex"
+
+print"ex.async outside a coroutine runs inline"
+local e = ex.async.stat("rt22.lua")
+print("expect file", e.type, e.size > 0)
+print("expect nil error", ex.async.stat("rt22.nonexistent"))
+
+print"ex.async in coroutines"
+local name = os.tmpname()
+local log = {}
+local function task(i)
+  return coroutine.wrap(function()
+    local f = assert(ex.async.open(name .. i, "w"))
+    assert(ex.async.write(f, ("x"):rep(i * 1000)))
+    assert(ex.async.fsync(f))
+    f:close()
+    local e = assert(ex.async.stat(name .. i))
+    log[#log + 1] = e.size
+    f = assert(ex.async.open(name .. i))
+    local data = ex.async.read(f, 100000)
+    f:close()
+    assert(#data == i * 1000)
+    assert(ex.async.remove(name .. i))
+  end)
+end
+for i = 1, 8 do task(i)() end
+print("expect >0", ex.async.pending())
+while ex.async.pending() > 0 do ex.async.run() end
+print("expect 8", #log)
+os.remove(name)
+
+print"ex.async.spawn"
+coroutine.wrap(function()
+  local proc = assert(ex.async.spawn{"sh", "-c", "exit 3", stdout="capture"})
+  print("expect 3", proc:wait())
+end)()
+ex.async.run()
+
+print"ex.async.dir"
+coroutine.wrap(function()
+  local names = assert(ex.async.dir("."))
+  local found
+  for _, n in ipairs(names) do found = found or n == "rt22.lua" end
+  print("expect true", found)
+end)()
+ex.async.run(1)
+
+print"ex.async.fd with ex.loop"
+local loop = ex.loop()
+coroutine.wrap(function()
+  print("expect directory", ex.async.stat(".").type)
+end)()
+local id = loop:file(ex.async.fd(), "r", function(id)
+  ex.async.run(0)
+  if ex.async.pending() == 0 then loop:remove(id) end
+end)
+loop:run(5)
+loop:close()
+
+print"ex.async.run with a coroutine which raises"
+local resumed, errors = 0, 0
+for i = 1, 3 do
+  coroutine.wrap(function()
+    ex.async.stat(".")
+    if i == 2 then error("raised") end
+    resumed = resumed + 1
+  end)()
+end
+while ex.async.pending() > 0 do
+  if not pcall(ex.async.run) then errors = errors + 1 end
+end
+print("expect 2 1", resumed, errors)
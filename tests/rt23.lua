@@ -0,0 +1,57 @@
+#!/usr/bin/env lua
+require "ex"
+
+for _, backend in ipairs{"auto", "threads"} do
+  local ring = assert(ex.ring(64, backend))
+  print(tostring(ring), "backend", ring:backend())
+
+  print"mkdir, stat and remove in batches"
+  local dir = os.tmpname()
+  os.remove(dir)
+  local ids = {}
+  ids[assert(ring:mkdir(dir))] = "mkdir"
+  print("expect 1", ring:submit())
+  print("expect 1", ring:wait())
+  for id, ok, err in ring:completions() do print("expect mkdir true", ids[id], ok, err) end
+  for i = 1, 50 do ids[assert(ring:mkdir(dir .. "/" .. i))] = i end
+  ring:wait(50)
+  local n = 0
+  for id, ok in ring:completions() do assert(ok and ids[id]); n = n + 1 end
+  print("expect 50", n)
+  for i = 1, 50 do ring:stat(dir .. "/" .. i) end
+  ring:stat(dir .. "/nonexistent")
+  ring:wait(51)
+  local dirs, missing = 0, 0
+  for id, e, err in ring:completions() do
+    if e then dirs = dirs + (e.type == "directory" and 1 or 0) else missing = missing + 1 end
+  end
+  print("expect 50 1", dirs, missing)
+
+  print"write, fsync, read and open"
+  local name = dir .. "/file"
+  local f = io.open(name, "w+")
+  ring:write(f, "hello ring\n", 0)
+  ring:wait()
+  ring:fsync(f)
+  ring:read(f, 100, 0)
+  ring:wait(2)
+  for id, v in ring:completions() do print("expect true or hello ring", v) end
+  f:close()
+  ring:open(name)
+  ring:wait()
+  for id, g in ring:completions() do print("expect hello ring", g:read"*l"); g:close() end
+
+  for i = 1, 50 do ring:remove(dir .. "/" .. i, true) end
+  ring:remove(name)
+  ring:wait(51)
+  n = 0
+  for id, ok in ring:completions() do assert(ok); n = n + 1 end
+  print("expect 51", n)
+  ring:remove(dir, true)
+  print("expect 1", ring:pending())
+  ring:wait()
+  for id, ok, err in ring:completions() do print("expect true", ok, err) end
+  print("expect 0", ring:pending())
+  ring:close()
+  print(tostring(ring))
+end
@@ -0,0 +1,57 @@
+#!/usr/bin/env lua
+require "ex"
+
+local dir = os.tmpname()
+os.remove(dir)
+assert(os.mkdir(dir))
+
+print"os.watch"
+local w = assert(os.watch(dir, {recursive=true, latency=0.05}))
+print(tostring(w), "fd", w:fd())
+print("expect table 0", type(w:read(0)), #w:read(0))
+
+local f = io.open(dir .. "/a", "w")
+f:write"x" f:flush() f:write"y" f:close()
+local seen = {}
+for _, e in ipairs(w:read(1)) do
+  print("", e.event, e.path, e.directory)
+  seen[e.event] = (seen[e.event] or 0) + 1
+end
+print("expect 1 1", seen.create, seen.modify)
+
+print"new subdirectories are watched"
+assert(os.mkdir(dir .. "/sub"))
+io.open(dir .. "/sub/b", "w"):close()
+for event, path, isdir in w:events(0.5) do print("", event, path, isdir) end
+io.open(dir .. "/sub/c", "w"):close()
+print("expect create", w:read(1)[1].event)
+
+print"removal"
+os.remove(dir .. "/sub/b")
+os.remove(dir .. "/sub/c")
+os.remove(dir .. "/sub")
+os.remove(dir .. "/a")
+for event, path in w:events(0.5) do print("", event, path) end
+
+print"events filter"
+local w2 = assert(os.watch({dir}, {events={"delete"}}))
+io.open(dir .. "/d", "w"):close()
+os.remove(dir .. "/d")
+local batch = w2:read(1)
+print("expect 1 delete", #batch, batch[1] and batch[1].event)
+w2:close()
+print(tostring(w2))
+
+print"ex.loop integration"
+local loop = ex.loop()
+loop:file(w:fd(), "r", function(id)
+  for _, e in ipairs(w:read(0)) do print("", e.event, e.path) end
+  loop:remove(id)
+end)
+io.open(dir .. "/e", "w"):close()
+loop:run(1)
+os.remove(dir .. "/e")
+
+print("expect nil error", os.watch(dir .. "/nonexistent"))
+w:close()
+os.remove(dir)
@@ -0,0 +1,61 @@
+#!/usr/bin/env lua
+require "ex"
+
+local name = os.tmpname()
+local function write(s) local f = io.open(name, "w") f:write(s) f:close() end
+write"x"
+
+print"ex.statcache"
+print("expect false", ex.statcache.stats().enabled)
+assert(ex.statcache.enable{entries=1024})
+for i = 1, 1000 do assert(os.dirent(name)) end
+local s = ex.statcache.stats()
+print("expect 999 1", s.hits, s.misses)
+
+print"inotify invalidation"
+write"xyz"
+os.sleep(0.05)
+print("expect 3", os.dirent(name).size)
+
+print"generation"
+assert(ex.statcache.enable{inotify=false})
+print("expect 3", os.dirent(name).size)
+write"xyzzy"
+print("expect 3 (stale)", os.dirent(name).size)
+ex.statcache.bump()
+print("expect 5", os.dirent(name).size)
+
+print"os.dirents"
+local entries = os.dirents{name, name .. ".nonexistent", "."}
+print("expect file false directory", entries[1].type, entries[2], entries[3].type)
+
+print"os.dir entries go through the cache"
+local dir = name:match"^(.*)/"
+local before = ex.statcache.stats().misses
+for e in os.dir(dir) do end
+for e in os.dir(dir) do end
+local after = ex.statcache.stats()
+print("misses once per entry", after.misses - before, after.hits)
+
+print"relative pathnames are not cached"
+before = ex.statcache.stats()
+os.dirent(".")
+os.dirent(".")
+after = ex.statcache.stats()
+print("expect 0 0", after.hits - before.hits, after.misses - before.misses)
+
+print"renaming the parent directory"
+assert(ex.statcache.enable{inotify=true})
+local parent = name .. ".d"
+assert(os.mkdir(parent))
+local f = io.open(parent .. "/f", "w") f:write"x" f:close()
+assert(os.dirent(parent .. "/f"))
+assert(os.rename(parent, parent .. ".x"))
+os.sleep(0.05)
+print("expect nil", os.dirent(parent .. "/f"))
+os.remove(parent .. ".x/f")
+os.remove(parent .. ".x")
+
+ex.statcache.disable()
+print("expect false", ex.statcache.stats().enabled)
+os.remove(name)
@@ -0,0 +1,30 @@
+#!/usr/bin/env lua
+require "ex"
+
+local name = os.tmpname()
+
+print"file:lock contention"
+local a, b = io.open(name, "w"), io.open(name, "r+")
+assert(a:lock("w"))
+print("expect nil", (b:lock("w")))
+print("expect nil timeout", b:lock("r", {timeout=0.3}))
+assert(a:unlock())
+print("expect file", b:lock("w", {timeout=1}))
+b:unlock()
+
+print"ex.lockfile"
+local lock = assert(ex.lockfile(name, {mode="r"}))
+print("expect 1", lock:count())
+print("expect true", rawequal(lock, ex.lockfile(name)))
+print("expect 2", lock:count())
+assert(a:lock("w", {wait=false}) == nil)
+lock:release()
+lock:release()
+print("expect 0", lock:count())
+print(lock)
+
+print"ex.lockstats"
+local s = ex.lockstats()[name]
+print("expect 2 nil", s.acquired, s.held)
+a:close() b:close()
+os.remove(name)
@@ -0,0 +1,45 @@
+#!/usr/bin/env lua
+require "ex"
+
+local lua = arg[-1] or "lua"
+
+print"ex.shm.ring"
+local ring = assert(ex.shm.ring(nil, 4096))
+print(ring)
+assert(ring:put"hello")
+print("expect hello", ring:get())
+print("expect nil timeout", ring:get(0.1))
+print("expect error", pcall(ring.put, ring, string.rep("x", 4096)))
+
+print"wrapping"
+for i = 1, 1000 do
+  assert(ring:put(string.rep("x", i % 300)))
+  assert(#ring:get() == i % 300)
+end
+
+print"full"
+local n = 0
+while ring:put(string.rep("y", 100), 0) do n = n + 1 end
+print("expect 39 or so", n)
+print("expect the same", #ring:drain())
+
+print"child producer"
+local proc = assert(os.spawn(lua, {args={"-e", [[
+  require "ex"
+  local ring = assert(ex.shm.ring(io.stdin))
+  for i = 1, 100000 do ring:put(tostring(i)) end
+]]}, stdin=ring:file()}))
+local ok = true
+for i = 1, 100000 do ok = ok and ring:get(5) == tostring(i) end
+print("expect true 0", ok, proc:wait())
+local s = ring:stats()
+print("expect 0 spsc", s.used, s.mode)
+ring:close()
+
+print"named mpmc"
+local name = "/ex-rt27-" .. os.time()
+local a = assert(ex.shm.ring(name, 4096, {mode="mpmc"}))
+local b = assert(ex.shm.ring(name))
+assert(a:put"shared")
+print("expect shared mpmc", b:get(), b:stats().mode)
+assert(ex.shm.unlink(name))
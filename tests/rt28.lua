@@ -0,0 +1,48 @@
+#!/usr/bin/env lua
+require "ex"
+
+local lua = arg[-1] or "lua"
+
+print"io.socketpair"
+local a, b = assert(io.socketpair())
+a:write"ping\n" a:flush()
+print("expect ping", b:read())
+b:write"pong\n" b:flush()
+print("expect pong", a:read())
+
+print"seqpacket"
+local a, b = assert(io.socketpair{type="seqpacket"})
+a:sendfds({}, "one") a:sendfds({}, "two")
+print("expect one two", (b:recvfds()), (b:recvfds()))
+
+print"passing a file"
+local name = os.tmpname()
+local f = io.open(name, "w")
+f:write"passed\n" f:close()
+f = io.open(name)
+assert(a:sendfds({f}, "file"))
+f:close()
+local data, files = b:recvfds()
+print("expect file 1 passed", data, #files, files[1]:read())
+os.remove(name)
+
+print"a persistent child"
+local parent, child = assert(io.socketpair{type="seqpacket"})
+local proc = assert(os.spawn(lua, {args={"-e", [[
+  require "ex"
+  while true do
+    local data, files = io.stdin:recvfds()
+    if not data or data == "quit" then break end
+    io.stdin:sendfds({}, files[1]:read"*a")
+  end
+]]}, stdin=child}))
+child:close()
+for i = 1, 3 do
+  local r, w = io.pipe()
+  w:write("task " .. i) w:close()
+  parent:sendfds({r}, "task")
+  r:close()
+  print("expect task " .. i, (parent:recvfds()))
+end
+parent:sendfds({}, "quit")
+print("expect 0", proc:wait())
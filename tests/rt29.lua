@@ -0,0 +1,41 @@
+#!/usr/bin/env lua
+require "ex"
+
+local lua = arg[-1] or "lua"
+
+print"ex.channel on a pipe"
+local r, w = io.pipe()
+local out, inp = ex.channel(nil, w), ex.channel(r, nil)
+assert(out:send"hello")
+assert(out:send{"binary\0\n\r", "", string.rep("x", 100000)})
+print("expect hello", inp:recv())
+print("expect 9 0 100000", #inp:recv(), #inp:recv(), #inp:recv())
+w:close()
+print("expect nil", inp:recv())
+
+print"batch"
+local r, w = io.pipe()
+local out, inp = ex.channel(nil, w), ex.channel(r, nil, {batch=true})
+local t = {}
+for i = 1, 1000 do t[i] = tostring(i) end
+assert(out:send(t))
+local n = 0
+while n < 1000 do n = n + #inp:recv() end
+print("expect 1000", n)
+
+print"a child through os.spawn"
+local down_r, down_w = io.pipe()
+local up_r, up_w = io.pipe()
+local proc = assert(os.spawn(lua, {args={"-e", [[
+  require "ex"
+  local ch = ex.channel(io.stdin, io.stdout)
+  for msg in ch.recv, ch do ch:send(msg:upper()) end
+]]}, stdin=down_r, stdout=up_w}))
+down_r:close() up_w:close()
+local ch = ex.channel(up_r, down_w)
+for i = 1, 3 do
+  ch:send("message " .. i)
+  print("expect MESSAGE " .. i, ch:recv())
+end
+down_w:close()
+print("expect nil 0", ch:recv(), proc:wait())
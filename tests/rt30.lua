@@ -0,0 +1,29 @@
+#!/usr/bin/env lua
+require "ex"
+
+print"os.expand"
+local env = {HOME="/home/x", EMPTY="", N=3}
+print("expect /home/x/bin", os.expand("$HOME/bin", env))
+print("expect [] [d] [] [e]", os.expand("[$UNSET] [${UNSET:-d}] [${EMPTY-d}] [${EMPTY:-e}]", env))
+print("expect [3+] []", os.expand("[${HOME:+$N+}] [${EMPTY:+x}]", env))
+print("expect $5 $", os.expand("$$5 $", env))
+print("expect nil missing", os.expand("${UNSET?missing}", env))
+print("expect nil UNSET: parameter not set", os.expand("${UNSET:?}", env))
+print("expect error", pcall(os.expand, "${HOME", env))
+os.setenv("EX_EXPAND", "live")
+print("expect live", os.expand("${EX_EXPAND}"))
+
+print"argv"
+local argv = os.expand({"ls", "$HOME", "${N}", stdin="$HOME"}, env)
+print("expect ls /home/x 3 $HOME", argv[1], argv[2], argv[3], argv.stdin)
+local opts = os.expand({args={"-l", "$HOME"}}, env)
+print("expect /home/x", opts.args[2])
+
+print"ex.template"
+local t = ex.template("${HOME}/${N:-0}")
+print(t)
+print("expect /home/x/3 /a/0", t(env), t:expand{HOME="/a"})
+local tv = ex.template{"echo", "$HOME", stdout=io.stdout}
+local v = tv(env)
+print("expect echo /home/x true", v[1], v[2], v.stdout == io.stdout)
+print("expect 0", os.spawn(tv(env)):wait())
@@ -0,0 +1,44 @@
+#!/usr/bin/env lua
+require "ex"
+
+print"os.setenv and os.getenv"
+print("expect true", os.setenv("EX_SNAP", "one"))
+print("expect one", os.getenv("EX_SNAP"))
+os.setenv("EX_SNAP", "two")
+print("expect two two", os.getenv("EX_SNAP"), os.environ().EX_SNAP)
+print("expect nil", os.setenv("EX=SNAP", "x"))
+os.setenv("EX_SNAP", nil)
+print("expect nil nil", os.getenv("EX_SNAP"), os.environ().EX_SNAP)
+
+print"children"
+os.setenv("EX_SNAP", "child")
+local p = os.spawn{"sh", "-c", 'test "$EX_SNAP" = child'}
+print("expect 0", p:wait())
+local f = io.popen("echo $EX_SNAP")
+print("expect child", f:read"*l")
+f:close()
+print("expect child", os.expand("$EX_SNAP"))
+
+print"many values"
+for i = 1, 1000 do os.setenv("EX_SNAP" .. i, tostring(i)) end
+local ok = true
+for i = 1, 1000 do ok = ok and os.getenv("EX_SNAP" .. i) == tostring(i) end
+print("expect true", ok)
+for i = 1, 1000 do os.setenv("EX_SNAP" .. i, nil) end
+print("expect nil", os.environ().EX_SNAP1000)
+
+print"threads"
+-- async workers launch processes while this thread replaces the environment
+local ok = 0
+for i = 1, 50 do
+  os.setenv("EX_SNAP_T", tostring(i))
+  coroutine.wrap(function()
+    local p = assert(ex.async.spawn{"sh", "-c", 'test "$EX_SNAP_T" = ' .. i})
+    if p:wait() == 0 then ok = ok + 1 end
+  end)()
+  os.setenv("EX_SNAP_T", "changed")
+  os.setenv("PATH", os.getenv("PATH"))
+end
+while ex.async.pending() > 0 do ex.async.run() end
+print("expect 50", ok)
+os.setenv("EX_SNAP_T", nil)
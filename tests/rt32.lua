@@ -0,0 +1,36 @@
+#!/usr/bin/env lua
+require "ex"
+
+local root = os.tmpname()
+os.remove(root)
+assert(os.mkdir(root))
+assert(os.mkdir(root .. "/sub"))
+local function write(name, size)
+  local f = assert(io.open(root .. "/" .. name, "w"))
+  f:write(string.rep("x", size))
+  f:close()
+end
+write("a.txt", 1000)
+write("b.txt", 3000)
+write("sub/c.dat", 5000)
+os.execute("ln " .. root .. "/sub/c.dat " .. root .. "/sub/d.dat")
+
+print"os.du"
+local s = assert(os.du(root, {apparent=true}))
+print("expect 3 2 0", s.files, s.dirs, s.errors)
+print("expect true", s.bytes >= 9000)
+print("expect true", os.du(root).bytes >= 8192)
+
+print"by"
+local d = os.du(root, {by="dir", apparent=true})
+print("expect 3 2", d.groups[root].files, d.groups[root].dirs)
+print("expect 1", d.groups[root .. "/sub"].files)
+local e = os.du(root, {by="ext", apparent=true, threads=2})
+print("expect 4000 2 5000 1", e.groups.txt.bytes, e.groups.txt.files,
+      e.groups.dat.bytes, e.groups.dat.files)
+local o = os.du(root, {by="owner"})
+for uid, sum in pairs(o.groups) do print("uid", uid, sum.files, sum.dirs) end
+print("expect error", pcall(os.du, root, {by="size"}))
+print("expect nil", os.du(root .. "/missing"))
+
+os.execute("rm -r " .. root)
@@ -0,0 +1,17 @@
+#!/usr/bin/env lua
+require "ex"
+
+print"proc:poll()"
+local slow = assert(os.spawn{"sleep", "2"})
+local fast = assert(os.spawn{"true"})
+print("expect false", slow:poll())
+
+print"proc:wait(timeout)"
+print("expect nil timeout", slow:wait(0.1))
+
+print"os.waitany()"
+local proc, status = assert(os.waitany({slow, fast}, 1))
+print("expect", fast, 0)
+print("got", proc, status)
+print("expect", slow, 0)
+print("got", assert(os.waitany({slow})))
@@ -0,0 +1,14 @@
+#!/usr/bin/env lua
+require "ex"
+
+print"proc:kill()"
+local proc = assert(os.spawn{"sleep", "10", pgid=true})
+assert(proc:kill("TERM", true))
+local exitcode, status = assert(proc:wait())
+print("expect 143 15", exitcode, status.signal)
+
+print"status record"
+proc = assert(os.spawn{"sh", "-c", "exit 3"})
+exitcode, status = assert(proc:wait())
+print("expect 3", status.exitcode)
+for k, v in pairs(status) do print(k, v) end